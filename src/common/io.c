@@ -16,3 +16,25 @@ uint16 inw(uint16 port) {
   asm volatile ("inw %1, %0" : "=a" (ret) : "dN" (port));
   return ret;
 }
+
+void outw(uint16 port, uint16 value) {
+  asm volatile ("outw %1, %0" : : "dN" (port), "a" (value));
+}
+
+uint32 inl(uint16 port) {
+  uint32 ret;
+  asm volatile ("inl %1, %0" : "=a" (ret) : "dN" (port));
+  return ret;
+}
+
+void outl(uint16 port, uint32 value) {
+  asm volatile ("outl %1, %0" : : "dN" (port), "a" (value));
+}
+
+void insw(uint16 port, void* buffer, uint32 count) {
+  asm volatile ("cld; rep insw" : "+D" (buffer), "+c" (count) : "d" (port) : "memory");
+}
+
+void outsw(uint16 port, void* buffer, uint32 count) {
+  asm volatile ("cld; rep outsw" : "+S" (buffer), "+c" (count) : "d" (port) : "memory");
+}
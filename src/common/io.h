@@ -6,5 +6,14 @@
 void outb(uint16 port, uint8 value);
 uint8 inb(uint16 port);
 uint16 inw(uint16 port);
+void outw(uint16 port, uint16 value);
+uint32 inl(uint16 port);
+void outl(uint16 port, uint32 value);
+
+// Read count words from port into buffer.
+void insw(uint16 port, void* buffer, uint32 count);
+
+// Write count words from buffer to port.
+void outsw(uint16 port, void* buffer, uint32 count);
 
 #endif
@@ -0,0 +1,210 @@
+#include "driver/block_queue.h"
+#include "driver/hard_disk.h"
+#include "common/stdlib.h"
+#include "interrupt/timer.h"
+#include "mem/kheap.h"
+#include "monitor/monitor.h"
+#include "sync/yieldlock.h"
+#include "task/scheduler.h"
+#include "utils/math.h"
+
+static rb_tree_t pending_requests;
+static bool dispatching;
+// Sector after the last dispatched read - C-LOOK sweeps upward from here.
+static uint32 head_position;
+
+static block_queue_stats_t stats;
+
+// Waiters of block_queue_read, woken by its completion callback.
+static linked_list_t waiting_threads;
+
+static yieldlock_t block_queue_lock;
+
+static int32 compare_request(rb_node_t* x, rb_node_t* y) {
+  uint32 sector1 = rb_entry(x, block_request_t, rb_node)->sector;
+  uint32 sector2 = rb_entry(y, block_request_t, rb_node)->sector;
+  return sector1 < sector2 ? -1 : (sector1 == sector2 ? 0 : 1);
+}
+
+void init_block_queue() {
+  rb_tree_init(&pending_requests, compare_request);
+  dispatching = false;
+  head_position = 0;
+  memset(&stats, 0, sizeof(stats));
+  linked_list_init(&waiting_threads);
+  yieldlock_init(&block_queue_lock);
+}
+
+// C-LOOK: the first request at or above head position, wrapping to the lowest one.
+static block_request_t* pick_next_request() {
+  rb_node_t* node = pending_requests.root;
+  rb_node_t* candidate = nullptr;
+  while (node != nullptr) {
+    if (rb_entry(node, block_request_t, rb_node)->sector >= head_position) {
+      candidate = node;
+      node = node->left;
+    } else {
+      node = node->right;
+    }
+  }
+  if (candidate == nullptr) {
+    candidate = rb_tree_first(&pending_requests);
+  }
+  return candidate == nullptr ? nullptr : rb_entry(candidate, block_request_t, rb_node);
+}
+
+// Take first request and all following ones contiguous to it, up to merge limit. They are
+// removed from the queue and returned in an array. Caller holds the lock.
+static uint32 take_batch(block_request_t** batch, uint32 batch_max) {
+  block_request_t* first = pick_next_request();
+  if (first == nullptr) {
+    return 0;
+  }
+  uint32 num = 0;
+  uint32 end_sector = first->sector;
+  uint32 sector_num = 0;
+  rb_node_t* node = &first->rb_node;
+  while (node != nullptr && num < batch_max) {
+    block_request_t* request = rb_entry(node, block_request_t, rb_node);
+    if (request->sector != end_sector ||
+        sector_num + request->sector_num > BLOCK_QUEUE_MERGE_SECTORS_MAX) {
+      break;
+    }
+    batch[num++] = request;
+    end_sector += request->sector_num;
+    sector_num += request->sector_num;
+    node = rb_tree_next(node);
+  }
+  // A single request larger than merge limit goes alone.
+  if (num == 0) {
+    batch[num++] = first;
+  }
+  for (uint32 i = 0; i < num; i++) {
+    rb_tree_remove(&pending_requests, &batch[i]->rb_node);
+  }
+  return num;
+}
+
+static void serve_batch(block_request_t** batch, uint32 num) {
+  block_request_t* first = batch[0];
+  int32 result;
+  if (num == 1) {
+    result = read_hard_disk_sectors(first->buffer, first->sector, first->sector_num);
+  } else {
+    uint32 sector_num = 0;
+    for (uint32 i = 0; i < num; i++) {
+      sector_num += batch[i]->sector_num;
+    }
+    char* buffer = (char*)kmalloc(sector_num * SECTOR_SIZE);
+    result = read_hard_disk_sectors(buffer, first->sector, sector_num);
+    char* data = buffer;
+    for (uint32 i = 0; i < num && result == 0; i++) {
+      memcpy(batch[i]->buffer, data, batch[i]->sector_num * SECTOR_SIZE);
+      data += batch[i]->sector_num * SECTOR_SIZE;
+    }
+    kfree(buffer);
+  }
+
+  uint32 crt_tick = getTick();
+  yieldlock_lock(&block_queue_lock);
+  block_request_t* last = batch[num - 1];
+  head_position = last->sector + last->sector_num;
+  stats.dispatched++;
+  stats.merged += num - 1;
+  stats.depth -= num;
+  // Requests must not be touched after this, as their owners may go on once done is set.
+  for (uint32 i = 0; i < num; i++) {
+    stats.service_ticks += crt_tick - batch[i]->submit_tick;
+    batch[i]->result = result;
+    batch[i]->done = true;
+    if (batch[i]->on_complete != nullptr) {
+      batch[i]->on_complete(batch[i]);
+    }
+  }
+  yieldlock_unlock(&block_queue_lock);
+}
+
+void block_queue_submit(block_request_t* request) {
+  request->done = false;
+  request->submit_tick = getTick();
+
+  yieldlock_lock(&block_queue_lock);
+  rb_tree_insert(&pending_requests, &request->rb_node);
+  stats.submitted++;
+  stats.depth++;
+  stats.max_depth = max(stats.max_depth, stats.depth);
+  if (dispatching) {
+    yieldlock_unlock(&block_queue_lock);
+    return;
+  }
+
+  // Become the dispatcher.
+  dispatching = true;
+  block_request_t* batch[BLOCK_QUEUE_BATCH_MAX];
+  while (true) {
+    uint32 num = take_batch(batch, BLOCK_QUEUE_BATCH_MAX);
+    if (num == 0) {
+      break;
+    }
+    yieldlock_unlock(&block_queue_lock);
+    serve_batch(batch, num);
+    yieldlock_lock(&block_queue_lock);
+  }
+  dispatching = false;
+  yieldlock_unlock(&block_queue_lock);
+}
+
+static void wake_up_waiter(block_request_t* request) {
+  thread_node_t* node = (thread_node_t*)request->private_data;
+  if (node != nullptr) {
+    linked_list_remove(&waiting_threads, node);
+    request->private_data = nullptr;
+    add_thread_node_to_schedule(node);
+  }
+}
+
+int32 block_queue_read(char* buffer, uint32 sector, uint32 sector_num) {
+  if (sector_num == 0) {
+    return 0;
+  }
+  // Without blocking we can not wait for another dispatcher - read directly.
+  if (!disk_io_can_block()) {
+    return read_hard_disk_sectors(buffer, sector, sector_num);
+  }
+
+  block_request_t request;
+  request.sector = sector;
+  request.sector_num = sector_num;
+  request.buffer = buffer;
+  request.on_complete = wake_up_waiter;
+  request.private_data = nullptr;
+  block_queue_submit(&request);
+
+  // Served by another dispatcher - wait for it.
+  yieldlock_lock(&block_queue_lock);
+  while (!request.done) {
+    thread_node_t* node = get_crt_thread_node();
+    request.private_data = node;
+    linked_list_append(&waiting_threads, node);
+    schedule_mark_thread_block();
+    yieldlock_unlock(&block_queue_lock);
+    schedule_thread_yield();
+    yieldlock_lock(&block_queue_lock);
+  }
+  yieldlock_unlock(&block_queue_lock);
+  return request.result;
+}
+
+block_queue_stats_t block_queue_get_stats() {
+  yieldlock_lock(&block_queue_lock);
+  block_queue_stats_t result = stats;
+  yieldlock_unlock(&block_queue_lock);
+  return result;
+}
+
+void block_queue_print_stats() {
+  block_queue_stats_t s = block_queue_get_stats();
+  monitor_printf("block queue: %d submitted, %d dispatched, %d merged, depth %d (max %d), ",
+                 s.submitted, s.dispatched, s.merged, s.depth, s.max_depth);
+  monitor_printf("%d service ticks\n", s.service_ticks);
+}
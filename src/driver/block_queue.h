@@ -0,0 +1,59 @@
+#ifndef DRIVER_BLOCK_QUEUE_H
+#define DRIVER_BLOCK_QUEUE_H
+
+#include "common/common.h"
+#include "utils/linked_list.h"
+#include "utils/rb_tree.h"
+
+// Adjacent requests are merged into one disk read up to this many sectors.
+#define BLOCK_QUEUE_MERGE_SECTORS_MAX  256
+#define BLOCK_QUEUE_BATCH_MAX          32
+
+struct block_request;
+typedef void (*block_request_callback_t)(struct block_request* request);
+
+// A read of whole sectors into a kernel buffer. Owned by the submitter until completion.
+struct block_request {
+  uint32 sector;
+  uint32 sector_num;
+  char* buffer;
+
+  // Called by the dispatching thread when data is ready, with queue lock held - it must not
+  // block or submit requests.
+  block_request_callback_t on_complete;
+  void* private_data;
+  volatile bool done;
+  // 0 on success, -1 if the disk read failed; valid once done
+  int32 result;
+
+  uint32 submit_tick;
+  // pending requests are sorted by sector
+  rb_node_t rb_node;
+};
+typedef struct block_request block_request_t;
+
+struct block_queue_stats {
+  uint32 submitted;
+  uint32 dispatched;  // disk reads issued, after merging
+  uint32 merged;      // requests which joined another one's disk read
+  uint32 depth;
+  uint32 max_depth;
+  uint32 service_ticks;  // total ticks from submit to completion
+};
+typedef struct block_queue_stats block_queue_stats_t;
+
+
+// ****************************************************************************
+void init_block_queue();
+
+// Queue a request. If no thread is dispatching, the caller becomes the dispatcher and serves
+// requests - including others' which arrive meanwhile - until the queue drains.
+void block_queue_submit(block_request_t* request);
+
+// Synchronously read sectors through the queue. Return 0 on success, or -1 on disk error.
+int32 block_queue_read(char* buffer, uint32 sector, uint32 sector_num);
+
+block_queue_stats_t block_queue_get_stats();
+void block_queue_print_stats();
+
+#endif
@@ -1,43 +1,406 @@
 #include "driver/hard_disk.h"
+#include "driver/block_queue.h"
+#include "driver/pci.h"
+#include "driver/virtio_blk.h"
 #include "mem/kheap.h"
+#include "mem/paging.h"
 #include "monitor/monitor.h"
+#include "common/io.h"
 #include "common/stdlib.h"
 #include "utils/math.h"
 #include "interrupt/interrupt.h"
+#include "sync/spinlock.h"
+#include "sync/yieldlock.h"
+#include "task/scheduler.h"
 
-static void disk_interrupt_handler() {}
+// Primary ATA channel.
+#define ATA_PORT_DATA          0x1F0
+#define ATA_PORT_SECTOR_COUNT  0x1F2
+#define ATA_PORT_LBA_LOW       0x1F3
+#define ATA_PORT_LBA_MID       0x1F4
+#define ATA_PORT_LBA_HIGH      0x1F5
+#define ATA_PORT_DEVICE        0x1F6
+#define ATA_PORT_STATUS        0x1F7
+#define ATA_PORT_COMMAND       0x1F7
+#define ATA_PORT_CONTROL       0x3F6  // alternate status on read
+
+#define ATA_STATUS_ERR   0x01
+#define ATA_STATUS_DRQ   0x08
+#define ATA_STATUS_BSY   0x80
+
+#define ATA_DEVICE_LBA     0xE0
+#define ATA_CMD_READ       0x20
+#define ATA_CMD_READ_DMA   0xC8
+#define ATA_CMD_WRITE      0x30
+#define ATA_CMD_FLUSH      0xE7
+
+// Bus master IDE registers of primary channel, relative to BAR4.
+#define BM_REG_COMMAND     0x0
+#define BM_REG_STATUS      0x2
+#define BM_REG_PRDT        0x4
+
+#define BM_CMD_START       0x1
+#define BM_CMD_READ        0x8  // device to memory
+#define BM_STATUS_ACTIVE   0x1
+#define BM_STATUS_ERROR    0x2
+#define BM_STATUS_IRQ      0x4
+
+// Physical region descriptor - a physically contiguous buffer which must not cross a 64KB
+// boundary. Byte count 0 means 64KB.
+struct prd {
+  uint32 phy_addr;
+  uint16 byte_count;
+  uint16 flags;
+} __attribute__((packed));
+typedef struct prd prd_t;
+
+#define PRD_FLAG_EOT       0x8000
+#define PRD_ENTRIES_MAX    (PAGE_SIZE / sizeof(prd_t))
+#define PRD_REGION_MAX     0x10000
+
+// Reads into a buffer which can not be DMA'ed directly go through this buffer.
+#define DMA_BOUNCE_BUFFER_SIZE  (64 * 1024)
+
+extern uint32 get_eflags();
+
+static disk_backend_t* disk_backend;
+
+// One request is outstanding on the ATA channel at a time.
+static yieldlock_t disk_lock;
+
+// Set by IRQ14 when a sector is ready, consumed by the thread doing the transfer.
+static spinlock_t disk_irq_lock;
+static volatile bool disk_irq_received;
+static thread_node_t* disk_waiting_thread_node;
+
+static void disk_interrupt_handler() {
+  // Reading status acknowledges the interrupt.
+  inb(ATA_PORT_STATUS);
+
+  spinlock_lock(&disk_irq_lock);
+  disk_irq_received = true;
+  thread_node_t* node = disk_waiting_thread_node;
+  disk_waiting_thread_node = nullptr;
+  spinlock_unlock(&disk_irq_lock);
+
+  if (node != nullptr) {
+    add_thread_node_to_schedule_head(node);
+    get_crt_thread()->need_reschedule = true;
+  }
+}
+
+static void secondary_disk_interrupt_handler() {}
+
+// Bus master DMA state, protected by disk_lock.
+static bool dma_enabled;
+static uint16 bm_base;
+static prd_t* prd_table;
+static uint32 prd_table_phy;
+static char* dma_bounce_buffer;
+
+static void init_dma() {
+  dma_enabled = false;
+
+  pci_device_t ide;
+  if (!pci_find_device_by_class(PCI_CLASS_STORAGE, PCI_SUBCLASS_IDE, &ide)) {
+    monitor_printf("no PCI IDE controller, disk DMA disabled\n");
+    return;
+  }
+  // BAR4 is the bus master I/O base; bit 0 is set for I/O space.
+  uint32 bar4 = pci_config_read32(&ide, PCI_BAR4);
+  if (!(bar4 & 0x1) || (bar4 & 0xFFFC) == 0) {
+    monitor_printf("IDE controller has no bus master, disk DMA disabled\n");
+    return;
+  }
+  bm_base = bar4 & 0xFFFC;
+  pci_enable_bus_master(&ide);
+
+  // Touch the buffers so that they are backed by frames before their physical addresses are
+  // taken. A page-aligned PRD table never crosses 64KB.
+  prd_table = (prd_t*)kmalloc_aligned(PAGE_SIZE);
+  memset(prd_table, 0, PAGE_SIZE);
+  prd_table_phy = get_phy_addr((uint32)prd_table);
+  dma_bounce_buffer = (char*)kmalloc_aligned(DMA_BOUNCE_BUFFER_SIZE);
+  memset(dma_bounce_buffer, 0, DMA_BOUNCE_BUFFER_SIZE);
+
+  dma_enabled = true;
+}
+
+static int32 ata_read_sectors(char* buffer, uint32 sector, uint32 sector_num);
+static int32 ata_write_sectors(char* buffer, uint32 sector, uint32 sector_num);
+
+static disk_backend_t ata_backend = {
+  .name = "ata",
+  .sectors_per_request_max = ATA_SECTORS_PER_REQUEST_MAX,
+  .read_sectors = ata_read_sectors,
+  .write_sectors = ata_write_sectors,
+};
+
+static void init_ata() {
+  yieldlock_init(&disk_lock);
+  spinlock_init(&disk_irq_lock);
+  disk_irq_received = false;
+  disk_waiting_thread_node = nullptr;
 
-void init_hard_disk() {
-  // Ignore disk interrupt.
   register_interrupt_handler(IRQ14_INT_NUM, &disk_interrupt_handler);
-  register_interrupt_handler(IRQ15_INT_NUM, &disk_interrupt_handler);
+  register_interrupt_handler(IRQ15_INT_NUM, &secondary_disk_interrupt_handler);
+
+  // Enable interrupts from the drive (nIEN = 0).
+  outb(ATA_PORT_CONTROL, 0);
+
+  init_dma();
 }
 
-extern void read_disk(char* buffer, uint32 start_sector, uint32 sector_num);
+void init_hard_disk() {
+  disk_backend = init_virtio_blk();
+  if (disk_backend == nullptr) {
+    init_ata();
+    disk_backend = &ata_backend;
+  }
+  monitor_printf("disk backend: %s\n", disk_backend->name);
 
-static void read_sector(char* buffer, uint32 sector) {
-  read_disk(buffer, sector, 1);
+  init_block_queue();
 }
 
-void read_hard_disk(char* buffer, uint32 start, uint32 length) {
-  uint32 end = start + length;
+disk_backend_t* get_disk_backend() {
+  return disk_backend;
+}
+
+// Blocking is only possible in a thread with interrupts on - otherwise the completion interrupt
+// never comes and nobody wakes us up, e.g. during boot before multi-task is enabled, in an irq
+// handler, or with a spinlock held with irqsave. Exception handlers like page fault run with
+// interrupts re-enabled by isr_handler, so they do block here.
+bool disk_io_can_block() {
+  return multi_task_is_enabled() && (get_eflags() & (1 << 9));
+}
 
-  uint32 start_sector = start / SECTOR_SIZE;
-  uint32 end_sector = (end - 1) / SECTOR_SIZE + 1;
+static void wait_for_irq() {
+  spinlock_lock_irqsave(&disk_irq_lock);
+  while (!disk_irq_received) {
+    disk_waiting_thread_node = get_crt_thread_node();
+    schedule_mark_thread_block();
+    spinlock_unlock_irqrestore(&disk_irq_lock);
+    schedule_thread_yield();
 
-  // Do NOT allocate buffer on kernel stack!
-  char* sector_buffer = (char*)kmalloc(SECTOR_SIZE);
+    spinlock_lock_irqsave(&disk_irq_lock);
+  }
+  disk_irq_received = false;
+  spinlock_unlock_irqrestore(&disk_irq_lock);
+}
 
-  for (uint32 i = start_sector; i < end_sector; i++) {
-    read_sector(sector_buffer, i);
+// Status is not valid until 400ns after a command; each alternate status read takes ~100ns.
+static void ata_delay_400ns() {
+  for (uint32 i = 0; i < 4; i++) {
+    inb(ATA_PORT_CONTROL);
+  }
+}
 
-    uint32 copy_start_addr = max(i * SECTOR_SIZE, start);
-    uint32 copy_end_addr = min((i + 1) * SECTOR_SIZE, end);
-    uint32 copy_size = copy_end_addr - copy_start_addr;
-    memcpy(buffer, sector_buffer + copy_start_addr - i * SECTOR_SIZE, copy_size);
-    buffer += (copy_size);
+static bool wait_for_data(bool use_irq) {
+  if (use_irq) {
+    wait_for_irq();
   }
+  uint8 status;
+  do {
+    status = inb(ATA_PORT_STATUS);
+  } while ((status & ATA_STATUS_BSY) ||
+           !(status & (ATA_STATUS_DRQ | ATA_STATUS_ERR)));
+  return (status & ATA_STATUS_ERR) == 0;
+}
+
+static void reset_irq() {
+  spinlock_lock_irqsave(&disk_irq_lock);
+  disk_irq_received = false;
+  spinlock_unlock_irqrestore(&disk_irq_lock);
+}
 
-  kfree(sector_buffer);
+static void issue_command(uint8 command, uint32 sector, uint32 sector_num) {
+  // Sector count 0 means 256.
+  outb(ATA_PORT_SECTOR_COUNT, (uint8)sector_num);
+  outb(ATA_PORT_LBA_LOW, sector & 0xFF);
+  outb(ATA_PORT_LBA_MID, (sector >> 8) & 0xFF);
+  outb(ATA_PORT_LBA_HIGH, (sector >> 16) & 0xFF);
+  outb(ATA_PORT_DEVICE, ATA_DEVICE_LBA | ((sector >> 24) & 0x0F));
+  outb(ATA_PORT_COMMAND, command);
+  ata_delay_400ns();
 }
 
+// Describe buffer with PRD table. It fails if any page of buffer is not mapped.
+static bool build_prd_table(char* buffer, uint32 length) {
+  uint32 entries_num = 0;
+  prd_t* last = nullptr;
+  uint32 addr = (uint32)buffer;
+  uint32 end = addr + length;
+  while (addr < end) {
+    uint32 piece_end = min((addr / PAGE_SIZE + 1) * PAGE_SIZE, end);
+    int32 phy_addr = get_phy_addr(addr);
+    if (phy_addr < 0) {
+      return false;
+    }
+    uint32 piece_size = piece_end - addr;
+
+    // Extend last region if physically contiguous, and it stays within one 64KB region.
+    uint32 last_size = (last == nullptr || last->byte_count == 0) ?
+        PRD_REGION_MAX : last->byte_count;
+    if (last != nullptr && last->phy_addr + last_size == (uint32)phy_addr &&
+        last->phy_addr / PRD_REGION_MAX == (phy_addr + piece_size - 1) / PRD_REGION_MAX) {
+      last->byte_count = (uint16)(last_size + piece_size);
+    } else {
+      if (entries_num == PRD_ENTRIES_MAX) {
+        return false;
+      }
+      last = prd_table + entries_num++;
+      last->phy_addr = phy_addr;
+      last->byte_count = (uint16)piece_size;
+      last->flags = 0;
+    }
+    addr = piece_end;
+  }
+  if (last == nullptr) {
+    return false;
+  }
+  last->flags = PRD_FLAG_EOT;
+  return true;
+}
+
+// Read sectors by DMA into a kernel buffer, and block until IRQ14 signals completion.
+static bool dma_read_sectors(char* buffer, uint32 sector, uint32 sector_num) {
+  if (!build_prd_table(buffer, sector_num * SECTOR_SIZE)) {
+    return false;
+  }
+
+  outl(bm_base + BM_REG_PRDT, prd_table_phy);
+  outb(bm_base + BM_REG_COMMAND, BM_CMD_READ);
+  // Error and interrupt bits are cleared by writing 1.
+  outb(bm_base + BM_REG_STATUS, BM_STATUS_ERROR | BM_STATUS_IRQ);
+
+  reset_irq();
+  issue_command(ATA_CMD_READ_DMA, sector, sector_num);
+  outb(bm_base + BM_REG_COMMAND, BM_CMD_READ | BM_CMD_START);
+
+  wait_for_irq();
+
+  outb(bm_base + BM_REG_COMMAND, 0);
+  uint8 bm_status = inb(bm_base + BM_REG_STATUS);
+  uint8 status = inb(ATA_PORT_STATUS);
+  outb(bm_base + BM_REG_STATUS, BM_STATUS_ERROR | BM_STATUS_IRQ);
+
+  if ((bm_status & BM_STATUS_ERROR) || (status & ATA_STATUS_ERR)) {
+    monitor_printf("disk DMA error on sector %d, bm status %x\n", sector, bm_status);
+    return false;
+  }
+  return true;
+}
+
+// Read up to ATA_SECTORS_PER_REQUEST_MAX sectors by PIO, straight into buffer.
+static int32 pio_read_sectors(char* buffer, uint32 sector, uint32 sector_num) {
+  bool use_irq = disk_io_can_block();
+
+  reset_irq();
+  issue_command(ATA_CMD_READ, sector, sector_num);
+
+  // The drive raises an interrupt as each sector becomes ready.
+  for (uint32 i = 0; i < sector_num; i++) {
+    if (!wait_for_data(use_irq)) {
+      monitor_printf("disk read error on sector %d\n", sector + i);
+      return -1;
+    }
+    insw(ATA_PORT_DATA, buffer, SECTOR_SIZE / 2);
+    buffer += SECTOR_SIZE;
+  }
+  return 0;
+}
+
+// DMA needs IRQ completion. User pages are never DMA'ed directly, as they may be copy-on-write
+// shared, so they go through the bounce buffer.
+static int32 ata_read_sectors_locked(char* buffer, uint32 sector, uint32 sector_num) {
+  if (!dma_enabled || !disk_io_can_block()) {
+    return pio_read_sectors(buffer, sector, sector_num);
+  }
+
+  if ((uint32)buffer >= 0xC0000000 && ((uint32)buffer & 1) == 0 &&
+      dma_read_sectors(buffer, sector, sector_num)) {
+    return 0;
+  }
+
+  while (sector_num > 0) {
+    uint32 num = min(sector_num, DMA_BOUNCE_BUFFER_SIZE / SECTOR_SIZE);
+    if (dma_read_sectors(dma_bounce_buffer, sector, num)) {
+      memcpy(buffer, dma_bounce_buffer, num * SECTOR_SIZE);
+    } else if (pio_read_sectors(buffer, sector, num) != 0) {
+      return -1;
+    }
+    buffer += num * SECTOR_SIZE;
+    sector += num;
+    sector_num -= num;
+  }
+  return 0;
+}
+
+static int32 ata_read_sectors(char* buffer, uint32 sector, uint32 sector_num) {
+  yieldlock_lock(&disk_lock);
+  int32 result = ata_read_sectors_locked(buffer, sector, sector_num);
+  yieldlock_unlock(&disk_lock);
+  return result;
+}
+
+static void wait_not_busy() {
+  while (inb(ATA_PORT_STATUS) & ATA_STATUS_BSY) {}
+}
+
+// Writes are done by polling PIO - the drive asks for each sector as soon as it has taken the
+// previous one, and the cache is flushed at the end, so that written data is durable.
+static int32 pio_write_sectors(char* buffer, uint32 sector, uint32 sector_num) {
+  reset_irq();
+  issue_command(ATA_CMD_WRITE, sector, sector_num);
+  for (uint32 i = 0; i < sector_num; i++) {
+    if (!wait_for_data(false)) {
+      monitor_printf("disk write error on sector %d\n", sector + i);
+      return -1;
+    }
+    outsw(ATA_PORT_DATA, buffer, SECTOR_SIZE / 2);
+    buffer += SECTOR_SIZE;
+  }
+  wait_not_busy();
+
+  outb(ATA_PORT_COMMAND, ATA_CMD_FLUSH);
+  ata_delay_400ns();
+  wait_not_busy();
+  if (inb(ATA_PORT_STATUS) & ATA_STATUS_ERR) {
+    monitor_printf("disk flush error after sector %d\n", sector);
+    return -1;
+  }
+  return 0;
+}
+
+static int32 ata_write_sectors(char* buffer, uint32 sector, uint32 sector_num) {
+  yieldlock_lock(&disk_lock);
+  int32 result = pio_write_sectors(buffer, sector, sector_num);
+  yieldlock_unlock(&disk_lock);
+  return result;
+}
+
+int32 read_hard_disk_sectors(char* buffer, uint32 sector, uint32 sector_num) {
+  while (sector_num > 0) {
+    uint32 num = min(sector_num, disk_backend->sectors_per_request_max);
+    if (disk_backend->read_sectors(buffer, sector, num) != 0) {
+      return -1;
+    }
+    buffer += num * SECTOR_SIZE;
+    sector += num;
+    sector_num -= num;
+  }
+  return 0;
+}
+
+int32 write_hard_disk_sectors(char* buffer, uint32 sector, uint32 sector_num) {
+  while (sector_num > 0) {
+    uint32 num = min(sector_num, disk_backend->sectors_per_request_max);
+    if (disk_backend->write_sectors(buffer, sector, num) != 0) {
+      return -1;
+    }
+    buffer += num * SECTOR_SIZE;
+    sector += num;
+    sector_num -= num;
+  }
+  return 0;
+}
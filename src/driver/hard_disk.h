@@ -5,9 +5,32 @@
 
 #define SECTOR_SIZE  512
 
+// A single ATA command transfers at most 256 sectors.
+#define ATA_SECTORS_PER_REQUEST_MAX  256
+
+// A disk backend reads and writes whole sectors. It is picked at boot by PCI probe. Both
+// return 0 on success and -1 on failure, in which case buffer content is undefined. Writes
+// return when data is durable on the disk.
+struct disk_backend {
+  char* name;
+  uint32 sectors_per_request_max;
+  int32 (*read_sectors)(char* buffer, uint32 sector, uint32 sector_num);
+  int32 (*write_sectors)(char* buffer, uint32 sector, uint32 sector_num);
+};
+typedef struct disk_backend disk_backend_t;
+
 void init_hard_disk();
 
-void read_hard_disk(char* buffer, uint32 start, uint32 length);
+disk_backend_t* get_disk_backend();
+
+// Whether disk I/O may block current thread until an interrupt - otherwise it must poll.
+bool disk_io_can_block();
+
+// Read whole sectors. Return 0 on success, or -1 if any of them fails.
+int32 read_hard_disk_sectors(char* buffer, uint32 sector, uint32 sector_num);
+
+// Write whole sectors. Return 0 on success, or -1 if any of them fails.
+int32 write_hard_disk_sectors(char* buffer, uint32 sector, uint32 sector_num);
 
 
 #endif
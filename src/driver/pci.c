@@ -0,0 +1,93 @@
+#include "driver/pci.h"
+#include "common/io.h"
+
+#define PCI_BUSES_NUM      256
+#define PCI_DEVICES_NUM    32
+#define PCI_FUNCTIONS_NUM  8
+
+static uint32 config_address(pci_device_t* dev, uint8 offset) {
+  return (1 << 31) | (dev->bus << 16) | (dev->device << 11) | (dev->function << 8) |
+         (offset & 0xFC);
+}
+
+uint32 pci_config_read32(pci_device_t* dev, uint8 offset) {
+  outl(PCI_CONFIG_ADDRESS, config_address(dev, offset));
+  return inl(PCI_CONFIG_DATA);
+}
+
+uint16 pci_config_read16(pci_device_t* dev, uint8 offset) {
+  return (pci_config_read32(dev, offset) >> ((offset & 2) * 8)) & 0xFFFF;
+}
+
+void pci_config_write32(pci_device_t* dev, uint8 offset, uint32 value) {
+  outl(PCI_CONFIG_ADDRESS, config_address(dev, offset));
+  outl(PCI_CONFIG_DATA, value);
+}
+
+void pci_config_write16(pci_device_t* dev, uint8 offset, uint16 value) {
+  uint32 shift = (offset & 2) * 8;
+  uint32 dword = pci_config_read32(dev, offset);
+  dword = (dword & ~(0xFFFF << shift)) | ((uint32)value << shift);
+  pci_config_write32(dev, offset, dword);
+}
+
+// Fill ids and class of the function. Return false if it does not exist.
+static bool probe_function(uint8 bus, uint8 device, uint8 function, pci_device_t* dev) {
+  dev->bus = bus;
+  dev->device = device;
+  dev->function = function;
+  uint32 ids = pci_config_read32(dev, PCI_VENDOR_ID);
+  if ((ids & 0xFFFF) == 0xFFFF) {
+    return false;
+  }
+  dev->vendor_id = ids & 0xFFFF;
+  dev->device_id = ids >> 16;
+
+  uint32 class_revision = pci_config_read32(dev, PCI_CLASS_REVISION);
+  dev->class_code = class_revision >> 24;
+  dev->subclass = (class_revision >> 16) & 0xFF;
+  dev->prog_if = (class_revision >> 8) & 0xFF;
+  return true;
+}
+
+typedef bool (*pci_match_func)(pci_device_t* dev, uint32 arg1, uint32 arg2);
+
+static bool scan(pci_match_func match, uint32 arg1, uint32 arg2, pci_device_t* dev) {
+  for (uint32 bus = 0; bus < PCI_BUSES_NUM; bus++) {
+    for (uint32 device = 0; device < PCI_DEVICES_NUM; device++) {
+      if (!probe_function(bus, device, 0, dev)) {
+        continue;
+      }
+      // Only multi-function devices have functions other than 0.
+      uint32 functions_num = (pci_config_read32(dev, PCI_HEADER_TYPE) >> 16) & 0x80 ?
+          PCI_FUNCTIONS_NUM : 1;
+      for (uint32 function = 0; function < functions_num; function++) {
+        if (probe_function(bus, device, function, dev) && match(dev, arg1, arg2)) {
+          return true;
+        }
+      }
+    }
+  }
+  return false;
+}
+
+static bool match_class(pci_device_t* dev, uint32 class_code, uint32 subclass) {
+  return dev->class_code == class_code && dev->subclass == subclass;
+}
+
+static bool match_id(pci_device_t* dev, uint32 vendor_id, uint32 device_id) {
+  return dev->vendor_id == vendor_id && dev->device_id == device_id;
+}
+
+bool pci_find_device_by_class(uint8 class_code, uint8 subclass, pci_device_t* dev) {
+  return scan(match_class, class_code, subclass, dev);
+}
+
+bool pci_find_device(uint16 vendor_id, uint16 device_id, pci_device_t* dev) {
+  return scan(match_id, vendor_id, device_id, dev);
+}
+
+void pci_enable_bus_master(pci_device_t* dev) {
+  uint16 command = pci_config_read16(dev, PCI_COMMAND);
+  pci_config_write16(dev, PCI_COMMAND, command | PCI_COMMAND_IO | PCI_COMMAND_BUS_MASTER);
+}
@@ -0,0 +1,54 @@
+#ifndef DRIVER_PCI_H
+#define DRIVER_PCI_H
+
+#include "common/common.h"
+
+#define PCI_CONFIG_ADDRESS  0xCF8
+#define PCI_CONFIG_DATA     0xCFC
+
+// Config space registers.
+#define PCI_VENDOR_ID       0x00
+#define PCI_DEVICE_ID       0x02
+#define PCI_COMMAND         0x04
+#define PCI_CLASS_REVISION  0x08
+#define PCI_HEADER_TYPE     0x0E
+#define PCI_BAR0            0x10
+#define PCI_BAR4            0x20
+#define PCI_INTERRUPT_LINE  0x3C
+
+#define PCI_COMMAND_IO            0x1
+#define PCI_COMMAND_MEMORY        0x2
+#define PCI_COMMAND_BUS_MASTER    0x4
+
+#define PCI_CLASS_STORAGE         0x01
+#define PCI_SUBCLASS_IDE          0x01
+
+struct pci_device {
+  uint8 bus;
+  uint8 device;
+  uint8 function;
+  uint16 vendor_id;
+  uint16 device_id;
+  uint8 class_code;
+  uint8 subclass;
+  uint8 prog_if;
+};
+typedef struct pci_device pci_device_t;
+
+
+// ****************************************************************************
+uint32 pci_config_read32(pci_device_t* dev, uint8 offset);
+uint16 pci_config_read16(pci_device_t* dev, uint8 offset);
+void pci_config_write32(pci_device_t* dev, uint8 offset, uint32 value);
+void pci_config_write16(pci_device_t* dev, uint8 offset, uint16 value);
+
+// Scan all buses for the first device of given class, and return false if none.
+bool pci_find_device_by_class(uint8 class_code, uint8 subclass, pci_device_t* dev);
+
+// Find device by vendor and device id.
+bool pci_find_device(uint16 vendor_id, uint16 device_id, pci_device_t* dev);
+
+// Enable I/O space decoding and bus mastering for the device.
+void pci_enable_bus_master(pci_device_t* dev);
+
+#endif
@@ -0,0 +1,375 @@
+#include "driver/virtio_blk.h"
+#include "driver/pci.h"
+#include "common/io.h"
+#include "common/stdlib.h"
+#include "interrupt/interrupt.h"
+#include "mem/kheap.h"
+#include "mem/paging.h"
+#include "monitor/monitor.h"
+#include "sync/spinlock.h"
+#include "task/scheduler.h"
+#include "utils/linked_list.h"
+#include "utils/math.h"
+
+#define barrier() asm volatile("": : :"memory")
+
+static uint16 io_base;
+static uint16 queue_size;
+
+static virtq_desc_t* descs;
+static virtq_avail_t* avail;
+static virtq_used_t* used;
+static virtio_blk_request_t* requests;
+static uint32 requests_phy;
+
+// Free descriptors are chained by next.
+static uint16 free_head;
+static uint16 free_num;
+static uint16 last_used_idx;
+
+// Protects the queue; also taken by the interrupt handler.
+static spinlock_t queue_lock;
+
+// Device is read-only, VIRTIO_BLK_F_RO.
+static bool read_only;
+
+static uint32 requests_completed;
+static uint32 max_in_flight;
+
+static disk_backend_t virtio_blk_backend;
+
+static uint32 align_up(uint32 addr, uint32 align) {
+  return (addr + align - 1) / align * align;
+}
+
+// Allocate physically contiguous memory, and map it to kernel space.
+static uint32 alloc_dma_memory(uint32 size, uint32* phy_addr) {
+  uint32 pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+  uint32 order = 0;
+  while ((1u << order) < pages) {
+    order++;
+  }
+  int32 frame = allocate_phy_frames(order);
+  if (frame < 0) {
+    return 0;
+  }
+
+  uint32 vaddr = kmap_frames(frame, pages);
+  if (vaddr == 0) {
+    release_phy_frames(frame, order);
+    return 0;
+  }
+  memset((void*)vaddr, 0, pages * PAGE_SIZE);
+
+  *phy_addr = frame * PAGE_SIZE;
+  return vaddr;
+}
+
+static bool init_queue() {
+  outw(io_base + VIRTIO_REG_QUEUE_SELECT, 0);
+  queue_size = inw(io_base + VIRTIO_REG_QUEUE_SIZE);
+  if (queue_size == 0) {
+    return false;
+  }
+
+  uint32 avail_offset = queue_size * sizeof(virtq_desc_t);
+  uint32 used_offset = align_up(avail_offset + 6 + 2 * queue_size, VIRTQ_ALIGN);
+  uint32 requests_offset = align_up(used_offset + 6 + sizeof(virtq_used_elem_t) * queue_size,
+                                    VIRTQ_ALIGN);
+  uint32 size = requests_offset + queue_size * sizeof(virtio_blk_request_t);
+
+  uint32 phy_addr;
+  uint32 vaddr = alloc_dma_memory(size, &phy_addr);
+  if (vaddr == 0) {
+    return false;
+  }
+  descs = (virtq_desc_t*)vaddr;
+  avail = (virtq_avail_t*)(vaddr + avail_offset);
+  used = (virtq_used_t*)(vaddr + used_offset);
+  requests = (virtio_blk_request_t*)(vaddr + requests_offset);
+  requests_phy = phy_addr + requests_offset;
+
+  for (uint32 i = 0; i < queue_size; i++) {
+    descs[i].next = (i + 1) % queue_size;
+  }
+  free_head = 0;
+  free_num = queue_size;
+  last_used_idx = 0;
+
+  outl(io_base + VIRTIO_REG_QUEUE_ADDRESS, phy_addr / VIRTQ_ALIGN);
+  return true;
+}
+
+// Collect finished requests from used ring, and wake up their waiters.
+static void collect_completions() {
+  linked_list_t wake_list;
+  linked_list_init(&wake_list);
+
+  spinlock_lock_irqsave(&queue_lock);
+  while (last_used_idx != used->idx) {
+    barrier();
+    uint32 id = used->ring[last_used_idx % queue_size].id;
+    last_used_idx++;
+
+    virtio_blk_request_t* request = requests + id;
+    request->done = true;
+    requests_completed++;
+    if (request->waiting_thread_node != nullptr) {
+      linked_list_append(&wake_list, request->waiting_thread_node);
+      request->waiting_thread_node = nullptr;
+    }
+  }
+  spinlock_unlock_irqrestore(&queue_lock);
+
+  linked_list_node_t* node = wake_list.head;
+  while (node != nullptr) {
+    linked_list_node_t* next_node = node->next;
+    linked_list_remove(&wake_list, node);
+    add_thread_node_to_schedule_head(node);
+    node = next_node;
+  }
+}
+
+static void virtio_blk_interrupt_handler() {
+  // Reading ISR status acknowledges the interrupt.
+  if (!(inb(io_base + VIRTIO_REG_ISR_STATUS) & 0x1)) {
+    return;
+  }
+  collect_completions();
+  get_crt_thread()->need_reschedule = true;
+}
+
+static uint16 alloc_desc() {
+  uint16 id = free_head;
+  free_head = descs[id].next;
+  free_num--;
+  return id;
+}
+
+static void free_desc_chain(uint16 head) {
+  uint16 id = head;
+  while (true) {
+    uint16 flags = descs[id].flags;
+    uint16 next = descs[id].next;
+    descs[id].next = free_head;
+    free_head = id;
+    free_num++;
+    if (!(flags & VIRTQ_DESC_F_NEXT)) {
+      break;
+    }
+    id = next;
+  }
+}
+
+static int32 get_mapped_phy_addr(uint32 virtual_addr) {
+  if (!is_page_mapped(virtual_addr)) {
+    // Kernel heap is mapped on demand - touch it.
+    *(volatile char*)virtual_addr;
+  }
+  return get_phy_addr(virtual_addr);
+}
+
+// Count physically contiguous pieces of a buffer.
+static uint32 count_pieces(char* buffer, uint32 length) {
+  uint32 start = (uint32)buffer;
+  uint32 end = start + length;
+  return (end - 1) / PAGE_SIZE - start / PAGE_SIZE + 1;
+}
+
+// Queue a request, whose data buffer is a kernel buffer. Caller holds the queue lock and has
+// made sure there are enough free descriptors. Return the head descriptor.
+static uint16 submit_request(uint32 type, char* buffer, uint32 sector, uint32 sector_num) {
+  uint16 head = alloc_desc();
+  virtio_blk_request_t* request = requests + head;
+  request->type = type;
+  request->reserved = 0;
+  request->sector = sector;
+  request->status = 0xFF;
+  request->done = false;
+  request->waiting_thread_node = nullptr;
+
+  uint32 request_phy = requests_phy + head * sizeof(virtio_blk_request_t);
+  descs[head].addr = request_phy;
+  descs[head].len = 16;
+  descs[head].flags = VIRTQ_DESC_F_NEXT;
+  uint16 prev = head;
+
+  // Data, one descriptor per physically contiguous piece. Device writes it on read.
+  uint16 data_flags = VIRTQ_DESC_F_NEXT | (type == VIRTIO_BLK_T_IN ? VIRTQ_DESC_F_WRITE : 0);
+  uint32 addr = (uint32)buffer;
+  uint32 end = addr + sector_num * SECTOR_SIZE;
+  while (addr < end) {
+    uint32 piece_end = min((addr / PAGE_SIZE + 1) * PAGE_SIZE, end);
+    uint32 phy_addr = get_mapped_phy_addr(addr);
+    virtq_desc_t* last = descs + prev;
+    if (prev != head && last->addr + last->len == phy_addr) {
+      last->len += piece_end - addr;
+    } else {
+      uint16 id = alloc_desc();
+      descs[id].addr = phy_addr;
+      descs[id].len = piece_end - addr;
+      descs[id].flags = data_flags;
+      descs[prev].next = id;
+      prev = id;
+    }
+    addr = piece_end;
+  }
+
+  uint16 status_desc = alloc_desc();
+  descs[status_desc].addr = request_phy + 16;
+  descs[status_desc].len = 1;
+  descs[status_desc].flags = VIRTQ_DESC_F_WRITE;
+  descs[prev].next = status_desc;
+
+  avail->ring[avail->idx % queue_size] = head;
+  barrier();
+  avail->idx++;
+  return head;
+}
+
+// Return false if the device failed the request.
+static bool wait_request(uint16 head, bool can_block) {
+  virtio_blk_request_t* request = requests + head;
+  spinlock_lock_irqsave(&queue_lock);
+  while (!request->done) {
+    if (can_block) {
+      request->waiting_thread_node = get_crt_thread_node();
+      schedule_mark_thread_block();
+      spinlock_unlock_irqrestore(&queue_lock);
+      schedule_thread_yield();
+    } else {
+      spinlock_unlock_irqrestore(&queue_lock);
+      collect_completions();
+    }
+    spinlock_lock_irqsave(&queue_lock);
+  }
+  bool ok = (request->status == VIRTIO_BLK_S_OK);
+  if (!ok) {
+    monitor_printf("virtio blk error on sector %d\n", (uint32)request->sector);
+  }
+  free_desc_chain(head);
+  spinlock_unlock_irqrestore(&queue_lock);
+  return ok;
+}
+
+// Split the transfer into requests and keep as many of them in flight as the queue holds.
+// Return -1 if any request fails - all of them are still waited for.
+static int32 virtio_blk_transfer(uint32 type, char* buffer, uint32 sector, uint32 sector_num) {
+  bool can_block = disk_io_can_block();
+  uint32 requests_num = (sector_num + VIRTIO_BLK_REQUEST_SECTORS_MAX - 1) /
+                        VIRTIO_BLK_REQUEST_SECTORS_MAX;
+  uint16 heads[requests_num];
+
+  uint32 submitted = 0, waited = 0;
+  int32 result = 0;
+  while (waited < requests_num) {
+    spinlock_lock_irqsave(&queue_lock);
+    uint32 in_flight_before = submitted - waited;
+    while (submitted < requests_num) {
+      uint32 offset = submitted * VIRTIO_BLK_REQUEST_SECTORS_MAX;
+      uint32 num = min(sector_num - offset, VIRTIO_BLK_REQUEST_SECTORS_MAX);
+      char* data = buffer + offset * SECTOR_SIZE;
+      // header + data pieces + status
+      if (free_num < count_pieces(data, num * SECTOR_SIZE) + 2) {
+        break;
+      }
+      heads[submitted++] = submit_request(type, data, sector + offset, num);
+    }
+    max_in_flight = max(max_in_flight, submitted - waited);
+    bool notify = (submitted - waited) > in_flight_before;
+    spinlock_unlock_irqrestore(&queue_lock);
+
+    if (notify) {
+      outw(io_base + VIRTIO_REG_QUEUE_NOTIFY, 0);
+    }
+    if (submitted == waited) {
+      // Queue is full of other threads' requests.
+      if (can_block) {
+        schedule_thread_yield();
+      } else {
+        collect_completions();
+      }
+      continue;
+    }
+    if (!wait_request(heads[waited++], can_block)) {
+      result = -1;
+    }
+  }
+  return result;
+}
+
+static int32 virtio_blk_read_sectors(char* buffer, uint32 sector, uint32 sector_num) {
+  // User pages may be copy-on-write shared, so never let the device write them directly.
+  if ((uint32)buffer >= 0xC0000000) {
+    return virtio_blk_transfer(VIRTIO_BLK_T_IN, buffer, sector, sector_num);
+  }
+  char* bounce_buffer = (char*)kmalloc(sector_num * SECTOR_SIZE);
+  int32 result = virtio_blk_transfer(VIRTIO_BLK_T_IN, bounce_buffer, sector, sector_num);
+  if (result == 0) {
+    memcpy(buffer, bounce_buffer, sector_num * SECTOR_SIZE);
+  }
+  kfree(bounce_buffer);
+  return result;
+}
+
+static int32 virtio_blk_write_sectors(char* buffer, uint32 sector, uint32 sector_num) {
+  if (read_only) {
+    monitor_printf("virtio blk is read-only, write to sector %d refused\n", sector);
+    return -1;
+  }
+  // User pages may not be mapped yet.
+  if ((uint32)buffer >= 0xC0000000) {
+    return virtio_blk_transfer(VIRTIO_BLK_T_OUT, buffer, sector, sector_num);
+  }
+  char* bounce_buffer = (char*)kmalloc(sector_num * SECTOR_SIZE);
+  memcpy(bounce_buffer, buffer, sector_num * SECTOR_SIZE);
+  int32 result = virtio_blk_transfer(VIRTIO_BLK_T_OUT, bounce_buffer, sector, sector_num);
+  kfree(bounce_buffer);
+  return result;
+}
+
+disk_backend_t* init_virtio_blk() {
+  pci_device_t dev;
+  if (!pci_find_device(VIRTIO_PCI_VENDOR_ID, VIRTIO_BLK_PCI_DEVICE_ID, &dev)) {
+    return nullptr;
+  }
+  uint32 bar0 = pci_config_read32(&dev, PCI_BAR0);
+  if (!(bar0 & 0x1)) {
+    return nullptr;
+  }
+  io_base = bar0 & 0xFFFC;
+  pci_enable_bus_master(&dev);
+
+  // Reset, then acknowledge the device. The only feature taken is read-only, so that writes
+  // are refused here rather than failed by the device.
+  outb(io_base + VIRTIO_REG_DEVICE_STATUS, 0);
+  uint8 status = VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER;
+  outb(io_base + VIRTIO_REG_DEVICE_STATUS, status);
+  uint32 features = inl(io_base + VIRTIO_REG_DEVICE_FEATURES);
+  read_only = (features & VIRTIO_BLK_F_RO) != 0;
+  outl(io_base + VIRTIO_REG_GUEST_FEATURES, features & VIRTIO_BLK_F_RO);
+
+  spinlock_init(&queue_lock);
+  if (!init_queue()) {
+    outb(io_base + VIRTIO_REG_DEVICE_STATUS, VIRTIO_STATUS_FAILED);
+    return nullptr;
+  }
+  requests_completed = 0;
+  max_in_flight = 0;
+
+  uint8 irq = pci_config_read32(&dev, PCI_INTERRUPT_LINE) & 0xFF;
+  register_interrupt_handler(IRQ0_INT_NUM + irq, &virtio_blk_interrupt_handler);
+
+  outb(io_base + VIRTIO_REG_DEVICE_STATUS, status | VIRTIO_STATUS_DRIVER_OK);
+
+  virtio_blk_backend.name = "virtio-blk";
+  virtio_blk_backend.sectors_per_request_max = VIRTIO_BLK_CALL_SECTORS_MAX;
+  virtio_blk_backend.read_sectors = virtio_blk_read_sectors;
+  virtio_blk_backend.write_sectors = virtio_blk_write_sectors;
+  return &virtio_blk_backend;
+}
+
+void virtio_blk_print_stats() {
+  monitor_printf("virtio blk: queue size %d, %d requests completed, max %d in flight\n",
+                 queue_size, requests_completed, max_in_flight);
+}
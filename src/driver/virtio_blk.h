@@ -0,0 +1,91 @@
+#ifndef DRIVER_VIRTIO_BLK_H
+#define DRIVER_VIRTIO_BLK_H
+
+#include "common/common.h"
+#include "driver/hard_disk.h"
+
+#define VIRTIO_PCI_VENDOR_ID        0x1AF4
+#define VIRTIO_BLK_PCI_DEVICE_ID    0x1001  // legacy block device
+
+// Legacy virtio PCI registers, relative to BAR0 I/O base.
+#define VIRTIO_REG_DEVICE_FEATURES  0x00
+#define VIRTIO_REG_GUEST_FEATURES   0x04
+#define VIRTIO_REG_QUEUE_ADDRESS    0x08
+#define VIRTIO_REG_QUEUE_SIZE       0x0C
+#define VIRTIO_REG_QUEUE_SELECT     0x0E
+#define VIRTIO_REG_QUEUE_NOTIFY     0x10
+#define VIRTIO_REG_DEVICE_STATUS    0x12
+#define VIRTIO_REG_ISR_STATUS       0x13
+
+#define VIRTIO_STATUS_ACKNOWLEDGE   0x1
+#define VIRTIO_STATUS_DRIVER        0x2
+#define VIRTIO_STATUS_DRIVER_OK     0x4
+#define VIRTIO_STATUS_FAILED        0x80
+
+// Device features
+#define VIRTIO_BLK_F_RO             (1 << 5)
+
+// Split virtqueue, in legacy layout: descriptor table and available ring, then used ring on
+// the next page boundary.
+#define VIRTQ_ALIGN                 4096
+#define VIRTQ_DESC_F_NEXT           0x1
+#define VIRTQ_DESC_F_WRITE          0x2
+
+struct virtq_desc {
+  uint64 addr;
+  uint32 len;
+  uint16 flags;
+  uint16 next;
+} __attribute__((packed));
+typedef struct virtq_desc virtq_desc_t;
+
+struct virtq_avail {
+  uint16 flags;
+  volatile uint16 idx;
+  uint16 ring[];
+} __attribute__((packed));
+typedef struct virtq_avail virtq_avail_t;
+
+struct virtq_used_elem {
+  uint32 id;
+  uint32 len;
+} __attribute__((packed));
+typedef struct virtq_used_elem virtq_used_elem_t;
+
+struct virtq_used {
+  uint16 flags;
+  volatile uint16 idx;
+  virtq_used_elem_t ring[];
+} __attribute__((packed));
+typedef struct virtq_used virtq_used_t;
+
+#define VIRTIO_BLK_T_IN             0
+#define VIRTIO_BLK_T_OUT            1
+#define VIRTIO_BLK_S_OK             0
+
+// Sectors of a single request; a call reads more with several requests in flight.
+#define VIRTIO_BLK_REQUEST_SECTORS_MAX  128
+#define VIRTIO_BLK_CALL_SECTORS_MAX     1024
+
+// Request slot, indexed by its head descriptor. Header and status are read and written by the
+// device, so slots live in the same physically contiguous area as the queue.
+struct virtio_blk_request {
+  uint32 type;
+  uint32 reserved;
+  uint64 sector;
+  volatile uint8 status;
+  volatile uint8 done;
+  uint16 pad0;
+  struct linked_list_node* waiting_thread_node;
+  uint32 pad[2];
+} __attribute__((packed));
+typedef struct virtio_blk_request virtio_blk_request_t;
+
+
+// ****************************************************************************
+// Probe PCI for a virtio block device. Return its backend, or nullptr if not found.
+disk_backend_t* init_virtio_blk();
+
+void virtio_blk_print_stats();
+
+#endif
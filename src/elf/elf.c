@@ -1,38 +1,122 @@
 #include "elf/elf.h"
 #include "common/stdlib.h"
 #include "monitor/monitor.h"
+#include "fs/vfs.h"
+#include "mem/paging.h"
+#include "utils/math.h"
 
-int32 load_elf(char* content, uint32* entry_addr) {
-  elf32_ehdr_t* elf_header = (elf32_ehdr_t*)content;
+// Segments must lie in user space - above the reserved first 4MB, and below kernel space.
+#define USER_SPACE_START  0x400000
+#define USER_SPACE_END    0xC0000000
+
+int32 parse_elf(char* path, elf_program_t* program) {
+  memset(&program->file, 0, sizeof(file_t));
+  if (open_file(path, &program->file) != 0) {
+    return -1;
+  }
+  file_t* file = &program->file;
+
+  elf32_ehdr_t elf_header;
+  if (read_open_file(file, (char*)&elf_header, 0, sizeof(elf32_ehdr_t)) !=
+      sizeof(elf32_ehdr_t)) {
+    return -1;
+  }
 
   // Verify magic number
-  if (elf_header->e_ident[0] != 0x7f) {
+  if (elf_header.e_ident[0] != 0x7f) {
     return -1;
   }
-  if (elf_header->e_ident[1] != 'E') {
+  if (elf_header.e_ident[1] != 'E') {
     return -1;
   }
-  if (elf_header->e_ident[2] != 'L') {
+  if (elf_header.e_ident[2] != 'L') {
     return -1;
   }
-  if (elf_header->e_ident[3] != 'F') {
+  if (elf_header.e_ident[3] != 'F') {
     return -1;
   }
 
-  // Load each section.
-  elf32_phdr_t* program_header = (elf32_phdr_t*)(content + elf_header->e_phoff);
-  for (uint32 i = 0; i < elf_header->e_phnum; i++) {
-    if (program_header->p_type == 0) {
+  // Record each loadable segment.
+  program->entry = elf_header.e_entry;
+  program->segments_num = 0;
+  for (uint32 i = 0; i < elf_header.e_phnum; i++) {
+    elf32_phdr_t program_header;
+    uint32 offset = elf_header.e_phoff + i * elf_header.e_phentsize;
+    if (read_open_file(file, (char*)&program_header, offset, sizeof(elf32_phdr_t)) !=
+        sizeof(elf32_phdr_t)) {
+      return -1;
+    }
+    if (program_header.p_type != PT_LOAD || program_header.p_memsz == 0) {
       continue;
     }
 
-    //monitor_printf("load section to vaddr %x, offset = %d, size = %d\n",
-    //    program_header->p_vaddr, program_header->p_offset, program_header->p_filesz);
-    memcpy((void*)program_header->p_vaddr, content + program_header->p_offset,
-        program_header->p_filesz);
-    program_header = (elf32_phdr_t*)((uint32)program_header + elf_header->e_phentsize);
+    //monitor_printf("segment vaddr %x, offset = %d, size = %d\n",
+    //    program_header.p_vaddr, program_header.p_offset, program_header.p_filesz);
+    if (program->segments_num >= ELF_SEGMENTS_MAX) {
+      return -1;
+    }
+    if (program_header.p_filesz > program_header.p_memsz ||
+        program_header.p_vaddr < USER_SPACE_START ||
+        program_header.p_vaddr + program_header.p_memsz > USER_SPACE_END ||
+        program_header.p_vaddr + program_header.p_memsz < program_header.p_vaddr) {
+      return -1;
+    }
+
+    elf_segment_t* segment = program->segments + program->segments_num;
+    segment->vaddr = program_header.p_vaddr;
+    segment->memsz = program_header.p_memsz;
+    segment->filesz = program_header.p_filesz;
+    segment->offset = program_header.p_offset;
+    segment->flags = program_header.p_flags;
+    program->segments_num++;
   }
 
-  *entry_addr = elf_header->e_entry;
+  return 0;
+}
+
+static bool segment_overlaps_page(elf_segment_t* segment, uint32 page_start) {
+  return segment->vaddr < page_start + PAGE_SIZE && segment->vaddr + segment->memsz > page_start;
+}
+
+bool elf_page_is_loadable(elf_program_t* program, uint32 page_start) {
+  for (uint32 i = 0; i < program->segments_num; i++) {
+    if (segment_overlaps_page(program->segments + i, page_start)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool elf_page_is_readonly(elf_program_t* program, uint32 page_start) {
+  bool covered = false;
+  for (uint32 i = 0; i < program->segments_num; i++) {
+    elf_segment_t* segment = program->segments + i;
+    if (!segment_overlaps_page(segment, page_start)) {
+      continue;
+    }
+    if (segment->flags & PF_W) {
+      return false;
+    }
+    covered = true;
+  }
+  return covered;
+}
+
+int32 elf_fill_page(elf_program_t* program, uint32 page_start, char* buffer) {
+  // Segments may share a page at their boundaries.
+  uint32 page_end = page_start + PAGE_SIZE;
+  for (uint32 i = 0; i < program->segments_num; i++) {
+    elf_segment_t* segment = program->segments + i;
+    uint32 start = max(segment->vaddr, page_start);
+    uint32 end = min(segment->vaddr + segment->filesz, page_end);
+    if (start >= end) {
+      continue;
+    }
+    int32 read = read_open_file(&program->file, buffer + (start - page_start),
+                                segment->offset + (start - segment->vaddr), end - start);
+    if (read != (int32)(end - start)) {
+      return -1;
+    }
+  }
   return 0;
 }
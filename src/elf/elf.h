@@ -2,6 +2,7 @@
 #define ELF_ELF_H
 
 #include "common/common.h"
+#include "fs/fd_table.h"
 
 struct elf32_ehdr {
   uint8  e_ident[16];    // Magic number
@@ -33,8 +34,50 @@ struct elf32_phdr {
 };
 typedef struct elf32_phdr elf32_phdr_t;
 
+#define PT_LOAD  1
+
+// segment flags
+#define PF_X  0x1
+#define PF_W  0x2
+#define PF_R  0x4
+
+#define ELF_SEGMENTS_MAX  8
+
+// A loadable segment, mapped from file [offset, offset + filesz) to memory
+// [vaddr, vaddr + memsz). The part beyond filesz is zero-filled.
+struct elf_segment {
+  uint32 vaddr;
+  uint32 memsz;
+  uint32 filesz;
+  uint32 offset;
+  uint32 flags;
+};
+typedef struct elf_segment elf_segment_t;
+
+struct elf_program {
+  // File opened on parse. Pages are read from it rather than by path, and it identifies the
+  // image, together with the version in its stat.
+  file_t file;
+  uint32 entry;
+  uint32 segments_num;
+  elf_segment_t segments[ELF_SEGMENTS_MAX];
+};
+typedef struct elf_program elf_program_t;
+
 
 // ****************************************************************************
-int32 load_elf(char* content, uint32* entry_addr);
+// Read elf header and program headers of file, without loading any segment.
+int32 parse_elf(char* path, elf_program_t* program);
+
+// Whether any segment covers the page starting at page_start.
+bool elf_page_is_loadable(elf_program_t* program, uint32 page_start);
+
+// Whether the page is covered only by non-writable segments.
+bool elf_page_is_readonly(elf_program_t* program, uint32 page_start);
+
+// Read the file-backed parts of all segments in the page into buffer, which must be a cleared
+// page. The rest of the page is left zero. Return 0 on success, or -1 if file can't be fully read,
+// in which case the page must not be used.
+int32 elf_fill_page(elf_program_t* program, uint32 page_start, char* buffer);
 
 #endif
@@ -0,0 +1,253 @@
+#include "elf/image_cache.h"
+#include "common/stdlib.h"
+#include "fs/vfs.h"
+#include "mem/kheap.h"
+#include "mem/paging.h"
+#include "monitor/monitor.h"
+#include "sync/yieldlock.h"
+#include "task/scheduler.h"
+
+static image_cache_entry_t images[IMAGE_CACHE_MAX];
+static uint32 total_frames_num;
+static uint32 use_clock;
+static uint32 next_image_id;
+
+static uint32 hits;
+static uint32 misses;
+static uint32 evictions;
+
+static yieldlock_t image_cache_lock;
+
+void init_image_cache() {
+  memset(images, 0, sizeof(images));
+  total_frames_num = 0;
+  use_clock = 0;
+  next_image_id = 1;
+  hits = 0;
+  misses = 0;
+  evictions = 0;
+  yieldlock_init(&image_cache_lock);
+}
+
+static void release_image(image_cache_entry_t* image) {
+  // Drop the cache's reference. Processes still mapping a frame keep it alive.
+  for (uint32 i = 0; i < image->pages_num; i++) {
+    int32 frame = image->frames[i];
+    if (frame < 0) {
+      continue;
+    }
+    if (change_cow_frame_refcount(frame, -1) <= 0) {
+      release_phy_frame(frame);
+    }
+  }
+  total_frames_num -= image->frames_num;
+
+  kfree(image->frames);
+  memset(image, 0, sizeof(image_cache_entry_t));
+}
+
+static image_cache_entry_t* lru_image(image_cache_entry_t* exclude) {
+  image_cache_entry_t* lru = nullptr;
+  for (uint32 i = 0; i < IMAGE_CACHE_MAX; i++) {
+    image_cache_entry_t* image = images + i;
+    if (!image->valid || image == exclude) {
+      continue;
+    }
+    if (lru == nullptr || image->last_used < lru->last_used) {
+      lru = image;
+    }
+  }
+  return lru;
+}
+
+static image_cache_entry_t* find_image(fs_t* fs, void* fs_file) {
+  for (uint32 i = 0; i < IMAGE_CACHE_MAX; i++) {
+    image_cache_entry_t* image = images + i;
+    if (image->valid && image->fs == fs && image->fs_file == fs_file) {
+      return image;
+    }
+  }
+  return nullptr;
+}
+
+static image_cache_entry_t* create_image(elf_program_t* program) {
+  // Program address range in pages.
+  uint32 start = 0xFFFFFFFF, end = 0;
+  for (uint32 i = 0; i < program->segments_num; i++) {
+    elf_segment_t* segment = program->segments + i;
+    if (segment->vaddr < start) {
+      start = segment->vaddr;
+    }
+    if (segment->vaddr + segment->memsz > end) {
+      end = segment->vaddr + segment->memsz;
+    }
+  }
+  if (start >= end) {
+    return nullptr;
+  }
+  uint32 start_page = start / PAGE_SIZE;
+  uint32 pages_num = (end + PAGE_SIZE - 1) / PAGE_SIZE - start_page;
+
+  image_cache_entry_t* image = nullptr;
+  for (uint32 i = 0; i < IMAGE_CACHE_MAX; i++) {
+    if (!images[i].valid) {
+      image = images + i;
+      break;
+    }
+  }
+  if (image == nullptr) {
+    image = lru_image(nullptr);
+    release_image(image);
+    evictions++;
+  }
+
+  image->frames = (int32*)kmalloc(pages_num * sizeof(int32));
+  for (uint32 i = 0; i < pages_num; i++) {
+    image->frames[i] = IMAGE_PAGE_NONE;
+  }
+  image->id = next_image_id++;
+  image->fs = program->file.fs;
+  image->fs_file = program->file.fs_private;
+  image->version = program->file.stat.version;
+  image->start_page = start_page;
+  image->pages_num = pages_num;
+  image->frames_num = 0;
+  image->valid = true;
+  return image;
+}
+
+// Caller must hold the lock.
+static image_cache_entry_t* get_image(elf_program_t* program) {
+  image_cache_entry_t* image = find_image(program->file.fs, program->file.fs_private);
+  if (image != nullptr && image->version != program->file.stat.version) {
+    // File is changed since cached.
+    release_image(image);
+    image = nullptr;
+  }
+  if (image == nullptr) {
+    image = create_image(program);
+  }
+  return image;
+}
+
+// Read a page of program into a new frame. It is filled through a temporary kernel mapping, so
+// that no thread can write the frame before it is shared read-only. A frame which fails to be
+// filled is released, never cached.
+static int32 load_page(elf_program_t* program, uint32 page_start) {
+  int32 frame = allocate_phy_frame();
+  if (frame < 0) {
+    return -1;
+  }
+
+  uint32 vaddr = kmap_frames(frame, 1);
+  if (vaddr == 0) {
+    release_phy_frame(frame);
+    return -1;
+  }
+  clear_page(vaddr);
+  int32 result = elf_fill_page(program, page_start, (char*)vaddr);
+  kunmap_frames(vaddr, 1);
+  if (result != 0) {
+    release_phy_frame(frame);
+    return -1;
+  }
+  return frame;
+}
+
+bool image_cache_map_page(elf_program_t* program, uint32 page_start) {
+  yieldlock_lock(&image_cache_lock);
+  image_cache_entry_t* image;
+  uint32 page_index;
+  int32 frame;
+  while (true) {
+    image = get_image(program);
+    if (image == nullptr) {
+      yieldlock_unlock(&image_cache_lock);
+      return false;
+    }
+    image->last_used = ++use_clock;
+
+    page_index = page_start / PAGE_SIZE - image->start_page;
+    if (page_index >= image->pages_num) {
+      yieldlock_unlock(&image_cache_lock);
+      return false;
+    }
+    frame = image->frames[page_index];
+    if (frame != IMAGE_PAGE_LOADING) {
+      break;
+    }
+
+    // Another process is reading the page. The image may be gone when we are back, so look
+    // it up again.
+    yieldlock_unlock(&image_cache_lock);
+    schedule_thread_yield();
+    yieldlock_lock(&image_cache_lock);
+  }
+
+  if (frame >= 0) {
+    hits++;
+    change_cow_frame_refcount(frame, 1);
+    map_page_with_frame_readonly(page_start, frame);
+    yieldlock_unlock(&image_cache_lock);
+    return true;
+  }
+
+  // Miss - make room, then load the page with the lock released, so that faults on other
+  // pages and images go on meanwhile.
+  misses++;
+  while (total_frames_num >= IMAGE_CACHE_FRAMES_MAX) {
+    image_cache_entry_t* victim = lru_image(image);
+    if (victim == nullptr) {
+      yieldlock_unlock(&image_cache_lock);
+      return false;
+    }
+    release_image(victim);
+    evictions++;
+  }
+  image->frames[page_index] = IMAGE_PAGE_LOADING;
+  uint32 image_id = image->id;
+  yieldlock_unlock(&image_cache_lock);
+
+  frame = load_page(program, page_start);
+
+  yieldlock_lock(&image_cache_lock);
+  // The image may have been released and its slot reused meanwhile.
+  bool cached = (image->valid && image->id == image_id &&
+                 image->frames[page_index] == IMAGE_PAGE_LOADING);
+  if (frame < 0) {
+    if (cached) {
+      image->frames[page_index] = IMAGE_PAGE_NONE;
+    }
+    yieldlock_unlock(&image_cache_lock);
+    return false;
+  }
+  if (cached) {
+    // One reference for the cache, one for this process.
+    change_cow_frame_refcount(frame, 1);
+    image->frames[page_index] = frame;
+    image->frames_num++;
+    total_frames_num++;
+  }
+  map_page_with_frame_readonly(page_start, frame);
+  yieldlock_unlock(&image_cache_lock);
+  return true;
+}
+
+void image_cache_invalidate(char* path) {
+  file_t file;
+  memset(&file, 0, sizeof(file_t));
+  if (open_file(path, &file) != 0) {
+    return;
+  }
+  yieldlock_lock(&image_cache_lock);
+  image_cache_entry_t* image = find_image(file.fs, file.fs_private);
+  if (image != nullptr) {
+    release_image(image);
+  }
+  yieldlock_unlock(&image_cache_lock);
+}
+
+void image_cache_print_stats() {
+  monitor_printf("image cache: %d frames, %d hits, %d misses, %d evictions\n",
+                 total_frames_num, hits, misses, evictions);
+}
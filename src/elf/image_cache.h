@@ -0,0 +1,50 @@
+#ifndef ELF_IMAGE_CACHE_H
+#define ELF_IMAGE_CACHE_H
+
+#include "common/common.h"
+#include "elf/elf.h"
+
+#define IMAGE_CACHE_MAX         16
+// Total frames held by the cache, before least recently used images are evicted.
+#define IMAGE_CACHE_FRAMES_MAX  2048
+
+// frames[] of a page not loaded yet, or being read from file by some process.
+#define IMAGE_PAGE_NONE     -1
+#define IMAGE_PAGE_LOADING  -2
+
+// Read-only pages of an executable, which are mapped into every process running it. Each cached
+// frame holds one copy-on-write reference of the cache, and one for each process mapping it.
+struct image_cache_entry {
+  bool valid;
+  // never reused, to tell a released entry from a new one in the same slot
+  uint32 id;
+  // The file is identified by its fs and fs private data, which hold for any path or mount it
+  // is reached by; its content by version.
+  struct file_system* fs;
+  void* fs_file;
+  uint32 version;
+
+  // pages covered by the program
+  uint32 start_page;
+  uint32 pages_num;
+  int32* frames;
+  uint32 frames_num;
+
+  uint32 last_used;
+};
+typedef struct image_cache_entry image_cache_entry_t;
+
+
+// ****************************************************************************
+void init_image_cache();
+
+// Map a read-only page of program from the cache, loading it from file on miss. Return false if
+// it is not mapped, including when file can't be read.
+bool image_cache_map_page(elf_program_t* program, uint32 page_start);
+
+// Drop the cached image of a file, e.g. after it is modified.
+void image_cache_invalidate(char* path);
+
+void image_cache_print_stats();
+
+#endif
@@ -0,0 +1,160 @@
+#include "fs/buffer_cache.h"
+#include "driver/hard_disk.h"
+#include "driver/block_queue.h"
+#include "mem/kheap.h"
+#include "monitor/monitor.h"
+#include "common/stdlib.h"
+#include "sync/yieldlock.h"
+#include "utils/hash_table.h"
+#include "utils/math.h"
+
+// sector -> buffer
+static hash_table_t buffers;
+static linked_list_t lru_list;
+static uint32 max_buffers_num;
+
+static uint32 hits;
+static uint32 misses;
+static uint32 evictions;
+
+static yieldlock_t buffer_cache_lock;
+
+void init_buffer_cache(uint32 max_size) {
+  hash_table_init(&buffers);
+  linked_list_init(&lru_list);
+  max_buffers_num = max(max_size / SECTOR_SIZE, 1);
+  hits = 0;
+  misses = 0;
+  evictions = 0;
+  yieldlock_init(&buffer_cache_lock);
+}
+
+static void release_buffer(buffer_t* buffer) {
+  hash_table_remove(&buffers, buffer->sector);
+  linked_list_remove(&lru_list, &buffer->lru_node);
+  kfree(buffer->data);
+  kfree(buffer);
+}
+
+static void evict_buffers(uint32 keep_num) {
+  while (lru_list.size > keep_num) {
+    buffer_t* buffer = (buffer_t*)lru_list.tail->ptr;
+    release_buffer(buffer);
+    evictions++;
+  }
+}
+
+void buffer_cache_set_max_size(uint32 max_size) {
+  yieldlock_lock(&buffer_cache_lock);
+  max_buffers_num = max(max_size / SECTOR_SIZE, 1);
+  evict_buffers(max_buffers_num);
+  yieldlock_unlock(&buffer_cache_lock);
+}
+
+// Caller must hold the lock.
+static buffer_t* lookup_buffer(uint32 sector) {
+  buffer_t* buffer = (buffer_t*)hash_table_get(&buffers, sector);
+  if (buffer != nullptr) {
+    linked_list_remove(&lru_list, &buffer->lru_node);
+    linked_list_insert_to_head(&lru_list, &buffer->lru_node);
+  }
+  return buffer;
+}
+
+// Caller must hold the lock.
+static void insert_buffer(uint32 sector, char* data) {
+  if (hash_table_contains(&buffers, sector)) {
+    // Another reader has filled it meanwhile.
+    return;
+  }
+  evict_buffers(max_buffers_num - 1);
+
+  buffer_t* buffer = (buffer_t*)kmalloc(sizeof(buffer_t));
+  buffer->sector = sector;
+  buffer->data = (char*)kmalloc(SECTOR_SIZE);
+  buffer->lru_node.ptr = buffer;
+  memcpy(buffer->data, data, SECTOR_SIZE);
+
+  hash_table_put(&buffers, sector, buffer);
+  linked_list_insert_to_head(&lru_list, &buffer->lru_node);
+}
+
+// Copy the part of sector data within [start, end) to buffer, and return copied size.
+static uint32 copy_sector_data(char* buffer, uint32 sector, char* data, uint32 start, uint32 end) {
+  uint32 copy_start_addr = max(sector * SECTOR_SIZE, start);
+  uint32 copy_end_addr = min((sector + 1) * SECTOR_SIZE, end);
+  uint32 copy_size = copy_end_addr - copy_start_addr;
+  memcpy(buffer, data + copy_start_addr - sector * SECTOR_SIZE, copy_size);
+  return copy_size;
+}
+
+int32 buffer_cache_read(char* buffer, uint32 start, uint32 length) {
+  if (length == 0) {
+    return 0;
+  }
+  uint32 end = start + length;
+  uint32 start_sector = start / SECTOR_SIZE;
+  uint32 end_sector = (end - 1) / SECTOR_SIZE + 1;
+
+  yieldlock_lock(&buffer_cache_lock);
+  uint32 sector = start_sector;
+  while (sector < end_sector) {
+    buffer_t* sector_buffer = lookup_buffer(sector);
+    if (sector_buffer != nullptr) {
+      hits++;
+      buffer += copy_sector_data(buffer, sector, sector_buffer->data, start, end);
+      sector++;
+      continue;
+    }
+
+    // Read the run of missing sectors at once. The lock is dropped meanwhile, so that other
+    // readers can go on, and their disk requests be queued and merged with ours.
+    uint32 run_end = sector + 1;
+    while (run_end < end_sector && run_end - sector < BUFFER_CACHE_READ_RUN_MAX &&
+           !hash_table_contains(&buffers, run_end)) {
+      run_end++;
+    }
+    uint32 run = run_end - sector;
+    misses += run;
+    yieldlock_unlock(&buffer_cache_lock);
+
+    char* data = (char*)kmalloc(run * SECTOR_SIZE);
+    if (block_queue_read(data, sector, run) != 0) {
+      kfree(data);
+      return -1;
+    }
+
+    yieldlock_lock(&buffer_cache_lock);
+    for (uint32 i = 0; i < run; i++) {
+      char* sector_data = data + i * SECTOR_SIZE;
+      insert_buffer(sector + i, sector_data);
+      buffer += copy_sector_data(buffer, sector + i, sector_data, start, end);
+    }
+    kfree(data);
+    sector = run_end;
+  }
+  yieldlock_unlock(&buffer_cache_lock);
+  return 0;
+}
+
+void buffer_cache_invalidate(uint32 start, uint32 length) {
+  if (length == 0) {
+    return;
+  }
+  uint32 start_sector = start / SECTOR_SIZE;
+  uint32 end_sector = (start + length - 1) / SECTOR_SIZE + 1;
+
+  yieldlock_lock(&buffer_cache_lock);
+  for (uint32 i = start_sector; i < end_sector; i++) {
+    buffer_t* buffer = (buffer_t*)hash_table_get(&buffers, i);
+    if (buffer != nullptr) {
+      release_buffer(buffer);
+    }
+  }
+  yieldlock_unlock(&buffer_cache_lock);
+}
+
+void buffer_cache_print_stats() {
+  monitor_printf("buffer cache: %d/%d sectors, %d hits, %d misses, %d evictions\n",
+                 lru_list.size, max_buffers_num, hits, misses, evictions);
+}
@@ -0,0 +1,37 @@
+#ifndef FS_BUFFER_CACHE_H
+#define FS_BUFFER_CACHE_H
+
+#include "common/common.h"
+#include "utils/linked_list.h"
+
+// Default memory budget of cached sectors.
+#define BUFFER_CACHE_SIZE_DEFAULT  (256 * 1024)
+
+// Consecutive missing sectors are read from disk together, up to this many.
+#define BUFFER_CACHE_READ_RUN_MAX  64
+
+// A cached disk sector. It is linked into the LRU list, head being the most recently used.
+struct buffer {
+  uint32 sector;
+  char* data;
+  linked_list_node_t lru_node;
+};
+typedef struct buffer buffer_t;
+
+
+// ****************************************************************************
+void init_buffer_cache(uint32 max_size);
+
+// Change memory budget, evicting buffers if it shrinks.
+void buffer_cache_set_max_size(uint32 max_size);
+
+// Read bytes of disk through the cache. start is byte offset on disk, at any alignment.
+// Return 0 on success, or -1 on disk error - nothing of the failed read is cached.
+int32 buffer_cache_read(char* buffer, uint32 start, uint32 length);
+
+// Drop cached sectors overlapping the byte range, e.g. after the disk is written.
+void buffer_cache_invalidate(uint32 start, uint32 length);
+
+void buffer_cache_print_stats();
+
+#endif
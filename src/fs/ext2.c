@@ -0,0 +1,567 @@
+#include "fs/ext2.h"
+#include "fs/buffer_cache.h"
+#include "monitor/monitor.h"
+#include "mem/kheap.h"
+#include "common/stdlib.h"
+#include "sync/yieldlock.h"
+#include "utils/hash_table.h"
+#include "utils/math.h"
+#include "utils/string.h"
+
+fs_t ext2_fs;
+
+static ext2_super_block_t super_block;
+static uint32 block_size;
+static uint32 inode_size;
+static uint32 groups_num;
+static ext2_group_desc_t* group_descs;
+
+// ino -> ext2_cached_inode_t
+static hash_table_t inode_cache;
+static linked_list_t inode_lru_list;
+// hash of (parent ino, name) -> ext2_dentry_t
+static hash_table_t dentry_cache;
+static linked_list_t dentry_lru_list;
+
+static uint32 inode_hits;
+static uint32 inode_misses;
+static uint32 dentry_hits;
+static uint32 dentry_misses;
+
+// Protects the caches. Disk is never read with it held.
+static yieldlock_t ext2_lock;
+
+fs_t* get_ext2_fs() {
+  return &ext2_fs;
+}
+
+static int32 read_disk(char* buffer, uint32 block, uint32 offset, uint32 length) {
+  return buffer_cache_read(buffer, ext2_fs.partition.offset + block * block_size + offset, length);
+}
+
+// ********************************* inodes ************************************
+// Caller must hold the lock.
+static void evict_inodes(uint32 keep_num) {
+  while (inode_lru_list.size > keep_num) {
+    ext2_cached_inode_t* cached = (ext2_cached_inode_t*)inode_lru_list.tail->ptr;
+    hash_table_remove(&inode_cache, cached->ino);
+    linked_list_remove(&inode_lru_list, &cached->lru_node);
+    kfree(cached);
+  }
+}
+
+static bool get_inode(uint32 ino, ext2_inode_t* inode) {
+  if (ino == 0 || ino > super_block.s_inodes_count) {
+    return false;
+  }
+
+  yieldlock_lock(&ext2_lock);
+  ext2_cached_inode_t* cached = (ext2_cached_inode_t*)hash_table_get(&inode_cache, ino);
+  if (cached != nullptr) {
+    linked_list_remove(&inode_lru_list, &cached->lru_node);
+    linked_list_insert_to_head(&inode_lru_list, &cached->lru_node);
+    memcpy(inode, &cached->inode, sizeof(ext2_inode_t));
+    inode_hits++;
+    yieldlock_unlock(&ext2_lock);
+    return true;
+  }
+  inode_misses++;
+  yieldlock_unlock(&ext2_lock);
+
+  uint32 group = (ino - 1) / super_block.s_inodes_per_group;
+  uint32 index = (ino - 1) % super_block.s_inodes_per_group;
+  if (read_disk((char*)inode, group_descs[group].bg_inode_table, index * inode_size,
+                sizeof(ext2_inode_t)) != 0) {
+    return false;
+  }
+
+  yieldlock_lock(&ext2_lock);
+  if (!hash_table_contains(&inode_cache, ino)) {
+    evict_inodes(EXT2_INODE_CACHE_SIZE - 1);
+    cached = (ext2_cached_inode_t*)kmalloc(sizeof(ext2_cached_inode_t));
+    cached->ino = ino;
+    memcpy(&cached->inode, inode, sizeof(ext2_inode_t));
+    cached->lru_node.ptr = cached;
+    hash_table_put(&inode_cache, ino, cached);
+    linked_list_insert_to_head(&inode_lru_list, &cached->lru_node);
+  }
+  yieldlock_unlock(&ext2_lock);
+  return true;
+}
+
+static bool is_dir(ext2_inode_t* inode) {
+  return (inode->i_mode & EXT2_S_IFMT) == EXT2_S_IFDIR;
+}
+
+static bool is_regular_file(ext2_inode_t* inode) {
+  return (inode->i_mode & EXT2_S_IFMT) == EXT2_S_IFREG;
+}
+
+// ****************************** block mapping ********************************
+// A read error is passed down the indirect chain as EXT2_BLOCK_ERROR.
+static uint32 read_block_entry(uint32 block, uint32 index) {
+  if (block == 0 || block == EXT2_BLOCK_ERROR) {
+    return block;
+  }
+  uint32 entry;
+  if (read_disk((char*)&entry, block, index * sizeof(uint32), sizeof(uint32)) != 0) {
+    return EXT2_BLOCK_ERROR;
+  }
+  return entry;
+}
+
+static uint32 map_indirect_block(ext2_inode_t* inode, uint32 file_block) {
+  uint32 entries_per_block = block_size / sizeof(uint32);
+  if (file_block < EXT2_NDIR_BLOCKS) {
+    return inode->i_block[file_block];
+  }
+
+  file_block -= EXT2_NDIR_BLOCKS;
+  if (file_block < entries_per_block) {
+    return read_block_entry(inode->i_block[EXT2_IND_BLOCK], file_block);
+  }
+
+  file_block -= entries_per_block;
+  if (file_block < entries_per_block * entries_per_block) {
+    uint32 block = read_block_entry(inode->i_block[EXT2_DIND_BLOCK],
+                                    file_block / entries_per_block);
+    return read_block_entry(block, file_block % entries_per_block);
+  }
+
+  file_block -= entries_per_block * entries_per_block;
+  uint32 block = read_block_entry(inode->i_block[EXT2_TIND_BLOCK],
+                                  file_block / (entries_per_block * entries_per_block));
+  block = read_block_entry(block, (file_block / entries_per_block) % entries_per_block);
+  return read_block_entry(block, file_block % entries_per_block);
+}
+
+static uint32 map_extent_block(ext2_inode_t* inode, uint32 file_block, uint32* run) {
+  char* node = (char*)inode->i_block;
+  char* node_buffer = nullptr;
+  uint32 block = 0;
+
+  while (true) {
+    ext4_extent_header_t* header = (ext4_extent_header_t*)node;
+    if (header->eh_magic != EXT4_EXTENT_MAGIC) {
+      break;
+    }
+
+    if (header->eh_depth == 0) {
+      ext4_extent_t* extents = (ext4_extent_t*)(header + 1);
+      for (uint32 i = 0; i < header->eh_entries; i++) {
+        ext4_extent_t* extent = extents + i;
+        uint32 length = extent->ee_len;
+        bool uninitialized = (length > EXT4_EXTENT_INIT_MAX_LEN);
+        if (uninitialized) {
+          length -= EXT4_EXTENT_INIT_MAX_LEN;
+        }
+        if (file_block >= extent->ee_block && file_block < extent->ee_block + length) {
+          *run = extent->ee_block + length - file_block;
+          if (!uninitialized) {
+            block = extent->ee_start_lo + (file_block - extent->ee_block);
+          }
+          break;
+        }
+      }
+      break;
+    }
+
+    // Go down the last index starting at or before file_block.
+    ext4_extent_idx_t* indexes = (ext4_extent_idx_t*)(header + 1);
+    int32 found = -1;
+    for (uint32 i = 0; i < header->eh_entries; i++) {
+      if (indexes[i].ei_block > file_block) {
+        break;
+      }
+      found = i;
+    }
+    if (found < 0) {
+      break;
+    }
+    if (node_buffer == nullptr) {
+      node_buffer = (char*)kmalloc(block_size);
+    }
+    if (read_disk(node_buffer, indexes[found].ei_leaf_lo, 0, block_size) != 0) {
+      block = EXT2_BLOCK_ERROR;
+      break;
+    }
+    node = node_buffer;
+  }
+
+  if (node_buffer != nullptr) {
+    kfree(node_buffer);
+  }
+  return block;
+}
+
+// Map file block to disk block, 0 for a hole, or EXT2_BLOCK_ERROR on disk error. run is set to the number of blocks from
+// file_block known to be contiguous on disk.
+static uint32 map_block(ext2_inode_t* inode, uint32 file_block, uint32* run) {
+  *run = 1;
+  if (inode->i_flags & EXT4_EXTENTS_FL) {
+    return map_extent_block(inode, file_block, run);
+  }
+  return map_indirect_block(inode, file_block);
+}
+
+// Read file data within file size into kernel buffer. Blocks contiguous on disk are read
+// together, so that the buffer cache gets them in one disk request. Return -1 on disk error.
+static int32 read_inode_chunk(ext2_inode_t* inode, char* buffer, uint32 start, uint32 length) {
+  uint32 end = start + length;
+
+  char* run_buffer = buffer;
+  uint32 run_disk_addr = 0;
+  uint32 run_length = 0;
+
+  uint32 pos = start;
+  while (pos < end) {
+    uint32 run;
+    uint32 block = map_block(inode, pos / block_size, &run);
+    if (block == EXT2_BLOCK_ERROR) {
+      return -1;
+    }
+    uint32 copy_length = min(end - pos, run * block_size - pos % block_size);
+
+    if (block != 0) {
+      uint32 disk_addr = ext2_fs.partition.offset + block * block_size + pos % block_size;
+      if (run_length > 0 && run_disk_addr + run_length == disk_addr) {
+        run_length += copy_length;
+      } else {
+        if (buffer_cache_read(run_buffer, run_disk_addr, run_length) != 0) {
+          return -1;
+        }
+        run_buffer = buffer + (pos - start);
+        run_disk_addr = disk_addr;
+        run_length = copy_length;
+      }
+    } else {
+      memset(buffer + (pos - start), 0, copy_length);
+    }
+    pos += copy_length;
+  }
+  return buffer_cache_read(run_buffer, run_disk_addr, run_length);
+}
+
+static int32 read_inode_data(ext2_inode_t* inode, char* buffer, uint32 start, uint32 length) {
+  uint32 size = inode->i_size;
+  if (start >= size || length == 0) {
+    return 0;
+  }
+  if (length > size - start) {
+    length = size - start;
+  }
+
+  char* bounce = (char*)kmalloc(min(length, FS_BOUNCE_BUFFER_SIZE));
+  uint32 done = 0;
+  while (done < length) {
+    uint32 chunk = min(length - done, FS_BOUNCE_BUFFER_SIZE);
+    if (read_inode_chunk(inode, bounce, start + done, chunk) != 0) {
+      kfree(bounce);
+      return -1;
+    }
+    memcpy(buffer + done, bounce, chunk);
+    done += chunk;
+  }
+  kfree(bounce);
+  return length;
+}
+
+// ******************************** directories ********************************
+// Call func on each entry of directory, until it returns true.
+typedef bool (*dir_entry_func)(ext2_dir_entry_t* entry, char* name, void* arg);
+
+static void for_each_dir_entry(ext2_inode_t* dir, dir_entry_func func, void* arg) {
+  char* block = (char*)kmalloc(block_size);
+  char name[EXT2_NAME_LEN_MAX + 1];
+
+  for (uint32 offset = 0; offset < dir->i_size; offset += block_size) {
+    int32 length = read_inode_data(dir, block, offset, block_size);
+    if (length < 0) {
+      break;
+    }
+    uint32 pos = 0;
+    while (pos + sizeof(ext2_dir_entry_t) <= length) {
+      ext2_dir_entry_t* entry = (ext2_dir_entry_t*)(block + pos);
+      if (entry->rec_len < sizeof(ext2_dir_entry_t) || pos + entry->rec_len > length) {
+        break;
+      }
+      if (entry->inode != 0 && entry->name_len <= entry->rec_len - sizeof(ext2_dir_entry_t)) {
+        memcpy(name, entry->name, entry->name_len);
+        name[entry->name_len] = '\0';
+        if (func(entry, name, arg)) {
+          kfree(block);
+          return;
+        }
+      }
+      pos += entry->rec_len;
+    }
+  }
+  kfree(block);
+}
+
+struct dir_lookup {
+  char* name;
+  uint32 ino;
+};
+
+static bool match_dir_entry(ext2_dir_entry_t* entry, char* name, void* arg) {
+  struct dir_lookup* lookup = (struct dir_lookup*)arg;
+  if (strcmp(name, lookup->name) == 0) {
+    lookup->ino = entry->inode;
+    return true;
+  }
+  return false;
+}
+
+static uint32 dentry_key(uint32 parent_ino, char* name) {
+  return str_hash(name) ^ (parent_ino * 0x9E3779B1);
+}
+
+// Caller must hold the lock.
+static void release_dentry(ext2_dentry_t* dentry) {
+  hash_table_remove(&dentry_cache, dentry->key);
+  linked_list_remove(&dentry_lru_list, &dentry->lru_node);
+  kfree(dentry);
+}
+
+// Look up name in directory, return its ino or 0 if not found. Negative results are cached
+// too - the file system never changes.
+static uint32 lookup_dir(uint32 dir_ino, ext2_inode_t* dir, char* name) {
+  uint32 key = dentry_key(dir_ino, name);
+
+  yieldlock_lock(&ext2_lock);
+  ext2_dentry_t* dentry = (ext2_dentry_t*)hash_table_get(&dentry_cache, key);
+  if (dentry != nullptr && dentry->parent_ino == dir_ino && strcmp(dentry->name, name) == 0) {
+    linked_list_remove(&dentry_lru_list, &dentry->lru_node);
+    linked_list_insert_to_head(&dentry_lru_list, &dentry->lru_node);
+    uint32 ino = dentry->ino;
+    dentry_hits++;
+    yieldlock_unlock(&ext2_lock);
+    return ino;
+  }
+  dentry_misses++;
+  yieldlock_unlock(&ext2_lock);
+
+  struct dir_lookup lookup;
+  lookup.name = name;
+  lookup.ino = 0;
+  for_each_dir_entry(dir, match_dir_entry, &lookup);
+
+  yieldlock_lock(&ext2_lock);
+  // Replace whatever is cached with this key, hash collision or not.
+  dentry = (ext2_dentry_t*)hash_table_get(&dentry_cache, key);
+  if (dentry != nullptr) {
+    release_dentry(dentry);
+  }
+  while (dentry_lru_list.size >= EXT2_DENTRY_CACHE_SIZE) {
+    release_dentry((ext2_dentry_t*)dentry_lru_list.tail->ptr);
+  }
+  dentry = (ext2_dentry_t*)kmalloc(sizeof(ext2_dentry_t));
+  dentry->key = key;
+  dentry->parent_ino = dir_ino;
+  dentry->ino = lookup.ino;
+  strcpy(dentry->name, name);
+  dentry->lru_node.ptr = dentry;
+  hash_table_put(&dentry_cache, key, dentry);
+  linked_list_insert_to_head(&dentry_lru_list, &dentry->lru_node);
+  yieldlock_unlock(&ext2_lock);
+
+  return lookup.ino;
+}
+
+// Resolve path relative to root of this fs, and get its inode. Return ino, or 0 if not found.
+static uint32 resolve_path(char* path, ext2_inode_t* inode) {
+  uint32 ino = EXT2_ROOT_INO;
+  if (!get_inode(ino, inode)) {
+    return 0;
+  }
+
+  char name[EXT2_NAME_LEN_MAX + 1];
+  while (*path != '\0') {
+    while (*path == '/') {
+      path++;
+    }
+    uint32 length = 0;
+    while (path[length] != '/' && path[length] != '\0') {
+      length++;
+    }
+    if (length == 0) {
+      break;
+    }
+    if (length > EXT2_NAME_LEN_MAX) {
+      return 0;
+    }
+    memcpy(name, path, length);
+    name[length] = '\0';
+    path += length;
+
+    if (length == 1 && name[0] == '.') {
+      continue;
+    }
+    if (!is_dir(inode)) {
+      return 0;
+    }
+    ino = lookup_dir(ino, inode, name);
+    if (ino == 0 || !get_inode(ino, inode)) {
+      return 0;
+    }
+  }
+  return ino;
+}
+
+// ******************************** fs functions *******************************
+static int32 ext2_stat_file(char* filename, file_stat_t* stat) {
+  ext2_inode_t inode;
+  if (resolve_path(filename, &inode) == 0) {
+    return -1;
+  }
+  stat->size = inode.i_size;
+  stat->version = 0;
+  return 0;
+}
+
+static bool print_dir_entry(ext2_dir_entry_t* entry, char* name, void* arg) {
+  ext2_inode_t inode;
+  if (!get_inode(entry->inode, &inode)) {
+    return false;
+  }
+
+  uint32 size = inode.i_size;
+  uint32 length = 1;
+  while ((size /= 10) > 0) {
+    length++;
+  }
+  monitor_printf("root  ");
+  for (uint32 i = length; i < 10; i++) {
+    monitor_printf(" ");
+  }
+  monitor_printf("%d  %s%s\n", inode.i_size, name, is_dir(&inode) ? "/" : "");
+  return false;
+}
+
+static int32 ext2_list_dir(char* dir) {
+  ext2_inode_t inode;
+  if (resolve_path(dir, &inode) == 0 || !is_dir(&inode)) {
+    return -1;
+  }
+  for_each_dir_entry(&inode, print_dir_entry, nullptr);
+  return 0;
+}
+
+static int32 ext2_read_data(char* filename, char* buffer, uint32 start, uint32 length) {
+  ext2_inode_t inode;
+  if (resolve_path(filename, &inode) == 0 || !is_regular_file(&inode)) {
+    return -1;
+  }
+  return read_inode_data(&inode, buffer, start, length);
+}
+
+static int32 ext2_write_data(char* filename, char* buffer, uint32 start, uint32 length) {
+  return -1;
+}
+
+static int32 ext2_open_file(char* filename, file_t* file) {
+  ext2_inode_t inode;
+  uint32 ino = resolve_path(filename, &inode);
+  if (ino == 0 || !is_regular_file(&inode)) {
+    return -1;
+  }
+  file->fs_private = (void*)ino;
+  file->stat.size = inode.i_size;
+  file->stat.version = 0;
+  return 0;
+}
+
+static int32 ext2_read_file_data(file_t* file, char* buffer, uint32 start, uint32 length) {
+  ext2_inode_t inode;
+  if (!get_inode((uint32)file->fs_private, &inode)) {
+    return -1;
+  }
+  return read_inode_data(&inode, buffer, start, length);
+}
+
+static int32 ext2_stat_open_file(file_t* file, file_stat_t* stat) {
+  ext2_inode_t inode;
+  if (!get_inode((uint32)file->fs_private, &inode)) {
+    return -1;
+  }
+  stat->size = inode.i_size;
+  stat->version = 0;
+  return 0;
+}
+
+static int32 ext2_sync() {
+  return 0;
+}
+
+bool init_ext2_fs(uint32 partition_offset) {
+  ext2_fs.type = EXT2;
+  ext2_fs.partition.offset = partition_offset;
+
+  ext2_fs.stat_file = ext2_stat_file;
+  ext2_fs.read_data = ext2_read_data;
+  ext2_fs.write_data = ext2_write_data;
+  ext2_fs.list_dir = ext2_list_dir;
+  ext2_fs.open_file = ext2_open_file;
+  ext2_fs.read_file_data = ext2_read_file_data;
+  ext2_fs.stat_open_file = ext2_stat_open_file;
+  ext2_fs.sync = ext2_sync;
+
+  if (buffer_cache_read((char*)&super_block, partition_offset + EXT2_SUPER_BLOCK_OFFSET,
+                        sizeof(ext2_super_block_t)) != 0 ||
+      super_block.s_magic != EXT2_SUPER_MAGIC) {
+    return false;
+  }
+  if (super_block.s_rev_level != EXT2_GOOD_OLD_REV &&
+      (super_block.s_feature_incompat & ~EXT2_FEATURE_INCOMPAT_SUPPORTED) != 0) {
+    monitor_printf("ext2 fs has unsupported features 0x%x\n",
+                   super_block.s_feature_incompat & ~EXT2_FEATURE_INCOMPAT_SUPPORTED);
+    return false;
+  }
+
+  block_size = 1024 << super_block.s_log_block_size;
+  inode_size = EXT2_GOOD_OLD_INODE_SIZE;
+  uint32 desc_size = EXT2_GROUP_DESC_SIZE;
+  if (super_block.s_rev_level != EXT2_GOOD_OLD_REV) {
+    inode_size = super_block.s_inode_size;
+    if ((super_block.s_feature_incompat & EXT4_FEATURE_INCOMPAT_64BIT) &&
+        super_block.s_desc_size > 0) {
+      desc_size = super_block.s_desc_size;
+    }
+  }
+  groups_num = (super_block.s_blocks_count - super_block.s_first_data_block +
+                super_block.s_blocks_per_group - 1) / super_block.s_blocks_per_group;
+
+  // Group descriptors are in the block after super block.
+  group_descs = (ext2_group_desc_t*)kmalloc(groups_num * sizeof(ext2_group_desc_t));
+  for (uint32 i = 0; i < groups_num; i++) {
+    if (read_disk((char*)(group_descs + i), super_block.s_first_data_block + 1, i * desc_size,
+                  sizeof(ext2_group_desc_t)) != 0) {
+      monitor_printf("ext2 fs couldn't read group descriptors\n");
+      kfree(group_descs);
+      return false;
+    }
+  }
+
+  hash_table_init(&inode_cache);
+  linked_list_init(&inode_lru_list);
+  hash_table_init(&dentry_cache);
+  linked_list_init(&dentry_lru_list);
+  inode_hits = 0;
+  inode_misses = 0;
+  dentry_hits = 0;
+  dentry_misses = 0;
+  yieldlock_init(&ext2_lock);
+
+  monitor_printf("ext2 fs: %d blocks of %d bytes, %d groups, %d inodes\n",
+                 super_block.s_blocks_count, block_size, groups_num,
+                 super_block.s_inodes_count);
+  return true;
+}
+
+void ext2_print_stats() {
+  monitor_printf("ext2 inode cache: %d/%d, %d hits, %d misses\n",
+                 inode_lru_list.size, EXT2_INODE_CACHE_SIZE, inode_hits, inode_misses);
+  monitor_printf("ext2 dentry cache: %d/%d, %d hits, %d misses\n",
+                 dentry_lru_list.size, EXT2_DENTRY_CACHE_SIZE, dentry_hits, dentry_misses);
+}
@@ -0,0 +1,208 @@
+#ifndef FS_EXT2_H
+#define FS_EXT2_H
+
+#include "common/common.h"
+#include "fs/vfs.h"
+#include "utils/linked_list.h"
+
+// Read-only ext2 driver. It also reads ext4 images without a journal to recover, as long as
+// their features are among EXT2_FEATURE_INCOMPAT_SUPPORTED.
+
+#define EXT2_SUPER_BLOCK_OFFSET  1024
+#define EXT2_SUPER_MAGIC         0xEF53
+#define EXT2_ROOT_INO            2
+#define EXT2_NAME_LEN_MAX        255
+
+#define EXT2_GOOD_OLD_REV         0
+#define EXT2_GOOD_OLD_INODE_SIZE  128
+
+#define EXT2_FEATURE_INCOMPAT_FILETYPE  0x0002
+#define EXT2_FEATURE_INCOMPAT_RECOVER   0x0004
+#define EXT4_FEATURE_INCOMPAT_EXTENTS   0x0040
+#define EXT4_FEATURE_INCOMPAT_64BIT     0x0080
+#define EXT4_FEATURE_INCOMPAT_FLEX_BG   0x0200
+#define EXT2_FEATURE_INCOMPAT_SUPPORTED \
+  (EXT2_FEATURE_INCOMPAT_FILETYPE | EXT4_FEATURE_INCOMPAT_EXTENTS | \
+   EXT4_FEATURE_INCOMPAT_64BIT | EXT4_FEATURE_INCOMPAT_FLEX_BG)
+
+#define EXT2_GROUP_DESC_SIZE  32
+
+// i_mode
+#define EXT2_S_IFMT   0xF000
+#define EXT2_S_IFDIR  0x4000
+#define EXT2_S_IFREG  0x8000
+
+// i_flags
+#define EXT4_EXTENTS_FL  0x00080000
+
+// i_block: 12 direct blocks, then single, double and triple indirect blocks.
+#define EXT2_NDIR_BLOCKS  12
+#define EXT2_IND_BLOCK    12
+#define EXT2_DIND_BLOCK   13
+#define EXT2_TIND_BLOCK   14
+#define EXT2_N_BLOCKS     15
+
+// Returned by block mapping when an indirect block or extent node can't be read.
+#define EXT2_BLOCK_ERROR  0xFFFFFFFF
+
+// Inodes and dentries cached in memory, each with its own LRU list.
+#define EXT2_INODE_CACHE_SIZE   256
+#define EXT2_DENTRY_CACHE_SIZE  512
+
+struct ext2_super_block {
+  uint32 s_inodes_count;
+  uint32 s_blocks_count;
+  uint32 s_r_blocks_count;
+  uint32 s_free_blocks_count;
+  uint32 s_free_inodes_count;
+  uint32 s_first_data_block;
+  uint32 s_log_block_size;
+  uint32 s_log_frag_size;
+  uint32 s_blocks_per_group;
+  uint32 s_frags_per_group;
+  uint32 s_inodes_per_group;
+  uint32 s_mtime;
+  uint32 s_wtime;
+  uint16 s_mnt_count;
+  uint16 s_max_mnt_count;
+  uint16 s_magic;
+  uint16 s_state;
+  uint16 s_errors;
+  uint16 s_minor_rev_level;
+  uint32 s_lastcheck;
+  uint32 s_checkinterval;
+  uint32 s_creator_os;
+  uint32 s_rev_level;
+  uint16 s_def_resuid;
+  uint16 s_def_resgid;
+  // EXT2_DYNAMIC_REV
+  uint32 s_first_ino;
+  uint16 s_inode_size;
+  uint16 s_block_group_nr;
+  uint32 s_feature_compat;
+  uint32 s_feature_incompat;
+  uint32 s_feature_ro_compat;
+  uint8 s_uuid[16];
+  char s_volume_name[16];
+  char s_last_mounted[64];
+  uint32 s_algo_bitmap;
+  uint8 s_prealloc_blocks;
+  uint8 s_prealloc_dir_blocks;
+  uint16 s_reserved_gdt_blocks;
+  uint8 s_journal_uuid[16];
+  uint32 s_journal_inum;
+  uint32 s_journal_dev;
+  uint32 s_last_orphan;
+  uint32 s_hash_seed[4];
+  uint8 s_def_hash_version;
+  uint8 s_jnl_backup_type;
+  uint16 s_desc_size;
+} __attribute__((packed));
+typedef struct ext2_super_block ext2_super_block_t;
+
+// Only the low 32 bytes, which are the same for ext4 64bit descriptors.
+struct ext2_group_desc {
+  uint32 bg_block_bitmap;
+  uint32 bg_inode_bitmap;
+  uint32 bg_inode_table;
+  uint16 bg_free_blocks_count;
+  uint16 bg_free_inodes_count;
+  uint16 bg_used_dirs_count;
+  uint16 bg_flags;
+  uint32 bg_exclude_bitmap;
+  uint16 bg_block_bitmap_csum;
+  uint16 bg_inode_bitmap_csum;
+  uint16 bg_itable_unused;
+  uint16 bg_checksum;
+} __attribute__((packed));
+typedef struct ext2_group_desc ext2_group_desc_t;
+
+struct ext2_inode {
+  uint16 i_mode;
+  uint16 i_uid;
+  uint32 i_size;
+  uint32 i_atime;
+  uint32 i_ctime;
+  uint32 i_mtime;
+  uint32 i_dtime;
+  uint16 i_gid;
+  uint16 i_links_count;
+  uint32 i_blocks;
+  uint32 i_flags;
+  uint32 i_osd1;
+  uint32 i_block[EXT2_N_BLOCKS];
+  uint32 i_generation;
+  uint32 i_file_acl;
+  uint32 i_size_high;
+  uint32 i_faddr;
+  uint8 i_osd2[12];
+} __attribute__((packed));
+typedef struct ext2_inode ext2_inode_t;
+
+struct ext2_dir_entry {
+  uint32 inode;
+  uint16 rec_len;
+  uint8 name_len;
+  uint8 file_type;
+  char name[];
+} __attribute__((packed));
+typedef struct ext2_dir_entry ext2_dir_entry_t;
+
+// ext4 extent tree. The root node is in i_block, other nodes take a block each.
+#define EXT4_EXTENT_MAGIC          0xF30A
+// An extent longer than this is uninitialized, and reads as zeros.
+#define EXT4_EXTENT_INIT_MAX_LEN   32768
+
+struct ext4_extent_header {
+  uint16 eh_magic;
+  uint16 eh_entries;
+  uint16 eh_max;
+  uint16 eh_depth;
+  uint32 eh_generation;
+} __attribute__((packed));
+typedef struct ext4_extent_header ext4_extent_header_t;
+
+struct ext4_extent_idx {
+  uint32 ei_block;
+  uint32 ei_leaf_lo;
+  uint16 ei_leaf_hi;
+  uint16 ei_unused;
+} __attribute__((packed));
+typedef struct ext4_extent_idx ext4_extent_idx_t;
+
+struct ext4_extent {
+  uint32 ee_block;
+  uint16 ee_len;
+  uint16 ee_start_hi;
+  uint32 ee_start_lo;
+} __attribute__((packed));
+typedef struct ext4_extent ext4_extent_t;
+
+// In-memory caches.
+struct ext2_cached_inode {
+  uint32 ino;
+  ext2_inode_t inode;
+  linked_list_node_t lru_node;
+};
+typedef struct ext2_cached_inode ext2_cached_inode_t;
+
+// Result of looking up name in a directory. ino is 0 if there is no such entry.
+struct ext2_dentry {
+  uint32 key;
+  uint32 parent_ino;
+  uint32 ino;
+  char name[EXT2_NAME_LEN_MAX + 1];
+  linked_list_node_t lru_node;
+};
+typedef struct ext2_dentry ext2_dentry_t;
+
+
+// ****************************************************************************
+// Mount the ext2 file system at byte offset of disk. Return false if there isn't one.
+bool init_ext2_fs(uint32 partition_offset);
+
+fs_t* get_ext2_fs();
+
+void ext2_print_stats();
+
+#endif
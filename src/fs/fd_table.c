@@ -0,0 +1,149 @@
+#include "fs/fd_table.h"
+#include "fs/vfs.h"
+#include "common/stdlib.h"
+#include "mem/kheap.h"
+
+void fd_table_init(fd_table_t* table) {
+  memset(table->files, 0, sizeof(table->files));
+  yieldlock_init(&table->lock);
+}
+
+static void put_file(file_t* file) {
+  yieldlock_lock(&file->lock);
+  int32 refcount = --file->refcount;
+  yieldlock_unlock(&file->lock);
+  if (refcount == 0) {
+    kfree(file);
+  }
+}
+
+void fd_table_copy(fd_table_t* dst, fd_table_t* src) {
+  yieldlock_lock(&src->lock);
+  for (uint32 i = 0; i < FD_TABLE_SIZE; i++) {
+    file_t* file = src->files[i];
+    if (file != nullptr) {
+      yieldlock_lock(&file->lock);
+      file->refcount++;
+      yieldlock_unlock(&file->lock);
+    }
+    dst->files[i] = file;
+  }
+  yieldlock_unlock(&src->lock);
+}
+
+void fd_table_release(fd_table_t* table) {
+  for (uint32 i = 0; i < FD_TABLE_SIZE; i++) {
+    fd_close(table, i);
+  }
+}
+
+int32 fd_open(fd_table_t* table, char* path) {
+  file_t* file = (file_t*)kmalloc(sizeof(file_t));
+  memset(file, 0, sizeof(file_t));
+  if (open_file(path, file) != 0) {
+    kfree(file);
+    return -1;
+  }
+  file->offset = 0;
+  file->refcount = 1;
+  yieldlock_init(&file->lock);
+
+  yieldlock_lock(&table->lock);
+  for (int32 fd = 0; fd < FD_TABLE_SIZE; fd++) {
+    if (table->files[fd] == nullptr) {
+      table->files[fd] = file;
+      yieldlock_unlock(&table->lock);
+      return fd;
+    }
+  }
+  yieldlock_unlock(&table->lock);
+  kfree(file);
+  return -1;
+}
+
+// Get file of fd with a reference held, which caller must put.
+static file_t* get_file(fd_table_t* table, int32 fd) {
+  if (fd < 0 || fd >= FD_TABLE_SIZE) {
+    return nullptr;
+  }
+  yieldlock_lock(&table->lock);
+  file_t* file = table->files[fd];
+  if (file != nullptr) {
+    yieldlock_lock(&file->lock);
+    file->refcount++;
+    yieldlock_unlock(&file->lock);
+  }
+  yieldlock_unlock(&table->lock);
+  return file;
+}
+
+int32 fd_close(fd_table_t* table, int32 fd) {
+  if (fd < 0 || fd >= FD_TABLE_SIZE) {
+    return -1;
+  }
+  yieldlock_lock(&table->lock);
+  file_t* file = table->files[fd];
+  table->files[fd] = nullptr;
+  yieldlock_unlock(&table->lock);
+  if (file == nullptr) {
+    return -1;
+  }
+  put_file(file);
+  return 0;
+}
+
+int32 fd_read(fd_table_t* table, int32 fd, char* buffer, uint32 size) {
+  file_t* file = get_file(table, fd);
+  if (file == nullptr) {
+    return -1;
+  }
+  // Reads on a shared file are serialized, so that each one gets its own range.
+  yieldlock_lock(&file->lock);
+  int32 read = read_open_file(file, buffer, file->offset, size);
+  if (read > 0) {
+    file->offset += read;
+  }
+  yieldlock_unlock(&file->lock);
+  put_file(file);
+  return read;
+}
+
+int32 fd_pread(fd_table_t* table, int32 fd, char* buffer, uint32 offset, uint32 size) {
+  file_t* file = get_file(table, fd);
+  if (file == nullptr) {
+    return -1;
+  }
+  int32 read = read_open_file(file, buffer, offset, size);
+  put_file(file);
+  return read;
+}
+
+int32 fd_lseek(fd_table_t* table, int32 fd, int32 offset, uint32 whence) {
+  file_t* file = get_file(table, fd);
+  if (file == nullptr) {
+    return -1;
+  }
+  yieldlock_lock(&file->lock);
+  int32 base;
+  if (whence == SEEK_SET) {
+    base = 0;
+  } else if (whence == SEEK_CUR) {
+    base = file->offset;
+  } else if (whence == SEEK_END) {
+    // File may be written or truncated since open.
+    base = -1;
+    if (stat_open_file(file, &file->stat) == 0) {
+      base = file->stat.size;
+    }
+  } else {
+    base = -1;
+  }
+  int32 new_offset = -1;
+  if (base >= 0 && base + offset >= 0) {
+    new_offset = base + offset;
+    file->offset = new_offset;
+  }
+  yieldlock_unlock(&file->lock);
+  put_file(file);
+  return new_offset;
+}
@@ -0,0 +1,52 @@
+#ifndef FS_FD_TABLE_H
+#define FS_FD_TABLE_H
+
+#include "common/common.h"
+#include "fs/file.h"
+#include "sync/yieldlock.h"
+
+#define FD_TABLE_SIZE  32
+
+struct file_system;
+
+// An open file. The path is resolved once on open, and the fs keeps whatever it needs to find
+// file data again in fs_private. It is shared by fd tables after fork, together with offset.
+struct file {
+  struct file_system* fs;
+  void* fs_private;
+  file_stat_t stat;
+  uint32 offset;
+  int32 refcount;
+  yieldlock_t lock;
+};
+typedef struct file file_t;
+
+struct fd_table {
+  file_t* files[FD_TABLE_SIZE];
+  yieldlock_t lock;
+};
+typedef struct fd_table fd_table_t;
+
+
+// ****************************************************************************
+void fd_table_init(fd_table_t* table);
+
+// Share all open files of src with dst, as fork does.
+void fd_table_copy(fd_table_t* dst, fd_table_t* src);
+
+// Close all files.
+void fd_table_release(fd_table_t* table);
+
+// Return fd, or -1 on failure.
+int32 fd_open(fd_table_t* table, char* path);
+int32 fd_close(fd_table_t* table, int32 fd);
+
+// Read from current offset and advance it.
+int32 fd_read(fd_table_t* table, int32 fd, char* buffer, uint32 size);
+// Read at given offset; current offset is not changed.
+int32 fd_pread(fd_table_t* table, int32 fd, char* buffer, uint32 offset, uint32 size);
+
+// Return the new offset, or -1 on failure.
+int32 fd_lseek(fd_table_t* table, int32 fd, int32 offset, uint32 whence);
+
+#endif
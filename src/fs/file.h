@@ -5,8 +5,15 @@
 
 struct file_stat {
   uint32 size;
+  // bumped on each write or truncate, so that cached file content can be told stale
+  uint32 version;
   uint8 acl;
 };
 typedef struct file_stat file_stat_t;
 
+// lseek whence
+#define SEEK_SET  0
+#define SEEK_CUR  1
+#define SEEK_END  2
+
 #endif
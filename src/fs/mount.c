@@ -0,0 +1,172 @@
+#include "fs/mount.h"
+#include "mem/kheap.h"
+#include "common/stdlib.h"
+#include "sync/yieldlock.h"
+#include "utils/string.h"
+
+#define MOUNT_PATH_LEN_MAX  256
+
+static mount_node_t root;
+static yieldlock_t mount_lock;
+
+void init_mount_table() {
+  memset(&root, 0, sizeof(mount_node_t));
+  hash_table_init(&root.children);
+  yieldlock_init(&mount_lock);
+}
+
+// Copy next component of path into name, and advance path past it. Return its length, which is
+// 0 at end of path, or -1 if it is too long.
+static int32 next_component(char** path, char* name) {
+  char* p = *path;
+  while (*p == '/') {
+    p++;
+  }
+  int32 length = 0;
+  while (p[length] != '/' && p[length] != '\0') {
+    length++;
+  }
+  if (length > MOUNT_NAME_LEN_MAX) {
+    return -1;
+  }
+  memcpy(name, p, length);
+  name[length] = '\0';
+  *path = p + length;
+  return length;
+}
+
+static mount_node_t* find_child(mount_node_t* node, char* name) {
+  mount_node_t* child = (mount_node_t*)hash_table_get(&node->children, str_hash(name));
+  if (child != nullptr && strcmp(child->name, name) == 0) {
+    return child;
+  }
+  return nullptr;
+}
+
+int32 mount_fs(char* path, fs_t* fs) {
+  char name[MOUNT_NAME_LEN_MAX + 1];
+  int32 length;
+
+  yieldlock_lock(&mount_lock);
+  mount_node_t* node = &root;
+  while ((length = next_component(&path, name)) != 0) {
+    if (length < 0) {
+      yieldlock_unlock(&mount_lock);
+      return -1;
+    }
+    if (length == 1 && name[0] == '.') {
+      continue;
+    }
+    mount_node_t* child = find_child(node, name);
+    if (child == nullptr) {
+      uint32 hash = str_hash(name);
+      if (hash_table_contains(&node->children, hash)) {
+        // Another name with the same hash.
+        yieldlock_unlock(&mount_lock);
+        return -1;
+      }
+      child = (mount_node_t*)kmalloc(sizeof(mount_node_t));
+      memset(child, 0, sizeof(mount_node_t));
+      strcpy(child->name, name);
+      child->parent = node;
+      hash_table_init(&child->children);
+      hash_table_put(&node->children, hash, child);
+    }
+    node = child;
+  }
+
+  if (node->fs != nullptr) {
+    yieldlock_unlock(&mount_lock);
+    return -1;
+  }
+  node->fs = fs;
+  yieldlock_unlock(&mount_lock);
+  return 0;
+}
+
+int32 umount_fs(char* path) {
+  char name[MOUNT_NAME_LEN_MAX + 1];
+  int32 length;
+
+  yieldlock_lock(&mount_lock);
+  mount_node_t* node = &root;
+  while ((length = next_component(&path, name)) != 0) {
+    if (length == 1 && name[0] == '.') {
+      continue;
+    }
+    node = (length > 0) ? find_child(node, name) : nullptr;
+    if (node == nullptr) {
+      yieldlock_unlock(&mount_lock);
+      return -1;
+    }
+  }
+  if (node->fs == nullptr) {
+    yieldlock_unlock(&mount_lock);
+    return -1;
+  }
+  node->fs = nullptr;
+
+  // Prune nodes no longer leading to any mount.
+  while (node != &root && node->fs == nullptr && node->children.size == 0) {
+    mount_node_t* parent = node->parent;
+    hash_table_remove(&parent->children, str_hash(node->name));
+    hash_table_destroy(&node->children);
+    kfree(node);
+    node = parent;
+  }
+  yieldlock_unlock(&mount_lock);
+  return 0;
+}
+
+fs_t* lookup_mount(char* path, char** fs_path) {
+  char name[MOUNT_NAME_LEN_MAX + 1];
+  int32 length;
+
+  yieldlock_lock(&mount_lock);
+  mount_node_t* node = &root;
+  fs_t* fs = root.fs;
+  *fs_path = path;
+  while ((length = next_component(&path, name)) > 0) {
+    if (length == 1 && name[0] == '.') {
+      continue;
+    }
+    node = find_child(node, name);
+    if (node == nullptr) {
+      break;
+    }
+    if (node->fs != nullptr) {
+      fs = node->fs;
+      *fs_path = path;
+    }
+  }
+  yieldlock_unlock(&mount_lock);
+  return fs;
+}
+
+static void visit_mounts(mount_node_t* node, char* path, uint32 path_length,
+                         mount_func func, void* arg) {
+  if (node->fs != nullptr) {
+    func(path_length > 0 ? path : "/", node->fs, arg);
+  }
+
+  hash_table_interator_t iter = hash_table_create_iterator(&node->children);
+  while (hash_table_iterator_has_next(&iter)) {
+    mount_node_t* child = (mount_node_t*)hash_table_iterator_next(&iter)->v_ptr;
+    uint32 name_length = strlen(child->name);
+    if (path_length + 1 + name_length >= MOUNT_PATH_LEN_MAX) {
+      continue;
+    }
+    path[path_length] = '/';
+    strcpy(path + path_length + 1, child->name);
+    visit_mounts(child, path, path_length + 1 + name_length, func, arg);
+    path[path_length] = '\0';
+  }
+}
+
+void for_each_mount(mount_func func, void* arg) {
+  char path[MOUNT_PATH_LEN_MAX];
+  path[0] = '\0';
+  yieldlock_lock(&mount_lock);
+  visit_mounts(&root, path, 0, func, arg);
+  yieldlock_unlock(&mount_lock);
+}
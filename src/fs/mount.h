@@ -0,0 +1,37 @@
+#ifndef FS_MOUNT_H
+#define FS_MOUNT_H
+
+#include "common/common.h"
+#include "fs/vfs.h"
+#include "utils/hash_table.h"
+
+#define MOUNT_NAME_LEN_MAX  63
+
+// Mount table is a trie of path components. A path is dispatched to the fs mounted at its
+// longest matching prefix, walking down one node per component.
+struct mount_node {
+  char name[MOUNT_NAME_LEN_MAX + 1];
+  struct mount_node* parent;
+  // fs mounted at this path, or nullptr if it is only on the way to deeper mounts
+  fs_t* fs;
+  // str_hash(name) -> child mount_node_t
+  hash_table_t children;
+};
+typedef struct mount_node mount_node_t;
+
+typedef void (*mount_func)(char* path, fs_t* fs, void* arg);
+
+
+// ****************************************************************************
+void init_mount_table();
+
+int32 mount_fs(char* path, fs_t* fs);
+int32 umount_fs(char* path);
+
+// Find fs that path is on. fs_path is set to the rest of path after the mount point.
+fs_t* lookup_mount(char* path, char** fs_path);
+
+// Call func on each mounted fs.
+void for_each_mount(mount_func func, void* arg);
+
+#endif
@@ -1,35 +1,141 @@
 #include "driver/hard_disk.h"
+#include "fs/buffer_cache.h"
 #include "fs/naive_fs.h"
 #include "monitor/monitor.h"
 #include "mem/kheap.h"
 #include "common/stdlib.h"
+#include "sync/yieldlock.h"
+#include "utils/debug.h"
 #include "utils/math.h"
+#include "utils/string.h"
 
 fs_t naive_fs;
-uint32 file_num;
-naive_file_meta_t* file_metas;
+
+static naive_file_t** files;
+static uint32 files_num;
+static uint32 files_capacity;
+
+static naive_file_index_slot_t* file_index;
+static uint32 file_index_capacity;
+
+// Log region, in absolute disk bytes.
+static uint32 log_start;
+static uint32 log_size;
+// Next transaction is written at log_start + log_head.
+static uint32 log_head;
+static uint32 log_next_seq;
+
+// Transaction being collected: header sector, then data. Its commit sector is separate.
+static char* staging_buffer;
+static uint32 staged_size;
+static naive_file_extent_t* staged_extents[NAIVE_LOG_TXN_RECORDS_MAX];
+
+// Protects files and the log.
+static yieldlock_t naive_fs_lock;
 
 fs_t* get_naive_fs() {
   return &naive_fs;
 }
 
-static int32 naive_fs_stat_file(char* filename, file_stat_t* stat) {
-  for (int i = 0; i < file_num; i++) {
-    naive_file_meta_t* meta = file_metas + i;
-    if (strcmp(meta->filename, filename) == 0) {
-      stat->size = meta->size;
-      return 0;
+static void index_file(uint32 i) {
+  uint32 hash = str_hash(files[i]->filename);
+  uint32 slot = hash & (file_index_capacity - 1);
+  while (file_index[slot].file_index >= 0) {
+    slot = (slot + 1) & (file_index_capacity - 1);
+  }
+  file_index[slot].hash = hash;
+  file_index[slot].file_index = i;
+}
+
+static void build_file_index() {
+  if (file_index != nullptr) {
+    kfree(file_index);
+  }
+  file_index_capacity = 16;
+  while (file_index_capacity < files_capacity * 2) {
+    file_index_capacity *= 2;
+  }
+  file_index = (naive_file_index_slot_t*)kmalloc(
+      file_index_capacity * sizeof(naive_file_index_slot_t));
+  for (uint32 i = 0; i < file_index_capacity; i++) {
+    file_index[i].file_index = -1;
+  }
+
+  for (uint32 i = 0; i < files_num; i++) {
+    index_file(i);
+  }
+}
+
+// Caller must hold the lock, as add_file may replace files and file_index. Files themselves are
+// never freed, so the one found stays valid after lock is released.
+static naive_file_t* find_file(char* filename) {
+  uint32 hash = str_hash(filename);
+  uint32 slot = hash & (file_index_capacity - 1);
+  while (file_index[slot].file_index >= 0) {
+    naive_file_t* file = files[file_index[slot].file_index];
+    if (file_index[slot].hash == hash && strcmp(file->filename, filename) == 0) {
+      return file;
     }
+    slot = (slot + 1) & (file_index_capacity - 1);
   }
-  return -1;
+  return nullptr;
+}
+
+// Caller must hold the lock.
+static naive_file_t* add_file(char* filename, uint32 size, uint32 base_offset) {
+  if (files_num == files_capacity) {
+    files_capacity *= 2;
+    naive_file_t** new_files = (naive_file_t**)kmalloc(files_capacity * sizeof(naive_file_t*));
+    memcpy(new_files, files, files_num * sizeof(naive_file_t*));
+    kfree(files);
+    files = new_files;
+    build_file_index();
+  }
+
+  naive_file_t* file = (naive_file_t*)kmalloc(sizeof(naive_file_t));
+  memset(file, 0, sizeof(naive_file_t));
+  strcpy(file->filename, filename);
+  file->size = size;
+  file->base_offset = base_offset;
+  file->base_size = size;
+  linked_list_init(&file->extents);
+
+  files[files_num] = file;
+  index_file(files_num);
+  files_num++;
+  return file;
+}
+
+static naive_file_extent_t* add_extent(naive_file_t* file, uint32 file_offset, uint32 length,
+                                       uint32 disk_addr, char* staged_data) {
+  naive_file_extent_t* extent = (naive_file_extent_t*)kmalloc(sizeof(naive_file_extent_t));
+  extent->file_offset = file_offset;
+  extent->length = length;
+  extent->disk_addr = disk_addr;
+  extent->staged_data = staged_data;
+  linked_list_append_ele(&file->extents, extent);
+  file->size = max(file->size, file_offset + length);
+  file->version++;
+  return extent;
+}
+
+static int32 naive_fs_stat_file(char* filename, file_stat_t* stat) {
+  yieldlock_lock(&naive_fs_lock);
+  naive_file_t* file = find_file(filename);
+  if (file != nullptr) {
+    stat->size = file->size;
+    stat->version = file->version;
+  }
+  yieldlock_unlock(&naive_fs_lock);
+  return file != nullptr ? 0 : -1;
 }
 
 static int32 naive_fs_list_dir(char* dir) {
-  uint32 size_length[file_num];
+  yieldlock_lock(&naive_fs_lock);
+  uint32 size_length[files_num];
   uint32 max_length = 0;
-  for (uint32 i = 0; i < file_num; i++) {
-    naive_file_meta_t* meta = file_metas + i;
-    uint32 size = meta->size;
+  for (uint32 i = 0; i < files_num; i++) {
+    uint32 size = files[i]->size;
     uint32 length = 1;
     while ((size /= 10) > 0) {
       length++;
@@ -38,41 +144,362 @@ static int32 naive_fs_list_dir(char* dir) {
     max_length = max(max_length, length);
   }
 
-  for (uint32 i = 0; i < file_num; i++) {
-    naive_file_meta_t* meta = file_metas + i;
+  for (uint32 i = 0; i < files_num; i++) {
+    naive_file_t* file = files[i];
     monitor_printf("root  ");
     for (uint32 j = 0; j < max_length - size_length[i]; j++) {
       monitor_printf(" ");
     }
-    monitor_printf("%d  %s\n", meta->size, meta->filename);
+    monitor_printf("%d  %s\n", file->size, file->filename);
   }
-  return -1;
+  yieldlock_unlock(&naive_fs_lock);
+  return 0;
+}
+
+// Read a part of file into kernel buffer. Extents overlapping it are taken under lock, and read
+// after it is released, so that the lock is not held during disk I/O. Return -1 on disk error.
+static int32 read_file_chunk(naive_file_t* file, char* buffer, uint32 start, uint32 length) {
+  uint32 end = start + length;
+
+  // Original data, and zeros for any hole beyond it.
+  if (start < file->base_size) {
+    uint32 base_end = min(end, file->base_size);
+    if (buffer_cache_read(buffer, naive_fs.partition.offset + file->base_offset + start,
+                          base_end - start) != 0) {
+      return -1;
+    }
+  }
+  if (end > file->base_size) {
+    uint32 zero_start = max(start, file->base_size);
+    memset(buffer + zero_start - start, 0, end - zero_start);
+  }
+
+  yieldlock_lock(&naive_fs_lock);
+  uint32 pieces_num = 0;
+  for (linked_list_node_t* node = file->extents.head; node != nullptr; node = node->next) {
+    naive_file_extent_t* extent = (naive_file_extent_t*)node->ptr;
+    if (max(start, extent->file_offset) < min(end, extent->file_offset + extent->length)) {
+      pieces_num++;
+    }
+  }
+  if (pieces_num == 0) {
+    yieldlock_unlock(&naive_fs_lock);
+    return 0;
+  }
+
+  // Staged data is copied, as its staging buffer is reused once committed.
+  naive_read_piece_t* pieces =
+      (naive_read_piece_t*)kmalloc(pieces_num * sizeof(naive_read_piece_t));
+  uint32 i = 0;
+  for (linked_list_node_t* node = file->extents.head; node != nullptr; node = node->next) {
+    naive_file_extent_t* extent = (naive_file_extent_t*)node->ptr;
+    uint32 copy_start = max(start, extent->file_offset);
+    uint32 copy_end = min(end, extent->file_offset + extent->length);
+    if (copy_start >= copy_end) {
+      continue;
+    }
+    naive_read_piece_t* piece = pieces + i++;
+    uint32 extent_offset = copy_start - extent->file_offset;
+    piece->offset = copy_start - start;
+    piece->length = copy_end - copy_start;
+    piece->disk_addr = extent->disk_addr + extent_offset;
+    piece->data = nullptr;
+    if (extent->staged_data != nullptr) {
+      piece->data = (char*)kmalloc(piece->length);
+      memcpy(piece->data, extent->staged_data + extent_offset, piece->length);
+    }
+  }
+  yieldlock_unlock(&naive_fs_lock);
+
+  // Overlay written extents, in order.
+  int32 result = 0;
+  for (i = 0; i < pieces_num; i++) {
+    naive_read_piece_t* piece = pieces + i;
+    if (piece->data != nullptr) {
+      memcpy(buffer + piece->offset, piece->data, piece->length);
+      kfree(piece->data);
+    } else if (result == 0 &&
+               buffer_cache_read(buffer + piece->offset, piece->disk_addr, piece->length) != 0) {
+      result = -1;
+    }
+  }
+  kfree(pieces);
+  return result;
+}
+
+static int32 read_file_data(naive_file_t* file, char* buffer, uint32 start, uint32 length) {
+  yieldlock_lock(&naive_fs_lock);
+  uint32 size = file->size;
+  yieldlock_unlock(&naive_fs_lock);
+  if (start >= size || length == 0) {
+    return 0;
+  }
+  if (length > size - start) {
+    length = size - start;
+  }
+
+  char* bounce = (char*)kmalloc(min(length, FS_BOUNCE_BUFFER_SIZE));
+  uint32 done = 0;
+  while (done < length) {
+    uint32 chunk = min(length - done, FS_BOUNCE_BUFFER_SIZE);
+    if (read_file_chunk(file, bounce, start + done, chunk) != 0) {
+      kfree(bounce);
+      return -1;
+    }
+    memcpy(buffer + done, bounce, chunk);
+    done += chunk;
+  }
+  kfree(bounce);
+  return length;
 }
 
 static int32 naive_fs_read_data(char* filename, char* buffer, uint32 start, uint32 length) {
-  naive_file_meta_t* file_meta = nullptr;
-  for (int i = 0; i < file_num; i++) {
-    naive_file_meta_t* meta = file_metas + i;
-    if (strcmp(meta->filename, filename) == 0) {
-      file_meta = meta;
+  yieldlock_lock(&naive_fs_lock);
+  naive_file_t* file = find_file(filename);
+  yieldlock_unlock(&naive_fs_lock);
+  if (file == nullptr) {
+    return -1;
+  }
+  return read_file_data(file, buffer, start, length);
+}
+
+static int32 naive_fs_open_file(char* filename, file_t* file) {
+  yieldlock_lock(&naive_fs_lock);
+  naive_file_t* naive_file = find_file(filename);
+  if (naive_file != nullptr) {
+    file->fs_private = naive_file;
+    file->stat.size = naive_file->size;
+    file->stat.version = naive_file->version;
+  }
+  yieldlock_unlock(&naive_fs_lock);
+  return naive_file != nullptr ? 0 : -1;
+}
+
+static int32 naive_fs_read_file_data(file_t* file, char* buffer, uint32 start, uint32 length) {
+  return read_file_data((naive_file_t*)file->fs_private, buffer, start, length);
+}
+
+static int32 naive_fs_stat_open_file(file_t* file, file_stat_t* stat) {
+  yieldlock_lock(&naive_fs_lock);
+  naive_file_t* naive_file = (naive_file_t*)file->fs_private;
+  stat->size = naive_file->size;
+  stat->version = naive_file->version;
+  yieldlock_unlock(&naive_fs_lock);
+  return 0;
+}
+
+// ********************************* write log *********************************
+static naive_log_txn_header_t* staged_header() {
+  return (naive_log_txn_header_t*)staging_buffer;
+}
+
+static uint32 txn_checksum(char* txn, uint32 data_sectors) {
+  uint32 checksum = 0;
+  uint32* words = (uint32*)txn;
+  for (uint32 i = 0; i < (1 + data_sectors) * SECTOR_SIZE / sizeof(uint32); i++) {
+    checksum = ((checksum << 1) | (checksum >> 31)) ^ words[i];
+  }
+  return checksum;
+}
+
+static uint32 txn_sectors(uint32 data_size) {
+  return 1 + (data_size + SECTOR_SIZE - 1) / SECTOR_SIZE + 1;
+}
+
+// Write staged transaction: header and data first, then the commit sector. Caller holds lock.
+// On failure, data stays staged and the transaction is written again on next commit.
+static int32 commit_staged() {
+  naive_log_txn_header_t* header = staged_header();
+  if (header->records_num == 0) {
+    return 0;
+  }
+
+  uint32 data_sectors = (staged_size + SECTOR_SIZE - 1) / SECTOR_SIZE;
+  header->magic = NAIVE_LOG_TXN_MAGIC;
+  header->seq = log_next_seq;
+  header->data_sectors = data_sectors;
+  memset(staging_buffer + SECTOR_SIZE + staged_size, 0, data_sectors * SECTOR_SIZE - staged_size);
+
+  uint32 txn_addr = log_start + log_head;
+  int32 result = write_hard_disk_sectors(staging_buffer, txn_addr / SECTOR_SIZE, 1 + data_sectors);
+
+  // Commit sector goes only after all data is written.
+  if (result == 0) {
+    char* commit_sector = (char*)kmalloc(SECTOR_SIZE);
+    memset(commit_sector, 0, SECTOR_SIZE);
+    naive_log_commit_t* commit = (naive_log_commit_t*)commit_sector;
+    commit->magic = NAIVE_LOG_COMMIT_MAGIC;
+    commit->seq = log_next_seq;
+    commit->checksum = txn_checksum(staging_buffer, data_sectors);
+    result = write_hard_disk_sectors(commit_sector, txn_addr / SECTOR_SIZE + 1 + data_sectors, 1);
+    kfree(commit_sector);
+  }
+
+  buffer_cache_invalidate(txn_addr, (2 + data_sectors) * SECTOR_SIZE);
+  if (result != 0) {
+    return -1;
+  }
+
+  // Extents now read from disk.
+  for (uint32 i = 0; i < header->records_num; i++) {
+    staged_extents[i]->staged_data = nullptr;
+  }
+
+  log_head += (2 + data_sectors) * SECTOR_SIZE;
+  log_next_seq++;
+  memset(staging_buffer, 0, SECTOR_SIZE);
+  staged_size = 0;
+  return 0;
+}
+
+// Append data to the staged transaction, committing it whenever it is full. Return the size
+// staged, which is short if the log is full or a commit fails. If *file is null, it is created
+// once its first data is staged, so that a rejected write leaves no empty file behind. Caller
+// holds lock.
+static uint32 stage_write(char* filename, naive_file_t** file, char* data, uint32 start,
+                          uint32 length, bool* no_space) {
+  uint32 written = 0;
+  while (written < length) {
+    naive_log_txn_header_t* header = staged_header();
+    if (header->records_num == NAIVE_LOG_TXN_RECORDS_MAX || staged_size == NAIVE_LOG_BATCH_SIZE) {
+      if (commit_staged() != 0) {
+        break;
+      }
+      continue;
+    }
+
+    uint32 chunk = min(length - written, NAIVE_LOG_BATCH_SIZE - staged_size);
+    if (log_head + txn_sectors(staged_size + chunk) * SECTOR_SIZE > log_size) {
+      *no_space = true;
       break;
     }
+
+    if (*file == nullptr) {
+      *file = add_file(filename, 0, 0);
+    }
+    naive_log_record_t* record = header->records + header->records_num;
+    strcpy(record->filename, filename);
+    record->file_offset = start + written;
+    record->length = chunk;
+    record->data_offset = staged_size;
+
+    char* staged_data = staging_buffer + SECTOR_SIZE + staged_size;
+    memcpy(staged_data, data + written, chunk);
+    uint32 disk_addr = log_start + log_head + SECTOR_SIZE + staged_size;
+    staged_extents[header->records_num] =
+        add_extent(*file, start + written, chunk, disk_addr, staged_data);
+
+    header->records_num++;
+    staged_size += chunk;
+    written += chunk;
   }
-  if (file_meta == nullptr) {
+  return written;
+}
+
+static int32 naive_fs_write_data(char* filename, char* buffer, uint32 start, uint32 length) {
+  if (strlen(filename) >= 64 || log_size == 0) {
     return -1;
   }
+  if (length == 0) {
+    return 0;
+  }
+
+  char* bounce = (char*)kmalloc(min(length, FS_BOUNCE_BUFFER_SIZE));
+  naive_file_t* file = nullptr;
+  uint32 written = 0;
+  bool no_space = false;
+  while (written < length) {
+    uint32 chunk = min(length - written, FS_BOUNCE_BUFFER_SIZE);
+    memcpy(bounce, buffer + written, chunk);
+
+    yieldlock_lock(&naive_fs_lock);
+    if (file == nullptr) {
+      file = find_file(filename);
+    }
+    uint32 staged = stage_write(filename, &file, bounce, start + written, chunk, &no_space);
+    yieldlock_unlock(&naive_fs_lock);
+    written += staged;
+    if (staged < chunk) {
+      break;
+    }
+  }
+  kfree(bounce);
 
-  uint32 offset = file_meta->offset;
-  uint32 size = file_meta->size;
-  if (length > size) {
-    length = size;
+  if (written == 0 && no_space) {
+    monitor_printf("naive fs log is full, write to %s refused\n", filename);
+    return FS_ERROR_NO_SPACE;
   }
 
-  read_hard_disk((char*)buffer, naive_fs.partition.offset + offset + start, length);
-  return length;  
+  // Large writes go to disk right away; small ones wait to be batched.
+  int32 result = 0;
+  yieldlock_lock(&naive_fs_lock);
+  if (staged_size >= NAIVE_LOG_BATCH_SIZE / 2) {
+    result = commit_staged();
+  }
+  yieldlock_unlock(&naive_fs_lock);
+  return (written > 0 && result == 0) ? (int32)written : -1;
 }
 
-static int32 naive_fs_write_data(char* filename, char* buffer, uint32 start, uint32 length) {
+static int32 naive_fs_sync() {
+  yieldlock_lock(&naive_fs_lock);
+  int32 result = commit_staged();
+  yieldlock_unlock(&naive_fs_lock);
+  return result;
+}
+
+// Apply committed transactions in log. Stop at the first one which is incomplete.
+static void replay_log() {
+  log_head = 0;
+  log_next_seq = 1;
+
+  char* txn = (char*)kmalloc(txn_sectors(NAIVE_LOG_BATCH_SIZE) * SECTOR_SIZE);
+  naive_log_txn_header_t* header = (naive_log_txn_header_t*)txn;
+  uint32 replayed = 0;
+  while (log_head + 2 * SECTOR_SIZE <= log_size) {
+    uint32 txn_addr = log_start + log_head;
+    if (buffer_cache_read(txn, txn_addr, SECTOR_SIZE) != 0) {
+      monitor_printf("naive fs couldn't read log at %d\n", log_head);
+      break;
+    }
+    if (header->magic != NAIVE_LOG_TXN_MAGIC || header->seq != log_next_seq ||
+        header->records_num == 0 || header->records_num > NAIVE_LOG_TXN_RECORDS_MAX ||
+        header->data_sectors * SECTOR_SIZE > NAIVE_LOG_BATCH_SIZE ||
+        log_head + (2 + header->data_sectors) * SECTOR_SIZE > log_size) {
+      break;
+    }
+
+    uint32 data_sectors = header->data_sectors;
+    if (buffer_cache_read(txn + SECTOR_SIZE, txn_addr + SECTOR_SIZE,
+                          (data_sectors + 1) * SECTOR_SIZE) != 0) {
+      monitor_printf("naive fs couldn't read log at %d\n", log_head);
+      break;
+    }
+    naive_log_commit_t* commit = (naive_log_commit_t*)(txn + (1 + data_sectors) * SECTOR_SIZE);
+    if (commit->magic != NAIVE_LOG_COMMIT_MAGIC || commit->seq != header->seq ||
+        commit->checksum != txn_checksum(txn, data_sectors)) {
+      break;
+    }
+
+    for (uint32 i = 0; i < header->records_num; i++) {
+      naive_log_record_t* record = header->records + i;
+      record->filename[63] = '\0';
+      naive_file_t* file = find_file(record->filename);
+      if (file == nullptr) {
+        file = add_file(record->filename, 0, 0);
+      }
+      add_extent(file, record->file_offset, record->length,
+                 txn_addr + SECTOR_SIZE + record->data_offset, nullptr);
+    }
+
+    log_head += (2 + data_sectors) * SECTOR_SIZE;
+    log_next_seq++;
+    replayed++;
+  }
+  kfree(txn);
+
+  if (replayed > 0) {
+    monitor_printf("naive fs replayed %d log transactions\n", replayed);
+  }
 }
 
 void init_naive_fs() {
@@ -83,15 +510,55 @@ void init_naive_fs() {
   naive_fs.read_data = naive_fs_read_data;
   naive_fs.write_data = naive_fs_write_data;
   naive_fs.list_dir = naive_fs_list_dir;
+  naive_fs.open_file = naive_fs_open_file;
+  naive_fs.read_file_data = naive_fs_read_file_data;
+  naive_fs.stat_open_file = naive_fs_stat_open_file;
+  naive_fs.sync = naive_fs_sync;
+
+  yieldlock_init(&naive_fs_lock);
 
-  read_hard_disk((char*)&file_num, 0 + naive_fs.partition.offset, sizeof(uint32));
+  uint32 file_num;
+  if (buffer_cache_read((char*)&file_num, 0 + naive_fs.partition.offset, sizeof(uint32)) != 0) {
+    monitor_printf("naive fs couldn't read file metas\n");
+    PANIC();
+  }
   //monitor_printf("naive fs found %d files:\n", file_num);
 
   uint32 meta_size = file_num * sizeof(naive_file_meta_t);
-  file_metas = (naive_file_meta_t*)kmalloc(meta_size);
-  read_hard_disk((char*)file_metas, 4 + naive_fs.partition.offset, meta_size);
+  naive_file_meta_t* file_metas = (naive_file_meta_t*)kmalloc(meta_size);
+  if (buffer_cache_read((char*)file_metas, 4 + naive_fs.partition.offset, meta_size) != 0) {
+    monitor_printf("naive fs couldn't read file metas\n");
+    PANIC();
+  }
+
+  files_num = 0;
+  files_capacity = max(file_num, 16);
+  files = (naive_file_t**)kmalloc(files_capacity * sizeof(naive_file_t*));
+  file_index = nullptr;
+  build_file_index();
+
+  log_start = 0;
+  log_size = 0;
   for (int i = 0; i < file_num; i++) {
     naive_file_meta_t* meta = file_metas + i;
     //monitor_printf(" - %s, offset = %d, size = %d\n", meta->filename, meta->offset, meta->size);
+    if (strcmp(meta->filename, NAIVE_LOG_FILENAME) == 0) {
+      log_start = naive_fs.partition.offset + meta->offset;
+      log_size = meta->size;
+      continue;
+    }
+    add_file(meta->filename, meta->size, meta->offset);
+  }
+  kfree(file_metas);
+
+  staging_buffer = (char*)kmalloc(SECTOR_SIZE + NAIVE_LOG_BATCH_SIZE);
+  memset(staging_buffer, 0, SECTOR_SIZE);
+  staged_size = 0;
+
+  if (log_size > 0 && log_start % SECTOR_SIZE == 0) {
+    replay_log();
+  } else {
+    log_size = 0;
+    monitor_printf("naive fs has no log region, it is read-only\n");
   }
 }
@@ -3,6 +3,7 @@
 
 #include "common/common.h"
 #include "fs/vfs.h"
+#include "utils/linked_list.h"
 
 fs_t* get_naive_fs();
 
@@ -13,6 +14,95 @@ struct naive_file_meta {
 };
 typedef struct naive_file_meta naive_file_meta_t;
 
+// Filename index, open addressing with linear probing. Capacity is a power of 2, at least twice
+// the number of files.
+struct naive_file_index_slot {
+  uint32 hash;
+  int32 file_index;  // -1 if empty
+};
+typedef struct naive_file_index_slot naive_file_index_slot_t;
+
+// ********************************* write log *********************************
+// Files are never written in place. Writes are appended to the log region - the data of a meta
+// entry named NAIVE_LOG_FILENAME, reserved by disk_image_writer - as transactions:
+//
+//   [header sector] [data sectors ...] [commit sector]
+//
+// A transaction only takes effect once its commit sector is on disk, so a crash in the middle
+// of a write leaves the file system as it was before it. On mount, committed transactions are
+// replayed in sequence, until the first invalid one.
+//
+// The log is never checkpointed - files have no room to grow at home, so extents live in the
+// log for good. Once its space is used up, writes fail with FS_ERROR_NO_SPACE, until the disk
+// image is written again.
+#define NAIVE_LOG_FILENAME          ".naive_log"
+#define NAIVE_LOG_TXN_MAGIC         0x4E4C5458
+#define NAIVE_LOG_COMMIT_MAGIC      0x4E4C434D
+#define NAIVE_LOG_TXN_RECORDS_MAX   6
+
+// Small writes are staged in memory, and committed together once this much data is collected,
+// or on sync.
+#define NAIVE_LOG_BATCH_SIZE        (64 * 1024)
+
+// A write of a file range. Its data is at data_offset of the transaction's data sectors.
+struct naive_log_record {
+  char filename[64];
+  uint32 file_offset;
+  uint32 length;
+  uint32 data_offset;
+};
+typedef struct naive_log_record naive_log_record_t;
+
+struct naive_log_txn_header {
+  uint32 magic;
+  uint32 seq;
+  uint32 records_num;
+  uint32 data_sectors;
+  naive_log_record_t records[NAIVE_LOG_TXN_RECORDS_MAX];
+};
+typedef struct naive_log_txn_header naive_log_txn_header_t;
+
+struct naive_log_commit {
+  uint32 magic;
+  uint32 seq;
+  uint32 checksum;  // of header sector and data sectors
+};
+typedef struct naive_log_commit naive_log_commit_t;
+
+// In memory, a file is its original data plus the extents written through the log, later ones
+// on top of earlier ones.
+struct naive_file_extent {
+  uint32 file_offset;
+  uint32 length;
+  // absolute byte address on disk
+  uint32 disk_addr;
+  // data in staging buffer, until its transaction is committed
+  char* staged_data;
+};
+typedef struct naive_file_extent naive_file_extent_t;
+
+struct naive_file {
+  char filename[64];
+  uint32 size;
+  uint32 version;
+  // original data in the image
+  uint32 base_offset;
+  uint32 base_size;
+  // naive_file_extent_t
+  linked_list_t extents;
+};
+typedef struct naive_file naive_file_t;
+
+// An extent overlapping a read, taken under lock and read after it is released. data is a copy
+// of staged data, or nullptr to read disk_addr.
+struct naive_read_piece {
+  uint32 offset;  // in read buffer
+  uint32 length;
+  uint32 disk_addr;
+  char* data;
+};
+typedef struct naive_read_piece naive_read_piece_t;
+
 
 // ****************************************************************************
 void init_naive_fs();
@@ -0,0 +1,384 @@
+#include "fs/tmpfs.h"
+#include "monitor/monitor.h"
+#include "mem/kheap.h"
+#include "common/stdlib.h"
+#include "sync/yieldlock.h"
+#include "task/scheduler.h"
+#include "utils/bitmap.h"
+#include "utils/math.h"
+#include "utils/string.h"
+
+#define TMPFS_HASH_BUCKETS  64
+
+fs_t tmpfs;
+
+static tmpfs_file_t* file_buckets[TMPFS_HASH_BUCKETS];
+static tmpfs_file_t* files_list;
+static uint32 files_num;
+
+// tmpfs virtual pages allocation
+static bitmap_t tmpfs_pages_map;
+static uint32 tmpfs_pages_bitarray[TMPFS_PAGES_MAX / 32];
+static uint32 pages_used;
+static uint32 max_pages;
+
+// Protects files and pages.
+static yieldlock_t tmpfs_lock;
+
+fs_t* get_tmpfs() {
+  return &tmpfs;
+}
+
+// ********************************** pages ************************************
+// Caller must hold the lock.
+static uint32 allocate_page() {
+  if (pages_used >= max_pages) {
+    return 0;
+  }
+  uint32 page_index;
+  if (!bitmap_allocate_first_free(&tmpfs_pages_map, &page_index)) {
+    return 0;
+  }
+  int32 frame = allocate_phy_frame();
+  if (frame < 0) {
+    bitmap_clear_bit(&tmpfs_pages_map, page_index);
+    return 0;
+  }
+
+  uint32 page = TMPFS_START + page_index * PAGE_SIZE;
+  map_page_with_frame(page, frame);
+  clear_page(page);
+  pages_used++;
+  return page;
+}
+
+// Caller must hold the lock. Like slab pages, tmpfs pages are never shared copy-on-write, so
+// the frame is released directly.
+static void release_page(uint32 page) {
+  int32 frame = get_phy_addr(page) / PAGE_SIZE;
+  release_pages(page, 1, false);
+  release_phy_frame(frame);
+  bitmap_clear_bit(&tmpfs_pages_map, (page - TMPFS_START) / PAGE_SIZE);
+  pages_used--;
+}
+
+// ********************************** files ************************************
+// Name of file in tmpfs, without leading '/'. Return nullptr if it is not a valid one.
+static char* file_name(char* path) {
+  while (*path == '/') {
+    path++;
+  }
+  uint32 length = strlen(path);
+  if (length == 0 || length >= TMPFS_FILENAME_MAX) {
+    return nullptr;
+  }
+  for (uint32 i = 0; i < length; i++) {
+    if (path[i] == '/') {
+      return nullptr;
+    }
+  }
+  return path;
+}
+
+// Caller must hold the lock.
+static tmpfs_file_t* find_file(char* name) {
+  tmpfs_file_t* file = file_buckets[str_hash(name) % TMPFS_HASH_BUCKETS];
+  while (file != nullptr && strcmp(file->filename, name) != 0) {
+    file = file->hash_next;
+  }
+  return file;
+}
+
+// Caller must hold the lock.
+static tmpfs_file_t* create_file(char* name) {
+  tmpfs_file_t* file = (tmpfs_file_t*)kmalloc(sizeof(tmpfs_file_t));
+  memset(file, 0, sizeof(tmpfs_file_t));
+  strcpy(file->filename, name);
+
+  uint32 bucket = str_hash(name) % TMPFS_HASH_BUCKETS;
+  file->hash_next = file_buckets[bucket];
+  file_buckets[bucket] = file;
+  file->list_next = files_list;
+  files_list = file;
+  files_num++;
+  return file;
+}
+
+// Make room for page index. Caller must hold the lock.
+static void reserve_pages(tmpfs_file_t* file, uint32 pages_num) {
+  if (pages_num <= file->pages_capacity) {
+    return;
+  }
+  uint32 capacity = max(file->pages_capacity * 2, 8);
+  while (capacity < pages_num) {
+    capacity *= 2;
+  }
+  uint32* pages = (uint32*)kmalloc(capacity * sizeof(uint32));
+  memset(pages, 0, capacity * sizeof(uint32));
+  if (file->pages != nullptr) {
+    memcpy(pages, file->pages, file->pages_capacity * sizeof(uint32));
+    kfree(file->pages);
+  }
+  file->pages = pages;
+  file->pages_capacity = capacity;
+}
+
+// Whether a file of size fits in the size limit - checked before its page array is grown, so that
+// a write at a large offset fails without asking for a huge page array. Caller must hold the lock.
+static bool size_fits(uint32 size) {
+  return size <= max_pages * PAGE_SIZE;
+}
+
+// Caller must hold the lock.
+static void resize_file(tmpfs_file_t* file, uint32 size) {
+  if (size < file->size) {
+    // Release pages wholly beyond new size, and zero the tail of the last page, so that it
+    // reads back as zeros if file grows again.
+    uint32 keep_pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    for (uint32 i = keep_pages; i < file->pages_capacity; i++) {
+      if (file->pages[i] != 0) {
+        release_page(file->pages[i]);
+        file->pages[i] = 0;
+      }
+    }
+    if (size % PAGE_SIZE != 0 && file->pages[size / PAGE_SIZE] != 0) {
+      memset((void*)(file->pages[size / PAGE_SIZE] + size % PAGE_SIZE), 0,
+             PAGE_SIZE - size % PAGE_SIZE);
+    }
+  }
+  file->size = size;
+  file->version++;
+}
+
+// Data is copied straight between file pages and caller buffer, a page at a time. The lock is
+// released while copying, as caller buffer may fault, and the fault may read a file again.
+static int32 read_file_data(tmpfs_file_t* file, char* buffer, uint32 start, uint32 length) {
+  uint32 done = 0;
+  while (done < length) {
+    // File may be truncated meanwhile, so its size is checked for each page.
+    yieldlock_lock(&tmpfs_lock);
+    uint32 pos = start + done;
+    if (pos >= file->size) {
+      yieldlock_unlock(&tmpfs_lock);
+      break;
+    }
+    uint32 page_offset = pos % PAGE_SIZE;
+    uint32 chunk = min(min(length - done, file->size - pos), PAGE_SIZE - page_offset);
+    uint32 page = file->pages[pos / PAGE_SIZE];
+    file->copying++;
+    yieldlock_unlock(&tmpfs_lock);
+
+    if (page != 0) {
+      memcpy(buffer + done, (void*)(page + page_offset), chunk);
+    } else {
+      memset(buffer + done, 0, chunk);
+    }
+
+    yieldlock_lock(&tmpfs_lock);
+    file->copying--;
+    yieldlock_unlock(&tmpfs_lock);
+    done += chunk;
+  }
+  return done;
+}
+
+// ******************************** fs functions *******************************
+static int32 tmpfs_stat_file(char* filename, file_stat_t* stat) {
+  char* name = file_name(filename);
+  if (name == nullptr) {
+    return -1;
+  }
+  yieldlock_lock(&tmpfs_lock);
+  tmpfs_file_t* file = find_file(name);
+  if (file != nullptr) {
+    stat->size = file->size;
+    stat->version = file->version;
+  }
+  yieldlock_unlock(&tmpfs_lock);
+  return file != nullptr ? 0 : -1;
+}
+
+static int32 tmpfs_list_dir(char* dir) {
+  while (*dir == '/') {
+    dir++;
+  }
+  if (dir[0] != '\0' && strcmp(dir, ".") != 0) {
+    return -1;
+  }
+
+  yieldlock_lock(&tmpfs_lock);
+  for (tmpfs_file_t* file = files_list; file != nullptr; file = file->list_next) {
+    uint32 size = file->size;
+    uint32 length = 1;
+    while ((size /= 10) > 0) {
+      length++;
+    }
+    monitor_printf("root  ");
+    for (uint32 i = length; i < 10; i++) {
+      monitor_printf(" ");
+    }
+    monitor_printf("%d  %s\n", file->size, file->filename);
+  }
+  yieldlock_unlock(&tmpfs_lock);
+  return 0;
+}
+
+static int32 tmpfs_read_data(char* filename, char* buffer, uint32 start, uint32 length) {
+  char* name = file_name(filename);
+  if (name == nullptr) {
+    return -1;
+  }
+  yieldlock_lock(&tmpfs_lock);
+  tmpfs_file_t* file = find_file(name);
+  yieldlock_unlock(&tmpfs_lock);
+  if (file == nullptr) {
+    return -1;
+  }
+  return read_file_data(file, buffer, start, length);
+}
+
+static int32 tmpfs_write_data(char* filename, char* buffer, uint32 start, uint32 length) {
+  char* name = file_name(filename);
+  if (name == nullptr || start + length < start) {
+    return -1;
+  }
+
+  yieldlock_lock(&tmpfs_lock);
+  if (!size_fits(start + length)) {
+    yieldlock_unlock(&tmpfs_lock);
+    return -1;
+  }
+  tmpfs_file_t* file = find_file(name);
+  if (file == nullptr) {
+    file = create_file(name);
+  }
+  yieldlock_unlock(&tmpfs_lock);
+  if (length == 0) {
+    return 0;
+  }
+
+  // Like read, a page at a time with the lock released while copying.
+  uint32 written = 0;
+  while (written < length) {
+    uint32 pos = start + written;
+    uint32 page_offset = pos % PAGE_SIZE;
+    uint32 chunk = min(length - written, PAGE_SIZE - page_offset);
+
+    yieldlock_lock(&tmpfs_lock);
+    uint32 page = 0;
+    if (size_fits(pos + chunk)) {
+      reserve_pages(file, pos / PAGE_SIZE + 1);
+      uint32* slot = file->pages + pos / PAGE_SIZE;
+      if (*slot == 0) {
+        *slot = allocate_page();
+      }
+      page = *slot;
+    }
+    if (page == 0) {
+      // Out of space.
+      yieldlock_unlock(&tmpfs_lock);
+      break;
+    }
+    file->copying++;
+    yieldlock_unlock(&tmpfs_lock);
+
+    memcpy((void*)(page + page_offset), buffer + written, chunk);
+
+    yieldlock_lock(&tmpfs_lock);
+    file->copying--;
+    file->size = max(file->size, pos + chunk);
+    file->version++;
+    yieldlock_unlock(&tmpfs_lock);
+    written += chunk;
+  }
+  return written > 0 ? (int32)written : -1;
+}
+
+static int32 tmpfs_truncate(char* filename, uint32 size) {
+  char* name = file_name(filename);
+  if (name == nullptr) {
+    return -1;
+  }
+  yieldlock_lock(&tmpfs_lock);
+  tmpfs_file_t* file = find_file(name);
+  bool ok = file != nullptr && size_fits(size);
+  // Pages being copied must not be released.
+  while (ok && size < file->size && file->copying > 0) {
+    yieldlock_unlock(&tmpfs_lock);
+    schedule_thread_yield();
+    yieldlock_lock(&tmpfs_lock);
+  }
+  if (ok) {
+    reserve_pages(file, (size + PAGE_SIZE - 1) / PAGE_SIZE);
+    resize_file(file, size);
+  }
+  yieldlock_unlock(&tmpfs_lock);
+  return ok ? 0 : -1;
+}
+
+static int32 tmpfs_open_file(char* filename, file_t* file) {
+  char* name = file_name(filename);
+  if (name == nullptr) {
+    return -1;
+  }
+  yieldlock_lock(&tmpfs_lock);
+  tmpfs_file_t* tmpfs_file = find_file(name);
+  if (tmpfs_file != nullptr) {
+    file->fs_private = tmpfs_file;
+    file->stat.size = tmpfs_file->size;
+    file->stat.version = tmpfs_file->version;
+  }
+  yieldlock_unlock(&tmpfs_lock);
+  return tmpfs_file != nullptr ? 0 : -1;
+}
+
+static int32 tmpfs_read_file_data(file_t* file, char* buffer, uint32 start, uint32 length) {
+  return read_file_data((tmpfs_file_t*)file->fs_private, buffer, start, length);
+}
+
+static int32 tmpfs_stat_open_file(file_t* file, file_stat_t* stat) {
+  yieldlock_lock(&tmpfs_lock);
+  tmpfs_file_t* tmpfs_file = (tmpfs_file_t*)file->fs_private;
+  stat->size = tmpfs_file->size;
+  stat->version = tmpfs_file->version;
+  yieldlock_unlock(&tmpfs_lock);
+  return 0;
+}
+
+static int32 tmpfs_sync() {
+  return 0;
+}
+
+void init_tmpfs(uint32 max_size) {
+  tmpfs.type = TMPFS;
+  tmpfs.partition.offset = 0;
+
+  tmpfs.stat_file = tmpfs_stat_file;
+  tmpfs.read_data = tmpfs_read_data;
+  tmpfs.write_data = tmpfs_write_data;
+  tmpfs.list_dir = tmpfs_list_dir;
+  tmpfs.open_file = tmpfs_open_file;
+  tmpfs.read_file_data = tmpfs_read_file_data;
+  tmpfs.stat_open_file = tmpfs_stat_open_file;
+  tmpfs.truncate = tmpfs_truncate;
+  tmpfs.sync = tmpfs_sync;
+
+  memset(file_buckets, 0, sizeof(file_buckets));
+  files_list = nullptr;
+  files_num = 0;
+
+  tmpfs_pages_map = bitmap_create(tmpfs_pages_bitarray, TMPFS_PAGES_MAX);
+  pages_used = 0;
+  max_pages = min(max_size / PAGE_SIZE, TMPFS_PAGES_MAX);
+  yieldlock_init(&tmpfs_lock);
+}
+
+void tmpfs_set_max_size(uint32 max_size) {
+  yieldlock_lock(&tmpfs_lock);
+  max_pages = min(max(max_size / PAGE_SIZE, pages_used), TMPFS_PAGES_MAX);
+  yieldlock_unlock(&tmpfs_lock);
+}
+
+void tmpfs_print_stats() {
+  monitor_printf("tmpfs: %d files, %d/%d pages\n", files_num, pages_used, max_pages);
+}
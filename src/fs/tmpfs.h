@@ -0,0 +1,45 @@
+#ifndef FS_TMPFS_H
+#define FS_TMPFS_H
+
+#include "common/common.h"
+#include "fs/vfs.h"
+#include "mem/paging.h"
+
+// File pages live in their own virtual space, right above slab. Each page is mapped to a frame
+// of its own, so that file data is read and written in place.
+#define TMPFS_START             0xE4000000
+#define TMPFS_MAX               0xE8000000
+#define TMPFS_PAGES_MAX         ((TMPFS_MAX - TMPFS_START) / PAGE_SIZE)
+
+#define TMPFS_SIZE_DEFAULT      (4 * 1024 * 1024)
+#define TMPFS_FILENAME_MAX      64
+
+// tmpfs has a single flat directory.
+struct tmpfs_file {
+  char filename[TMPFS_FILENAME_MAX];
+  uint32 size;
+  uint32 version;
+  // virtual address of each page, 0 for a hole
+  uint32* pages;
+  uint32 pages_capacity;
+  // threads copying to or from its pages with the lock released - pages are not released until
+  // they are done
+  uint32 copying;
+  // next file in the same hash bucket
+  struct tmpfs_file* hash_next;
+  struct tmpfs_file* list_next;
+};
+typedef struct tmpfs_file tmpfs_file_t;
+
+
+// ****************************************************************************
+void init_tmpfs(uint32 max_size);
+
+fs_t* get_tmpfs();
+
+// Change size limit. It never goes below pages already in use.
+void tmpfs_set_max_size(uint32 max_size);
+
+void tmpfs_print_stats();
+
+#endif
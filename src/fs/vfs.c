@@ -1,32 +1,139 @@
 #include "fs/vfs.h"
+#include "fs/mount.h"
 #include "fs/naive_fs.h"
+#include "fs/ext2.h"
+#include "fs/tmpfs.h"
+#include "fs/buffer_cache.h"
+#include "driver/hard_disk.h"
+#include "monitor/monitor.h"
+
+// The ext2 partition follows the naive fs image on disk, see Makefile.
+#define EXT2_PARTITION_SECTOR  8192
+
+// At most this many file systems are synced at once.
+#define SYNC_FS_MAX  16
 
 // ***************************** root fs APIs *********************************
-static fs_t* get_fs(char* path) {
-  // This is the only fs we have mount :)
-  return get_naive_fs();
+// Find the fs that path is on, and the path within that fs.
+static fs_t* get_fs(char* path, char** fs_path) {
+  return lookup_mount(path, fs_path);
 }
 
 void init_file_system() {
+  init_buffer_cache(BUFFER_CACHE_SIZE_DEFAULT);
+  init_mount_table();
+
   init_naive_fs();
+  mount_fs("/", get_naive_fs());
+  if (init_ext2_fs(EXT2_PARTITION_SECTOR * SECTOR_SIZE)) {
+    mount_fs("/ext2", get_ext2_fs());
+  }
+  init_tmpfs(TMPFS_SIZE_DEFAULT);
+  mount_fs("/tmp", get_tmpfs());
 }
 
 int32 stat_file(char* filename, file_stat_t* stat) {
-  fs_t* fs = get_fs(filename);
-  return fs->stat_file(filename, stat);
+  char* fs_path;
+  fs_t* fs = get_fs(filename, &fs_path);
+  if (fs == nullptr) {
+    return -1;
+  }
+  return fs->stat_file(fs_path, stat);
 }
 
 int32 list_dir(char* dir) {
-  fs_t* fs = get_fs(dir);
-  return fs->list_dir(dir);
+  char* fs_path;
+  fs_t* fs = get_fs(dir, &fs_path);
+  if (fs == nullptr) {
+    return -1;
+  }
+  return fs->list_dir(fs_path);
 }
 
 int32 read_file(char* filename, char* buffer, uint32 start, uint32 length) {
-  fs_t* fs = get_fs(filename);
-  return fs->read_data(filename, buffer, start, length);
+  char* fs_path;
+  fs_t* fs = get_fs(filename, &fs_path);
+  if (fs == nullptr) {
+    return -1;
+  }
+  return fs->read_data(fs_path, buffer, start, length);
 }
 
 int32 write_file(char* filename, char* buffer, uint32 start, uint32 length) {
-  fs_t* fs = get_fs(filename);
-  return fs->write_data(filename, buffer, start, length);
+  char* fs_path;
+  fs_t* fs = get_fs(filename, &fs_path);
+  if (fs == nullptr) {
+    return -1;
+  }
+  return fs->write_data(fs_path, buffer, start, length);
+}
+
+int32 truncate_file(char* filename, uint32 size) {
+  char* fs_path;
+  fs_t* fs = get_fs(filename, &fs_path);
+  if (fs == nullptr || fs->truncate == nullptr) {
+    return -1;
+  }
+  return fs->truncate(fs_path, size);
+}
+
+int32 open_file(char* filename, file_t* file) {
+  char* fs_path;
+  fs_t* fs = get_fs(filename, &fs_path);
+  if (fs == nullptr) {
+    return -1;
+  }
+  file->fs = fs;
+  return fs->open_file(fs_path, file);
+}
+
+int32 read_open_file(file_t* file, char* buffer, uint32 start, uint32 length) {
+  return file->fs->read_file_data(file, buffer, start, length);
+}
+
+int32 stat_open_file(file_t* file, file_stat_t* stat) {
+  return file->fs->stat_open_file(file, stat);
+}
+
+struct sync_list {
+  fs_t* fs[SYNC_FS_MAX];
+  uint32 num;
+};
+
+static void add_sync_fs(char* path, fs_t* fs, void* arg) {
+  struct sync_list* list = (struct sync_list*)arg;
+  if (list->num < SYNC_FS_MAX) {
+    list->fs[list->num++] = fs;
+  }
+}
+
+int32 sync_file_system() {
+  // Collect mounted fs first, so that no lock of mount table is held during disk I/O.
+  struct sync_list list;
+  list.num = 0;
+  for_each_mount(add_sync_fs, &list);
+
+  int32 result = 0;
+  for (uint32 i = 0; i < list.num; i++) {
+    if (list.fs[i]->sync != nullptr && list.fs[i]->sync() != 0) {
+      result = -1;
+    }
+  }
+  return result;
+}
+
+static void print_mount(char* path, fs_t* fs, void* arg) {
+  char* type = "naive";
+  if (fs->type == EXT2) {
+    type = "ext2";
+  } else if (fs->type == EXT4) {
+    type = "ext4";
+  } else if (fs->type == TMPFS) {
+    type = "tmpfs";
+  }
+  monitor_printf("%s on %s\n", type, path);
+}
+
+void print_mounts() {
+  for_each_mount(print_mount, nullptr);
 }
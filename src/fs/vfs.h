@@ -3,12 +3,23 @@
 
 #include "common/common.h"
 #include "fs/file.h"
+#include "fs/fd_table.h"
 
 enum fs_type {
   NAIVE,
-  EXT4
+  EXT2,
+  EXT4,
+  TMPFS
 };
 
+// Caller buffers of read and write may be user pages not faulted in yet, and their fault may read
+// a file again. So fs copies file data through a kernel buffer of up to this size, with no lock
+// held when it copies to or from caller buffer.
+#define FS_BOUNCE_BUFFER_SIZE  (16 * 1024)
+
+// Returned by write when fs has no space left for any of the data.
+#define FS_ERROR_NO_SPACE  -2
+
 struct disk_partition {
   uint32 offset;
 };
@@ -18,6 +29,15 @@ typedef int32 (*stat_file_func)(char* filename, file_stat_t* stat);
 typedef int32 (*list_dir_func)(char* dir);
 typedef int32 (*read_data_func)(char* filename, char* buffer, uint32 start, uint32 length);
 typedef int32 (*write_data_func)(char* filename, char* buffer, uint32 start, uint32 length);
+// Resolve path and fill fs_private and stat of file.
+typedef int32 (*open_file_func)(char* filename, file_t* file);
+typedef int32 (*read_file_data_func)(file_t* file, char* buffer, uint32 start, uint32 length);
+// Stat of an open file as of now - it may be written after open.
+typedef int32 (*stat_open_file_func)(file_t* file, file_stat_t* stat);
+// Set file size - data beyond it is dropped, and a hole reads as zeros.
+typedef int32 (*truncate_func)(char* filename, uint32 size);
+// Make buffered writes durable.
+typedef int32 (*sync_func)();
 
 struct file_system {
   enum fs_type type;
@@ -28,6 +48,12 @@ struct file_system {
   list_dir_func list_dir;
   read_data_func read_data;
   write_data_func write_data;
+  open_file_func open_file;
+  read_file_data_func read_file_data;
+  stat_open_file_func stat_open_file;
+  // optional
+  truncate_func truncate;
+  sync_func sync;
 };
 typedef struct file_system fs_t;
 
@@ -39,6 +65,15 @@ int32 stat_file(char* filename, file_stat_t* stat);
 int32 list_dir(char* dir);
 int32 read_file(char* filename, char* buffer, uint32 start, uint32 length);
 int32 write_file(char* filename, char* buffer, uint32 start, uint32 length);
+int32 truncate_file(char* filename, uint32 size);
+
+int32 open_file(char* filename, file_t* file);
+int32 read_open_file(file_t* file, char* buffer, uint32 start, uint32 length);
+int32 stat_open_file(file_t* file, file_stat_t* stat);
+
+int32 sync_file_system();
+
+void print_mounts();
 
 
 #endif
@@ -0,0 +1,150 @@
+#include "interrupt/apic.h"
+#include "interrupt/interrupt.h"
+#include "interrupt/timer.h"
+#include "mem/paging.h"
+#include "task/scheduler.h"
+#include "utils/math.h"
+
+extern void cpu_idle();
+
+static volatile uint32* lapic = nullptr;
+
+// Local APIC timer counts per timer tick.
+static uint32 lapic_timer_count = 0;
+
+static uint32 lapic_read(uint32 reg) {
+  return lapic[reg / 4];
+}
+
+static void lapic_write(uint32 reg, uint32 value) {
+  lapic[reg / 4] = value;
+  // Wait for write to finish, by reading.
+  lapic[LAPIC_ID / 4];
+}
+
+static void lapic_timer_callback(isr_params_t regs) {
+  schedule_timer_tick();
+}
+
+static void lapic_spurious_callback(isr_params_t regs) {}
+
+// Caller must have interrupts on, as timer ticks drive the wait.
+static void wait_ticks(uint32 ticks) {
+  uint32 target = getTick() + ticks;
+  while ((int32)(getTick() - target) < 0) {
+    cpu_idle();
+  }
+}
+
+static void enable_lapic() {
+  lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | LAPIC_SPURIOUS_INT_NUM);
+  lapic_write(LAPIC_LVT_ERROR, LAPIC_LVT_MASKED);
+  lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED);
+
+  // Clear error status - it must be written twice.
+  lapic_write(LAPIC_ESR, 0);
+  lapic_write(LAPIC_ESR, 0);
+
+  // Ack any outstanding interrupt, and accept all priorities.
+  lapic_write(LAPIC_EOI, 0);
+  lapic_write(LAPIC_TPR, 0);
+}
+
+void init_lapic(uint32 base_phy) {
+  map_page_with_frame_uncached(LAPIC_VIRTUAL, base_phy / PAGE_SIZE);
+  lapic = (volatile uint32*)LAPIC_VIRTUAL;
+
+  register_interrupt_handler(LAPIC_TIMER_INT_NUM, lapic_timer_callback);
+  register_interrupt_handler(LAPIC_SPURIOUS_INT_NUM, lapic_spurious_callback);
+
+  enable_lapic();
+
+  // Virtual wire mode: PIC is still connected to LINT0 of bootstrap processor.
+  lapic_write(LAPIC_LVT_LINT0, LAPIC_LVT_EXTINT);
+  lapic_write(LAPIC_LVT_LINT1, LAPIC_LVT_NMI);
+}
+
+void init_lapic_ap() {
+  enable_lapic();
+  lapic_write(LAPIC_LVT_LINT0, LAPIC_LVT_MASKED);
+  lapic_write(LAPIC_LVT_LINT1, LAPIC_LVT_NMI);
+}
+
+bool lapic_is_enabled() {
+  return lapic != nullptr;
+}
+
+uint32 lapic_id() {
+  return lapic_read(LAPIC_ID) >> 24;
+}
+
+void lapic_eoi() {
+  lapic_write(LAPIC_EOI, 0);
+}
+
+static void send_icr(uint32 apic_id, uint32 icr) {
+  lapic_write(LAPIC_ICR_HIGH, apic_id << 24);
+  lapic_write(LAPIC_ICR_LOW, icr);
+  while (lapic_read(LAPIC_ICR_LOW) & LAPIC_ICR_PENDING) {}
+}
+
+void lapic_send_ipi(uint32 apic_id, uint32 vector) {
+  send_icr(apic_id, vector);
+}
+
+void lapic_send_ipi_all_but_self(uint32 vector) {
+  send_icr(0, LAPIC_ICR_ALL_BUT_SELF | vector);
+}
+
+// Universal startup algorithm from MP spec: INIT, wait 10ms, then SIPI twice with 200us in
+// between. Timer tick is much longer than both waits, which does no harm.
+void lapic_start_ap(uint32 apic_id, uint32 boot_addr) {
+  send_icr(apic_id, LAPIC_ICR_INIT | LAPIC_ICR_LEVEL | LAPIC_ICR_ASSERT);
+  send_icr(apic_id, LAPIC_ICR_INIT | LAPIC_ICR_LEVEL);
+  wait_ticks(1);
+
+  for (uint32 i = 0; i < 2; i++) {
+    send_icr(apic_id, LAPIC_ICR_STARTUP | (boot_addr / PAGE_SIZE));
+    wait_ticks(1);
+  }
+}
+
+void lapic_calibrate_timer() {
+  lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_16);
+  lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED);
+
+  // Start right on a tick.
+  wait_ticks(1);
+  lapic_write(LAPIC_TIMER_INIT, 0xFFFFFFFF);
+  wait_ticks(LAPIC_CALIBRATE_TICKS);
+  uint32 elapsed = 0xFFFFFFFF - lapic_read(LAPIC_TIMER_CURRENT);
+  lapic_write(LAPIC_TIMER_INIT, 0);
+
+  lapic_timer_count = elapsed / LAPIC_CALIBRATE_TICKS;
+}
+
+void lapic_start_timer() {
+  lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_16);
+  lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_PERIODIC | LAPIC_TIMER_INT_NUM);
+  lapic_write(LAPIC_TIMER_INIT, lapic_timer_count);
+}
+
+bool lapic_timer_is_calibrated() {
+  return lapic_timer_count > 0;
+}
+
+void lapic_start_oneshot_timer(uint32 ticks) {
+  ticks = min(ticks, 0xFFFFFFFF / lapic_timer_count);
+  lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_16);
+  lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_INT_NUM);
+  lapic_write(LAPIC_TIMER_INIT, ticks * lapic_timer_count);
+}
+
+uint32 lapic_timer_elapsed_ticks() {
+  return (lapic_read(LAPIC_TIMER_INIT) - lapic_read(LAPIC_TIMER_CURRENT)) / lapic_timer_count;
+}
+
+void lapic_stop_timer() {
+  lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED);
+  lapic_write(LAPIC_TIMER_INIT, 0);
+}
@@ -0,0 +1,76 @@
+#ifndef INTERRUPT_APIC_H
+#define INTERRUPT_APIC_H
+
+#include "common/common.h"
+
+// Local APIC registers are memory mapped, at the same virtual address as physical.
+#define LAPIC_BASE_DEFAULT    0xFEE00000
+#define LAPIC_VIRTUAL         0xFEE00000
+
+#define LAPIC_ID              0x020
+#define LAPIC_VERSION         0x030
+#define LAPIC_TPR             0x080
+#define LAPIC_EOI             0x0B0
+#define LAPIC_SVR             0x0F0
+#define LAPIC_ESR             0x280
+#define LAPIC_ICR_LOW         0x300
+#define LAPIC_ICR_HIGH        0x310
+#define LAPIC_LVT_TIMER       0x320
+#define LAPIC_LVT_LINT0       0x350
+#define LAPIC_LVT_LINT1       0x360
+#define LAPIC_LVT_ERROR       0x370
+#define LAPIC_TIMER_INIT      0x380
+#define LAPIC_TIMER_CURRENT   0x390
+#define LAPIC_TIMER_DIVIDE    0x3E0
+
+#define LAPIC_SVR_ENABLE      (1 << 8)
+#define LAPIC_LVT_MASKED      (1 << 16)
+#define LAPIC_LVT_EXTINT      (7 << 8)
+#define LAPIC_LVT_NMI         (4 << 8)
+#define LAPIC_TIMER_PERIODIC  (1 << 17)
+#define LAPIC_TIMER_DIVIDE_16 0x3
+
+#define LAPIC_ICR_INIT            (5 << 8)
+#define LAPIC_ICR_STARTUP         (6 << 8)
+#define LAPIC_ICR_PENDING         (1 << 12)
+#define LAPIC_ICR_ASSERT          (1 << 14)
+#define LAPIC_ICR_LEVEL           (1 << 15)
+#define LAPIC_ICR_ALL_BUT_SELF    (3 << 18)
+
+// Timer ticks to measure local APIC timer rate over.
+#define LAPIC_CALIBRATE_TICKS     5
+
+
+// ****************************************************************************
+// Map local APIC and enable it on the bootstrap processor. PIC interrupts keep coming in
+// through LINT0.
+void init_lapic(uint32 base_phy);
+
+// Enable local APIC on an application processor.
+void init_lapic_ap();
+
+bool lapic_is_enabled();
+uint32 lapic_id();
+void lapic_eoi();
+
+void lapic_send_ipi(uint32 apic_id, uint32 vector);
+void lapic_send_ipi_all_but_self(uint32 vector);
+
+// Wake up an application processor with INIT-SIPI-SIPI, to run real mode code at boot_addr.
+void lapic_start_ap(uint32 apic_id, uint32 boot_addr);
+
+// Measure local APIC timer against timer ticks. Interrupts must be on.
+void lapic_calibrate_timer();
+
+// Start periodic timer interrupt on current cpu, at timer tick rate.
+void lapic_start_timer();
+
+bool lapic_timer_is_calibrated();
+
+// Timer interrupt once after the given ticks, or the longest timer can count if less. Ticks
+// passed since it started can be read back until it is stopped.
+void lapic_start_oneshot_timer(uint32 ticks);
+uint32 lapic_timer_elapsed_ticks();
+void lapic_stop_timer();
+
+#endif
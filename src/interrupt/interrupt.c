@@ -3,6 +3,9 @@
 #include "mem/gdt.h"
 #include "monitor/monitor.h"
 #include "interrupt/interrupt.h"
+#include "interrupt/apic.h"
+#include "interrupt/timer.h"
+#include "task/cpu.h"
 #include "utils/debug.h"
 
 extern void reload_idt(uint32);
@@ -16,8 +19,6 @@ static idt_entry_t idt_entries[256];
 
 static isr_t interrupt_handlers[256];
 
-bool in_irq_context = false;
-
 void init_idt() {
   idt_ptr.limit = sizeof(idt_entry_t) * 256 - 1;
   idt_ptr.base = (uint32)(&idt_entries);
@@ -77,6 +78,12 @@ void init_idt() {
   set_idt_gate(46, (uint32)isr46, SELECTOR_K_CODE, IDT_GATE_ATTR_DPL3);
   set_idt_gate(47, (uint32)isr47, SELECTOR_K_CODE, IDT_GATE_ATTR_DPL3);
 
+  // local APIC interrupts
+  set_idt_gate(48, (uint32)isr48, SELECTOR_K_CODE, IDT_GATE_ATTR_DPL0);
+  set_idt_gate(49, (uint32)isr49, SELECTOR_K_CODE, IDT_GATE_ATTR_DPL0);
+  set_idt_gate(50, (uint32)isr50, SELECTOR_K_CODE, IDT_GATE_ATTR_DPL0);
+  set_idt_gate(63, (uint32)isr63, SELECTOR_K_CODE, IDT_GATE_ATTR_DPL0);
+
   // soft int
   set_idt_gate(SYSCALL_INT_NUM, (uint32)syscall_entry , SELECTOR_K_CODE, IDT_GATE_ATTR_DPL3);
 
@@ -86,6 +93,10 @@ void init_idt() {
   init_pic();
 }
 
+void init_idt_ap() {
+  reload_idt((uint32)&idt_ptr);
+}
+
 static void set_idt_gate(uint8 num, uint32 base, uint16 sel, uint8 attrs) {
   idt_entries[num].handler_addr_low = base & 0xFFFF;
   idt_entries[num].handler_addr_high = (base >> 16) & 0xFFFF;
@@ -97,15 +108,30 @@ static void set_idt_gate(uint8 num, uint32 base, uint16 sel, uint8 attrs) {
 void isr_handler(isr_params_t params) {
   uint32 int_num = params.int_num;
 
-  // Send an EOI signal to the PICs for external interrupts
-  if (int_num >= 32 && int_num < SYSCALL_INT_NUM) {
-    if (int_num >= 40) {
-      // send reset signal to slave
-      outb(0xA0, 0x20);
+  // Hardware interrupt handlers run with interrupts off, so they stay on this cpu.
+  cpu_t* cpu = get_cpu();
+  bool irq = (int_num >= 32 && int_num < SYSCALL_INT_NUM);
+
+  // Send an EOI signal to the PICs for external interrupts, or to local APIC for its own.
+  if (irq) {
+    if (int_num >= LAPIC_TIMER_INT_NUM) {
+      if (int_num != LAPIC_SPURIOUS_INT_NUM) {
+        lapic_eoi();
+      }
+    } else {
+      if (int_num >= 40) {
+        // send reset signal to slave
+        outb(0xA0, 0x20);
+      }
+      // send reset signal to master
+      outb(0x20, 0x20);
+    }
+    cpu->in_irq_context = true;
+
+    // Timer may be stopped while this cpu was idle.
+    if (cpu->tickless) {
+      timer_idle_exit();
     }
-    // send reset signal to master
-    outb(0x20, 0x20);
-    in_irq_context = true;
   } else {
     // Not a hardware interrupt, enable interrupt as quickly as possible.
     enable_interrupt();
@@ -121,8 +147,8 @@ void isr_handler(isr_params_t params) {
   }
 
   // Clear in_irq_context flag and enable interrupt.
-  if (in_irq_context) {
-    in_irq_context = false;
+  if (irq) {
+    cpu->in_irq_context = false;
     enable_interrupt();
   }
 }
@@ -141,7 +167,7 @@ void disable_interrupt() {
 }
 
 bool is_in_irq_context() {
-  return in_irq_context;
+  return get_cpu()->in_irq_context;
 }
 
 void init_pic() {
@@ -39,6 +39,8 @@ struct idt_ptr_struct {
 typedef struct idt_ptr_struct idt_ptr_t;
 
 void init_idt();
+// Load idt on an application processor.
+void init_idt_ap();
 
 // ******************************** exceptions ****************************************
 extern void isr0();
@@ -92,6 +94,12 @@ extern void isr31();
 #define IRQ14_INT_NUM 46
 #define IRQ15_INT_NUM 47
 
+// local APIC interrupts, which are acked to local APIC rather than PIC
+#define LAPIC_TIMER_INT_NUM       48
+#define IPI_RESCHEDULE_INT_NUM    49
+#define IPI_TLB_FLUSH_INT_NUM     50
+#define LAPIC_SPURIOUS_INT_NUM    63
+
 #define SYSCALL_INT_NUM 0x80
 
 extern void isr32();
@@ -111,6 +119,11 @@ extern void isr45();
 extern void isr46();
 extern void isr47();
 
+extern void isr48();
+extern void isr49();
+extern void isr50();
+extern void isr63();
+
 
 // ******************************** handler ****************************************
 // argument struct for common isr_handler
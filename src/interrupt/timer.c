@@ -1,44 +1,191 @@
 #include "common/io.h"
 #include "monitor/monitor.h"
+#include "interrupt/apic.h"
 #include "interrupt/interrupt.h"
 #include "interrupt/timer.h"
+#include "sync/spinlock.h"
+#include "task/cpu.h"
 #include "task/thread.h"
 #include "task/scheduler.h"
+#include "utils/math.h"
+#include "utils/timer_wheel.h"
 
-uint32 tick = 0;
+#define PIT_FREQUENCY  1193180
+
+extern uint32 atomic_exchange(volatile uint32* dst, uint32 src);
+
+static volatile uint32 tick = 0;
+static uint32 pit_divisor;
+
+// Timer events are run by bootstrap processor, which keeps time.
+static timer_wheel_t timer_wheel;
+static spinlock_t timer_wheel_lock;
 
 uint32 getTick() {
   return tick;
 }
 
+static void run_timer_events() {
+  linked_list_t expired;
+  linked_list_init(&expired);
+  spinlock_lock(&timer_wheel_lock);
+  timer_wheel_advance(&timer_wheel, tick, &expired);
+  spinlock_unlock(&timer_wheel_lock);
+
+  // Get next node first - an event is gone once its callback runs.
+  linked_list_node_t* node = expired.head;
+  while (node != nullptr) {
+    linked_list_node_t* next_node = node->next;
+    timer_event_t* event = (timer_event_t*)node->ptr;
+    event->callback(event);
+    node = next_node;
+  }
+}
+
 static void timer_callback(isr_params_t regs) {
   if (tick % TIMER_FREQUENCY == 0) {
     //monitor_printf("second: %d\n", tick / TIMER_FREQUENCY);
   }
   tick++;
+  run_timer_events();
 
   // Check current thread time slice.
-  tcb_t* crt_thread = get_crt_thread();
-  crt_thread->ticks++;
-  if (crt_thread->ticks >= crt_thread->priority) {
-    crt_thread->need_reschedule = true;
-  }
+  schedule_timer_tick();
+}
+
+static void pit_start() {
+  // send the command byte.
+  outb(0x43, 0x36);
+
+  uint8 l = (uint8)(pit_divisor & 0xFF);
+  uint8 h = (uint8)((pit_divisor>>8) & 0xFF);
+
+  // Send the frequency divisor.
+  outb(0x40, l);
+  outb(0x40, h);
+
+  // Unmask IRQ0 on master PIC.
+  outb(0x21, inb(0x21) & ~0x01);
+}
+
+static void pit_stop() {
+  outb(0x21, inb(0x21) | 0x01);
 }
 
 void init_timer(uint32 frequency) {
   // register our timer callback.
   register_interrupt_handler(IRQ0_INT_NUM, &timer_callback);
 
+  spinlock_init(&timer_wheel_lock);
+  timer_wheel_init(&timer_wheel, tick);
+
   // the divisor must be small enough to fit into 16-bits.
-  uint32 divisor = 1193180 / frequency;
+  pit_divisor = PIT_FREQUENCY / frequency;
+  pit_start();
+}
 
-  // send the command byte.
-  outb(0x43, 0x36);
+// ******************************** sleep ***************************************
+static void wake_up_sleeper(timer_event_t* event) {
+  add_thread_node_to_schedule((thread_node_t*)event->data);
+}
+
+void timer_sleep_ticks(uint32 ticks) {
+  if (ticks == 0) {
+    return;
+  }
 
-  uint8 l = (uint8)(divisor & 0xFF);
-  uint8 h = (uint8)((divisor>>8) & 0xFF);
+  // The event lives on stack of this thread - it is done with before the thread wakes up.
+  timer_event_t event;
+  event.callback = wake_up_sleeper;
+  event.data = get_crt_thread_node();
 
-  // Send the frequency divisor.
-  outb(0x40, l);
-  outb(0x40, h);
+  spinlock_lock_irqsave(&timer_wheel_lock);
+  // Current tick is partly gone, so wait one more.
+  event.expires = tick + min(ticks, TIMER_WHEEL_MAX_TIMEOUT - 1) + 1;
+  timer_wheel_add(&timer_wheel, &event);
+  schedule_mark_thread_block();
+  spinlock_unlock_irqrestore(&timer_wheel_lock);
+
+  schedule_thread_yield();
+}
+
+void timer_sleep_ms(uint32 ms) {
+  uint32 seconds = min(ms / 1000, TIMER_WHEEL_MAX_TIMEOUT / TIMER_FREQUENCY);
+  timer_sleep_ticks(seconds * TIMER_FREQUENCY + ((ms % 1000) * TIMER_FREQUENCY + 999) / 1000);
+}
+
+int32 timer_nanosleep(timespec_t* duration) {
+  if (duration->tv_nsec >= 1000000000) {
+    return -1;
+  }
+  uint32 ns_per_tick = 1000000000 / TIMER_FREQUENCY;
+  uint32 seconds = min(duration->tv_sec, TIMER_WHEEL_MAX_TIMEOUT / TIMER_FREQUENCY);
+  timer_sleep_ticks(
+      seconds * TIMER_FREQUENCY + (duration->tv_nsec + ns_per_tick - 1) / ns_per_tick);
+  return 0;
+}
+
+// ***************************** tickless idle **********************************
+// An idle cpu stops its timer while halted. Application processors tick for scheduling only,
+// so they stop as soon as they go idle. Bootstrap processor keeps time and runs timer events -
+// it stops PIT only when all cpus are idle, and sets local APIC timer one-shot to the next
+// event, as PIT could not wait longer than 55ms. It is kicked back by the first other cpu that
+// wakes up.
+void timer_idle_enter() {
+  cpu_t* cpu = get_cpu();
+  if (!lapic_timer_is_calibrated() || !schedule_cpu_is_idle(cpu)) {
+    return;
+  }
+  if (cpu->id != 0) {
+    lapic_stop_timer();
+    cpu->tickless = true;
+    return;
+  }
+
+  // Set it before checking other cpus, which check it the other way round when they wake up.
+  atomic_exchange(&cpu->tickless, true);
+  if (!schedule_all_cpus_idle()) {
+    cpu->tickless = false;
+    return;
+  }
+
+  uint32 timeout = TIMER_WHEEL_MAX_TIMEOUT;
+  uint32 expires;
+  spinlock_lock(&timer_wheel_lock);
+  if (timer_wheel_next_expiry(&timer_wheel, &expires)) {
+    timeout = expires - tick;
+  }
+  spinlock_unlock(&timer_wheel_lock);
+  if ((int32)timeout <= 1) {
+    // Due by next tick anyway.
+    cpu->tickless = false;
+    return;
+  }
+
+  pit_stop();
+  lapic_start_oneshot_timer(timeout);
+}
+
+void timer_idle_exit() {
+  cpu_t* cpu = get_cpu();
+  if (cpu->id != 0) {
+    cpu->tickless = false;
+    lapic_start_timer();
+
+    // It may be getting work - bootstrap processor must keep time again.
+    cpu_t* bsp = get_cpu_by_id(0);
+    if (bsp->tickless) {
+      lapic_send_ipi(bsp->apic_id, IPI_RESCHEDULE_INT_NUM);
+    }
+    return;
+  }
+
+  uint32 elapsed = lapic_timer_elapsed_ticks();
+  lapic_stop_timer();
+  cpu->tickless = false;
+  pit_start();
+
+  // Catch up ticks missed, and run events due by now.
+  tick += elapsed;
+  run_timer_events();
 }
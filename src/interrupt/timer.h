@@ -5,8 +5,26 @@
 
 #define TIMER_FREQUENCY 50
 
+struct timespec {
+  uint32 tv_sec;
+  uint32 tv_nsec;
+};
+typedef struct timespec timespec_t;
+
 void init_timer(uint32 frequency);
 
 uint32 getTick();
 
+// Block current thread for at least the given time. It is rounded up to whole ticks.
+void timer_sleep_ticks(uint32 ticks);
+void timer_sleep_ms(uint32 ms);
+int32 timer_nanosleep(timespec_t* duration);
+
+// Stop timer of current cpu before it halts, if it has nothing to do until the next timer
+// event. Called by idle threads, with interrupts off.
+void timer_idle_enter();
+
+// Restart timer, on the first interrupt after it is stopped, and catch up missed ticks.
+void timer_idle_exit();
+
 #endif
@@ -4,10 +4,13 @@
 #include "mem/gdt.h"
 #include "mem/paging.h"
 #include "mem/kheap.h"
+#include "mem/slab.h"
 #include "task/thread.h"
 #include "task/process.h"
 #include "task/scheduler.h"
+#include "task/cpu.h"
 #include "fs/vfs.h"
+#include "elf/image_cache.h"
 #include "driver/hard_disk.h"
 #include "driver/keyboard.h"
 #include "utils/debug.h"
@@ -21,6 +24,7 @@ static void print_welcome() {
 }
 
 int main() {
+  init_cpus();
   init_gdt();
 
   monitor_init();
@@ -32,10 +36,12 @@ int main() {
 
   init_paging();
   init_kheap();
+  init_slab();
   init_paging_stage2();
 
   init_hard_disk();
   init_file_system();
+  init_image_cache();
 
   init_keyboard();
 
@@ -0,0 +1,189 @@
+#include "monitor/monitor.h"
+#include "mem/buddy.h"
+#include "utils/debug.h"
+
+static void free_list_push(buddy_t* this, uint32 frame, uint32 order) {
+  buddy_block_t* block = this->blocks + frame;
+  block->order = order;
+  block->is_free = true;
+  block->prev = BUDDY_NIL;
+  block->next = this->free_lists[order];
+  if (block->next != BUDDY_NIL) {
+    this->blocks[block->next].prev = frame;
+  }
+  this->free_lists[order] = frame;
+  this->free_blocks_num[order]++;
+}
+
+static void free_list_remove(buddy_t* this, uint32 frame) {
+  buddy_block_t* block = this->blocks + frame;
+  uint32 order = block->order;
+  if (block->prev != BUDDY_NIL) {
+    this->blocks[block->prev].next = block->next;
+  } else {
+    this->free_lists[order] = block->next;
+  }
+  if (block->next != BUDDY_NIL) {
+    this->blocks[block->next].prev = block->prev;
+  }
+  block->prev = BUDDY_NIL;
+  block->next = BUDDY_NIL;
+  block->is_free = false;
+  this->free_blocks_num[order]--;
+}
+
+void buddy_init(buddy_t* this, buddy_block_t* blocks, uint32 total_frames) {
+  this->blocks = blocks;
+  this->total_frames = total_frames;
+  this->free_frames = 0;
+  for (uint32 i = 0; i < BUDDY_ORDER_NUM; i++) {
+    this->free_lists[i] = BUDDY_NIL;
+    this->free_blocks_num[i] = 0;
+  }
+
+  for (uint32 i = 0; i < total_frames; i++) {
+    blocks[i].prev = BUDDY_NIL;
+    blocks[i].next = BUDDY_NIL;
+    blocks[i].order = 0;
+    blocks[i].is_free = false;
+  }
+}
+
+void buddy_free_range(buddy_t* this, uint32 start_frame, uint32 frames_num) {
+  uint32 frame = start_frame;
+  uint32 end_frame = start_frame + frames_num;
+  ASSERT(end_frame <= this->total_frames);
+
+  // Cut the range into the largest aligned blocks.
+  while (frame < end_frame) {
+    uint32 order = 0;
+    while (order < BUDDY_MAX_ORDER &&
+           (frame & ((1 << (order + 1)) - 1)) == 0 &&
+           frame + (1 << (order + 1)) <= end_frame) {
+      order++;
+    }
+    this->blocks[frame].order = order;
+    buddy_free(this, frame, order);
+    frame += (1 << order);
+  }
+}
+
+bool buddy_alloc(buddy_t* this, uint32 order, uint32* frame) {
+  ASSERT(order <= BUDDY_MAX_ORDER);
+
+  // Find the smallest free block that fits.
+  uint32 crt_order = order;
+  while (crt_order <= BUDDY_MAX_ORDER && this->free_lists[crt_order] == BUDDY_NIL) {
+    crt_order++;
+  }
+  if (crt_order > BUDDY_MAX_ORDER) {
+    return false;
+  }
+
+  uint32 block = this->free_lists[crt_order];
+  free_list_remove(this, block);
+
+  // Split it down to the requested order, returning the upper halves to free lists.
+  while (crt_order > order) {
+    crt_order--;
+    free_list_push(this, block + (1 << crt_order), crt_order);
+  }
+
+  this->blocks[block].order = order;
+  this->blocks[block].is_free = false;
+  this->free_frames -= (1 << order);
+  *frame = block;
+  return true;
+}
+
+void buddy_free(buddy_t* this, uint32 frame, uint32 order) {
+  ASSERT(frame < this->total_frames);
+  ASSERT((frame & ((1 << order) - 1)) == 0);
+  ASSERT(!this->blocks[frame].is_free);
+  ASSERT(this->blocks[frame].order == order);
+
+  this->free_frames += (1 << order);
+
+  // Merge with buddy as long as it is free and has the same order.
+  while (order < BUDDY_MAX_ORDER) {
+    uint32 buddy = frame ^ (1 << order);
+    if (buddy >= this->total_frames) {
+      break;
+    }
+    buddy_block_t* buddy_block = this->blocks + buddy;
+    if (!buddy_block->is_free || buddy_block->order != order) {
+      break;
+    }
+    free_list_remove(this, buddy);
+    if (buddy < frame) {
+      frame = buddy;
+    }
+    order++;
+  }
+
+  free_list_push(this, frame, order);
+}
+
+uint32 buddy_free_frames_num(buddy_t* this) {
+  return this->free_frames;
+}
+
+void buddy_print(buddy_t* this) {
+  monitor_printf("*************************** buddy *****************************\n");
+  monitor_printf("free frames: %d / %d\n", this->free_frames, this->total_frames);
+  for (uint32 i = 0; i < BUDDY_ORDER_NUM; i++) {
+    monitor_printf("order %d: %d blocks\n", i, this->free_blocks_num[i]);
+  }
+  monitor_printf("***************************************************************\n");
+}
+
+
+// ******************************** unit tests **********************************
+void buddy_test() {
+  monitor_print("buddy test ... ");
+
+  static buddy_block_t blocks[4096];
+  buddy_t buddy;
+  buddy_init(&buddy, blocks, 4096);
+  ASSERT(buddy_free_frames_num(&buddy) == 0);
+
+  // [1, 4096) is cut into blocks of order 0, 1, 2, ... 10, 10, 10.
+  buddy_free_range(&buddy, 1, 4095);
+  ASSERT(buddy_free_frames_num(&buddy) == 4095);
+  ASSERT(buddy.free_blocks_num[0] == 1);
+  ASSERT(buddy.free_blocks_num[9] == 1);
+  ASSERT(buddy.free_blocks_num[BUDDY_MAX_ORDER] == 3);
+
+  uint32 frame;
+  ASSERT(buddy_alloc(&buddy, 0, &frame));
+  ASSERT(frame == 1);
+  uint32 frame2;
+  ASSERT(buddy_alloc(&buddy, 0, &frame2));
+  ASSERT(frame2 == 2);
+
+  // Order-4 block must be aligned to 16 frames.
+  uint32 frame3;
+  ASSERT(buddy_alloc(&buddy, 4, &frame3));
+  ASSERT((frame3 & 15) == 0);
+  ASSERT(buddy_free_frames_num(&buddy) == 4095 - 18);
+
+  buddy_free(&buddy, frame3, 4);
+  buddy_free(&buddy, frame2, 0);
+  buddy_free(&buddy, frame, 0);
+  ASSERT(buddy_free_frames_num(&buddy) == 4095);
+  ASSERT(buddy.free_blocks_num[0] == 1);
+  ASSERT(buddy.free_blocks_num[BUDDY_MAX_ORDER] == 3);
+
+  // Exhaust all memory with order-0 allocations.
+  for (uint32 i = 0; i < 4095; i++) {
+    ASSERT(buddy_alloc(&buddy, 0, &frame));
+  }
+  ASSERT(!buddy_alloc(&buddy, 0, &frame));
+  for (uint32 i = 1; i < 4096; i++) {
+    buddy_free(&buddy, i, 0);
+  }
+  ASSERT(buddy_free_frames_num(&buddy) == 4095);
+  ASSERT(buddy.free_blocks_num[BUDDY_MAX_ORDER] == 3);
+
+  monitor_print_with_color("OK\n", COLOR_GREEN);
+}
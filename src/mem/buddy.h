@@ -0,0 +1,54 @@
+#ifndef MEM_BUDDY_H
+#define MEM_BUDDY_H
+
+#include "common/common.h"
+
+// Blocks of 2^0 ... 2^BUDDY_MAX_ORDER frames, the largest being 4MB.
+#define BUDDY_MAX_ORDER  10
+#define BUDDY_ORDER_NUM  (BUDDY_MAX_ORDER + 1)
+
+#define BUDDY_NIL  -1
+
+// Per-frame bookkeeping. Only the first frame of a block is meaningful: it records the
+// block order and, for free blocks, the links of the free list of that order.
+struct buddy_block {
+  int32 prev;
+  int32 next;
+  int8 order;
+  uint8 is_free;
+} __attribute__((packed));
+typedef struct buddy_block buddy_block_t;
+
+struct buddy_allocator {
+  buddy_block_t* blocks;
+  uint32 total_frames;
+  uint32 free_frames;
+  int32 free_lists[BUDDY_ORDER_NUM];
+  uint32 free_blocks_num[BUDDY_ORDER_NUM];
+};
+typedef struct buddy_allocator buddy_t;
+
+
+// ****************************************************************************
+// Initialize the allocator with all frames marked as allocated. Call buddy_free_range() to
+// hand usable memory to it.
+void buddy_init(buddy_t* this, buddy_block_t* blocks, uint32 total_frames);
+
+// Release a range of frames, which were reserved at init, to the allocator.
+void buddy_free_range(buddy_t* this, uint32 start_frame, uint32 frames_num);
+
+// Allocate 2^order continuous frames. The first frame is stored in *frame.
+bool buddy_alloc(buddy_t* this, uint32 order, uint32* frame);
+
+// Free a block allocated by buddy_alloc, with the same order.
+void buddy_free(buddy_t* this, uint32 frame, uint32 order);
+
+uint32 buddy_free_frames_num(buddy_t* this);
+
+void buddy_print(buddy_t* this);
+
+
+// ******************************** unit tests **********************************
+void buddy_test();
+
+#endif
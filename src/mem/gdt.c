@@ -2,14 +2,18 @@
 #include "common/global.h"
 #include "monitor/monitor.h"
 #include "mem/gdt.h"
+#include "task/cpu.h"
 
 extern void load_gdt(gdt_ptr_t*);
-extern void refresh_tss();
+extern void refresh_tss(uint32 selector);
+
+#define GDT_ENTRIES_NUM  (GDT_TSS_START + MAX_CPUS)
 
 static gdt_ptr_t gdt_ptr;
-static gdt_entry_t gdt_entries[7];
+static gdt_entry_t gdt_entries[GDT_ENTRIES_NUM];
 
-static tss_entry_t tss_entry;
+// one tss for each cpu
+static tss_entry_t tss_entries[MAX_CPUS];
 
 static void refresh_gdt() {
   load_gdt(&gdt_ptr);
@@ -26,10 +30,11 @@ static void gdt_set_gate(int32 num, uint32 base, uint32 limit, uint8 access, uin
 }
 
 static void write_tss(uint32 num, uint16 ss0, uint32 esp0) {
-  memset(&tss_entry, 0, sizeof(tss_entry_t));
-  tss_entry.ss0 = ss0;
-  tss_entry.esp0 = esp0;
-  tss_entry.iomap_base = sizeof(tss_entry_t);
+  tss_entry_t* tss_entry = &tss_entries[num - GDT_TSS_START];
+  memset(tss_entry, 0, sizeof(tss_entry_t));
+  tss_entry->ss0 = ss0;
+  tss_entry->esp0 = esp0;
+  tss_entry->iomap_base = sizeof(tss_entry_t);
 
   // Here we set the cs, ss, ds, es, fs and gs entries in the TSS. These specify what
   // segments should be loaded when the processor switches to kernel mode. Therefore
@@ -37,16 +42,17 @@ static void write_tss(uint32 num, uint16 ss0, uint32 esp0) {
   // but with the last two bits set, making 0x0b and 0x13. The setting of these bits
   // sets the RPL (requested privilege level) to 3, meaning that this TSS can be used
   // to switch to kernel mode from ring 3.
-  tss_entry.cs = SELECTOR_K_CODE | RPL3;
-  tss_entry.ss = tss_entry.ds = tss_entry.es = tss_entry.fs = tss_entry.gs = SELECTOR_K_DATA | RPL3;
+  tss_entry->cs = SELECTOR_K_CODE | RPL3;
+  tss_entry->ss = tss_entry->ds = tss_entry->es = tss_entry->fs = tss_entry->gs =
+      SELECTOR_K_DATA | RPL3;
 
-  uint32 base = (uint32)&tss_entry;
-  uint32 limit = base + sizeof(tss_entry);
+  uint32 base = (uint32)tss_entry;
+  uint32 limit = base + sizeof(tss_entry_t);
   gdt_set_gate(num, base, limit, DESC_P | DESC_DPL_0 | DESC_S_SYS | DESC_TYPE_TSS, 0x0);
 }
 
 void init_gdt() {
-  gdt_ptr.limit = (sizeof(gdt_entry_t) * 7) - 1;
+  gdt_ptr.limit = (sizeof(gdt_entry_t) * GDT_ENTRIES_NUM) - 1;
   gdt_ptr.base = (uint32)&gdt_entries;
 
   // reserved
@@ -64,13 +70,20 @@ void init_gdt() {
   // user data
   gdt_set_gate(5, 0, 0xBFFFF, DESC_P | DESC_DPL_3 | DESC_S_DATA | DESC_TYPE_DATA, FLAG_G_4K | FLAG_D_32);
 
-  // tss: 
-  write_tss(6, 0x10, 0x0);
+  // tss of each cpu
+  for (uint32 i = 0; i < MAX_CPUS; i++) {
+    write_tss(GDT_TSS_START + i, 0x10, 0x0);
+  }
 
   refresh_gdt((uint32)&gdt_ptr);
-  refresh_tss();
+  refresh_tss(SELECTOR_TSS(0));
+}
+
+void init_gdt_ap(uint32 cpu_id) {
+  refresh_gdt();
+  refresh_tss(SELECTOR_TSS(cpu_id));
 }
 
 void update_tss_esp(uint32 esp) {
-  tss_entry.esp0 = esp;
+  tss_entries[get_cpu()->id].esp0 = esp;
 }
@@ -39,6 +39,10 @@
 #define SELECTOR_U_CODE   ((4 << 3) + (TI_GDT << 2) + RPL3)
 #define SELECTOR_U_DATA   ((5 << 3) + (TI_GDT << 2) + RPL3)
 
+// Each cpu has its own tss, from this entry on.
+#define GDT_TSS_START     6
+#define SELECTOR_TSS(cpu_id)  (((GDT_TSS_START + (cpu_id)) << 3) + (TI_GDT << 2) + RPL0)
+
 
 // ****************************************************************************
 struct gdt_ptr {
@@ -92,7 +96,10 @@ typedef struct tss_entry_struct tss_entry_t;
 
 // ****************************************************************************
 void init_gdt();
+// Load gdt and tss on an application processor.
+void init_gdt_ap(uint32 cpu_id);
 
+// Kernel stack of current thread, on current cpu's tss.
 void update_tss_esp(uint32 esp);
 
 #endif
@@ -1,6 +1,7 @@
 #include "monitor/monitor.h"
 #include "mem/kheap.h"
 #include "mem/paging.h"
+#include "mem/slab.h"
 #include "sync/yieldlock.h"
 #include "utils/debug.h"
 #include "utils/rand.h"
@@ -70,10 +71,33 @@ static kheap_block_header_t* make_block(uint32 start, uint32 size, uint8 is_hole
   return block_header;
 }
 
-static int32 kheap_block_comparator(type_t x, type_t y) {
-  uint32 size1 = ((kheap_block_header_t*)x)->size;
-  uint32 size2 = ((kheap_block_header_t*)y)->size;
-  return size1 < size2 ? -1 : (size1 == size2 ? 0 : 1);
+// Each hole embeds its index tree node right after the header.
+static rb_node_t* hole_node(kheap_block_header_t* header) {
+  return (rb_node_t*)((uint32)header + HEADER_SIZE);
+}
+
+static kheap_block_header_t* hole_header(rb_node_t* node) {
+  return (kheap_block_header_t*)((uint32)node - HEADER_SIZE);
+}
+
+// Holes are ordered by size, and then by address, so that best fit picks the lowest one.
+static int32 kheap_block_comparator(rb_node_t* x, rb_node_t* y) {
+  uint32 size1 = hole_header(x)->size;
+  uint32 size2 = hole_header(y)->size;
+  if (size1 != size2) {
+    return size1 < size2 ? -1 : 1;
+  }
+  uint32 addr1 = (uint32)x;
+  uint32 addr2 = (uint32)y;
+  return addr1 < addr2 ? -1 : (addr1 == addr2 ? 0 : 1);
+}
+
+static void insert_hole(kheap_t* this, kheap_block_header_t* header) {
+  rb_tree_insert(&this->index, hole_node(header));
+}
+
+static void remove_hole(kheap_t* this, kheap_block_header_t* header) {
+  rb_tree_remove(&this->index, hole_node(header));
 }
 
 kheap_t create_kheap(uint32 start, uint32 end, uint32 max, uint8 supervisor, uint8 readonly) {
@@ -82,11 +106,8 @@ kheap_t create_kheap(uint32 start, uint32 end, uint32 max, uint8 supervisor, uin
 
   kheap_t kheap;
 
-  // Initialize the index array.
-  kheap.index = ordered_array_create((type_t*)start, KHEAP_INDEX_NUM, &kheap_block_comparator);
-
-  // Shift the start address forward to resemble where we can start putting data.
-  start += ((sizeof(type_t) * KHEAP_INDEX_NUM));
+  // Initialize the index tree. Its nodes live inside holes, so it takes no space by itself.
+  rb_tree_init(&kheap.index, &kheap_block_comparator);
 
   // Write the start, end and max addresses into the heap structure.
   kheap.start_address = start;
@@ -97,47 +118,70 @@ kheap_t create_kheap(uint32 start, uint32 end, uint32 max, uint8 supervisor, uin
   kheap.readonly = readonly;
 
   // Start off with one large hole in the index.
-  make_block(start, end - start - BLOCK_META_SIZE, IS_HOLE);
-  ordered_array_insert(&kheap.index, (type_t)start);
+  insert_hole(&kheap, make_block(start, end - start - BLOCK_META_SIZE, IS_HOLE));
 
   return kheap;
 }
 
+// Find the first hole whose size >= size, i.e. the smallest one that fits.
+static rb_node_t* lower_bound_hole(kheap_t *this, uint32 size) {
+  rb_node_t* result = nullptr;
+  rb_node_t* node = this->index.root;
+  while (node != nullptr) {
+    if (hole_header(node)->size >= size) {
+      result = node;
+      node = node->left;
+    } else {
+      node = node->right;
+    }
+  }
+  return result;
+}
+
 // Find the smallest hole that fits requested size.
-// Note if page_align is required, 
-static int32 find_hole(kheap_t *this, uint32 size, uint8 page_align, uint32* alloc_pos) {
-  uint32 iterator = 0;
-  for (int i = 0; i < this->index.size; i++) {
-    kheap_block_header_t* header = (kheap_block_header_t*)ordered_array_get(&this->index, i);
+// Note if page_align is required, the front part of the hole before the page boundary is cut
+// into a new hole, so it must be either empty or large enough for a block.
+static kheap_block_header_t* find_hole(kheap_t *this, uint32 size, uint8 page_align,
+                                       uint32* alloc_pos) {
+  rb_node_t* node = lower_bound_hole(this, size);
+  if (!page_align) {
+    if (node == nullptr) {
+      return nullptr;
+    }
+    *alloc_pos = (uint32)node;
+    return hole_header(node);
+  }
+
+  for (; node != nullptr; node = rb_tree_next(node)) {
+    kheap_block_header_t* header = hole_header(node);
     uint32 start = (uint32)header + HEADER_SIZE;
-    if (page_align) {
-      // Align the starting point.
-      // |..................|..................|..................|  page align
-      //      |h| data  |f|h| data |f|
-      uint32 end = start + header->size;
-      uint32 next_page_align = align_to_page(start);
-      while (next_page_align + size <= end) {
-        if (next_page_align - start > BLOCK_META_SIZE) {
-          *alloc_pos = next_page_align;
-          return i;
-        }
-        next_page_align += PAGE_SIZE;
+    // Align the starting point.
+    // |..................|..................|..................|  page align
+    //      |h| data  |f|h| data |f|
+    uint32 end = start + header->size;
+    uint32 next_page_align = align_to_page(start);
+    while (next_page_align + size <= end) {
+      uint32 gap = next_page_align - start;
+      if (gap == 0 || gap >= BLOCK_META_SIZE + KHEAP_MIN_BLOCK_SIZE) {
+        *alloc_pos = next_page_align;
+        return header;
       }
-    } else if (header->size >= size) {
-      *alloc_pos = start;
-      return i;
+      next_page_align += PAGE_SIZE;
     }
   }
 
-  return -1;
+  return nullptr;
 }
 
 void* alloc(kheap_t *this, uint32 size, uint8 page_align) {
   ASSERT(size > 0);
+  if (size < KHEAP_MIN_BLOCK_SIZE) {
+    size = KHEAP_MIN_BLOCK_SIZE;
+  }
 
   uint32 alloc_pos;
-  int32 iterator = find_hole(this, size, page_align, &alloc_pos);
-  if (iterator < 0) {
+  kheap_block_header_t* header = find_hole(this, size, page_align, &alloc_pos);
+  if (header == nullptr) {
     // No free hole fits, we need to expand the heap.
     uint32 old_end_address = this->end_address;
     uint32 extended_size = kheap_expand(this, size + BLOCK_META_SIZE);
@@ -145,36 +189,34 @@ void* alloc(kheap_t *this, uint32 size, uint8 page_align) {
     kheap_block_footer_t* last_footer = (kheap_block_footer_t*)(old_end_address - FOOTER_SIZE);
     kheap_block_header_t* last_header = last_footer->header;
     if (last_header->is_hole) {
-      // Extend the last hole. Note after extension, it needs to be taken out and re-inserted
-      // into the index ordered array since its size has been changed.
+      // Extend the last hole. Note it needs to be taken out of the index before its size is
+      // changed, and re-inserted after.
+      remove_hole(this, last_header);
       make_block((uint32)last_header, last_header->size + extended_size, IS_HOLE);
-      int32 remove = ordered_array_remove_element(&this->index, last_header);
-      ASSERT(remove);
-      ordered_array_insert(&this->index, last_header);
+      insert_hole(this, last_header);
     } else {
       // Append a new hole to the end.
       kheap_block_header_t* new_last_header =
           make_block(old_end_address, extended_size - BLOCK_META_SIZE, IS_HOLE);
-      ordered_array_insert(&this->index, (type_t)new_last_header);
+      insert_hole(this, new_last_header);
     }
 
     // Now try alloc again.
     return alloc(this, size, page_align);
   }
 
-  kheap_block_header_t* header = (kheap_block_header_t*)ordered_array_get(&this->index, iterator);
   ASSERT(header->magic == KHEAP_MAGIC);
   uint32 block_size = header->size;
 
-  ordered_array_remove(&this->index, iterator);
+  remove_hole(this, header);
   // If page-align is required, there may be space in the front that can make a new hole.
   if (page_align) {
     kheap_block_header_t* alloc_block_header = (kheap_block_header_t*)(alloc_pos - HEADER_SIZE);
     if (alloc_block_header > header) {
       uint32 cut_block_size = (uint32)alloc_block_header - (uint32)header;
-      ASSERT(cut_block_size > BLOCK_META_SIZE);
+      ASSERT(cut_block_size >= BLOCK_META_SIZE + KHEAP_MIN_BLOCK_SIZE);
       make_block((uint32)header, cut_block_size - BLOCK_META_SIZE, IS_HOLE);
-      ordered_array_insert(&this->index, (type_t)header);
+      insert_hole(this, header);
       block_size -= cut_block_size;
       header = alloc_block_header;
     }
@@ -183,20 +225,19 @@ void* alloc(kheap_t *this, uint32 size, uint8 page_align) {
   // Use this block.
   ASSERT(block_size >= size);
   uint32 remain_size = block_size - size;
-  if (remain_size <= BLOCK_META_SIZE) {
+  if (remain_size < BLOCK_META_SIZE + KHEAP_MIN_BLOCK_SIZE) {
     size = block_size;
     remain_size = 0;
   }
-  kheap_block_header_t* selected_hole_header = make_block((uint32)header, size, NOT_HOLE);
+  make_block((uint32)header, size, NOT_HOLE);
 
   // If there is remaining size after, cut a new hole.
   if (remain_size > 0) {
-    ASSERT(remain_size > BLOCK_META_SIZE);
     kheap_block_header_t* remain_hole_header = make_block(
         (uint32)header + BLOCK_META_SIZE + size, remain_size - BLOCK_META_SIZE, IS_HOLE);
-    ordered_array_insert(&this->index, (type_t)remain_hole_header);
+    insert_hole(this, remain_hole_header);
   }
-  
+
   // done
   return (void*)(alloc_pos);
 }
@@ -210,6 +251,7 @@ void free(kheap_t* this, void* ptr) {
   kheap_block_footer_t* footer = (kheap_block_footer_t*)((uint32)ptr + header->size);
   ASSERT(header->magic == KHEAP_MAGIC);
   ASSERT(footer->magic == KHEAP_MAGIC);
+  ASSERT(!header->is_hole);
 
   // Make us a hole.
   header->is_hole = 1;
@@ -217,26 +259,39 @@ void free(kheap_t* this, void* ptr) {
 
   // Merge with right.
   kheap_block_header_t* right_header = (kheap_block_header_t*)((uint32)footer + FOOTER_SIZE);
-  if (right_header->magic == KHEAP_MAGIC && right_header->is_hole) {
+  if ((uint32)right_header < this->end_address &&
+      right_header->magic == KHEAP_MAGIC && right_header->is_hole) {
+    remove_hole(this, right_header);
     make_block((uint32)header, header->size + right_header->size + BLOCK_META_SIZE, IS_HOLE);
-    int32 remove = ordered_array_remove_element(&this->index, right_header);
-    ASSERT(remove);
   }
 
   // Merge with left.
   kheap_block_footer_t* left_footer = (kheap_block_footer_t*)((uint32)header - FOOTER_SIZE);
-  if (left_footer->magic == KHEAP_MAGIC && left_footer->header->is_hole == 1) {
+  if ((uint32)header > this->start_address &&
+      left_footer->magic == KHEAP_MAGIC && left_footer->header->is_hole == 1) {
     kheap_block_header_t* left_header = left_footer->header;
+    remove_hole(this, left_header);
     make_block((uint32)left_header, left_header->size + header->size + BLOCK_META_SIZE, IS_HOLE);
-    int32 remove = ordered_array_remove_element(&this->index, left_header);
-    ASSERT(remove);
     new_hole = left_header;
   }
 
-  ordered_array_insert(&this->index, (type_t)new_hole);
+  insert_hole(this, new_hole);
 }
 
 // ****************************************************************************
+static bool hole_is_indexed(kheap_t* this, kheap_block_header_t* header) {
+  rb_node_t* target = hole_node(header);
+  rb_node_t* node = this->index.root;
+  while (node != nullptr) {
+    int32 cmp = kheap_block_comparator(target, node);
+    if (cmp == 0) {
+      return node == target;
+    }
+    node = (cmp < 0) ? node->left : node->right;
+  }
+  return false;
+}
+
 uint32 kheap_validate_print(uint8 print) {
   if (print) {
     monitor_printf("*************************** kheap *****************************\n");
@@ -248,7 +303,8 @@ uint32 kheap_validate_print(uint8 print) {
     kheap_block_header_t* header = (kheap_block_header_t*)(start);
     ASSERT(header->magic == KHEAP_MAGIC);
     if (header->is_hole) {
-      ASSERT(ordered_array_find_element(&kheap.index, (type_t)header) < kheap.index.size);
+      ASSERT(header->size >= KHEAP_MIN_BLOCK_SIZE);
+      ASSERT(hole_is_indexed(&kheap, header));
       if (print) {
         monitor_printf("[]--- start:%x end:%x size: %d\n",
             header, (uint32)header + header->size + BLOCK_META_SIZE, header->size);
@@ -287,13 +343,25 @@ static void* kmalloc_impl(uint32 size, uint8 align) {
   return ptr;
 }
 
-void* kmalloc(uint32 size) {
+static void* kheap_malloc(uint32 size) {
   yieldlock_lock(&kheap_lock);
   void* ptr = kmalloc_impl(size, 0);
   yieldlock_unlock(&kheap_lock);
   return ptr;
 }
 
+// Small objects are served by slab size classes, the rest go to kheap.
+void* kmalloc(uint32 size) {
+  if (size > 0 && size <= SLAB_MAX_OBJECT_SIZE && slab_is_ready()) {
+    void* ptr = slab_kmalloc(size);
+    if (ptr == nullptr) {
+      PANIC();
+    }
+    return ptr;
+  }
+  return kheap_malloc(size);
+}
+
 void* kmalloc_aligned(uint32 size) {
   yieldlock_lock(&kheap_lock);
   void* ptr = kmalloc_impl(size, 1);
@@ -305,6 +373,10 @@ void kfree(void* ptr) {
   if (ptr == nullptr) {
     return;
   }
+  if (is_slab_object(ptr)) {
+    slab_free(ptr);
+    return;
+  }
   yieldlock_lock(&kheap_lock);
   free(&kheap, ptr);
   yieldlock_unlock(&kheap_lock);
@@ -358,7 +430,7 @@ void kheap_killer() {
       if (i % 5 == 1) {
         ptrs[i] = (uint8*)kmalloc_aligned(random);
       } else {
-        ptrs[i] = (uint8*)kmalloc(random);
+        ptrs[i] = (uint8*)kheap_malloc(random);
       }
       ASSERT(kheap_validate_print(0) == (i + 1));
     }
@@ -375,7 +447,7 @@ void kheap_killer() {
       if (i % 5 >= 2) {
         ptrs[i + size] = (uint8*)kmalloc_aligned(random);
       } else {
-        ptrs[i + size] = (uint8*)kmalloc(random);
+        ptrs[i + size] = (uint8*)kheap_malloc(random);
       }
       ASSERT(kheap_validate_print(0) == size / 2 + (i + 1));
     }
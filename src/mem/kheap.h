@@ -2,15 +2,17 @@
 #define MEM_KHEAP_H
 
 #include "common/common.h"
-#include "utils/ordered_array.h"
+#include "utils/rb_tree.h"
 
 #define KHEAP_START          0xC0C00000
 #define KHEAP_MIN_SIZE       0x300000
 #define KHEAP_MAX            0xE0000000
 
-#define KHEAP_INDEX_NUM      0x20000
 #define KHEAP_MAGIC          0x123060AB
 
+// A hole keeps its index tree node in its data area, so every block must be able to hold one.
+#define KHEAP_MIN_BLOCK_SIZE (sizeof(rb_node_t))
+
 // 9 bytes
 struct kheap_block_header {
   uint32 magic;
@@ -27,7 +29,8 @@ struct kheap_block_footer {
 typedef struct kheap_block_footer kheap_block_footer_t;
 
 typedef struct kernel_heap {
-  ordered_array_t index;
+  // Holes ordered by (size, address).
+  rb_tree_t index;
   uint32 start_address;
   uint32 end_address;
   uint32 size;
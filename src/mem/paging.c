@@ -1,81 +1,122 @@
 #include "common/stdlib.h"
 #include "mem/paging.h"
+#include "mem/buddy.h"
 #include "mem/kheap.h"
+#include "mem/tlb.h"
 #include "monitor/monitor.h"
 #include "sync/yieldlock.h"
 #include "task/thread.h"
 #include "task/process.h"
 #include "task/scheduler.h"
+#include "task/cpu.h"
 #include "utils/math.h"
-#include "utils/hash_table.h"
 #include "utils/debug.h"
 
 // kernel's page directory
 static page_directory_t kernel_page_directory;
 
-// the current page directory;
-page_directory_t* current_page_directory = 0;
+// physical frames allocator
+static buddy_t phy_frames_allocator;
+static buddy_block_t phy_frames_blocks[PHYSICAL_MEM_SIZE / PAGE_SIZE];
+static yieldlock_t phy_frames_allocator_lock;
 
-static bitmap_t phy_frames_map;
-static uint32 bitarray[PHYSICAL_MEM_SIZE / PAGE_SIZE / 32];
-static yieldlock_t phy_frames_map_lock;
+// physical frames descriptors
+static page_t phy_pages[PHYSICAL_MEM_SIZE / PAGE_SIZE];
 
-// copy-on-write frames' reference counts
-static bool copy_on_write_ready = false;
-static hash_table_t frame_cow_ref_counts;
-static yieldlock_t frame_cow_ref_counts_lock;
+extern uint32 compare_and_exchange(volatile uint32* dst, uint32 expected, uint32 src);
+extern int32 atomic_add(volatile int32* dst, int32 delta);
 
 // locks for page copy
 static yieldlock_t page_copy_lock;
 
+// kmap window allocator, in pages
+static buddy_t kmap_allocator;
+static buddy_block_t kmap_blocks[KMAP_PAGES];
+static yieldlock_t kmap_lock;
+
+#ifdef LAZY_PAGE_TABLE_COPY
+// lock for sharing and splitting user page tables
+static yieldlock_t page_table_split_lock;
+
+static void unshare_page_table(uint32 pde_index);
+#endif
+
+static void enable_write_protect();
+
 void init_paging() {
-  // Initialize phy_frames_map. Note we have already used the first 3MB for kernel initialization.
-  //
-  // totally 8192 frames
-  for (int i = 0; i < 3 * 1024 * 1024 / PAGE_SIZE / 32; i++) {
-    bitarray[i] = 0xFFFFFFFF;
+  // Initialize phy_frames_allocator, totally 8192 frames. Note we have already used the first 3MB
+  // for kernel initialization, and the top of physical memory holds the kernel binary load area
+  // and the kernel stack (last frame). Kernel binary load area is released right below.
+  buddy_init(&phy_frames_allocator, phy_frames_blocks, PHYSICAL_MEM_SIZE / PAGE_SIZE);
+  buddy_free_range(&phy_frames_allocator, KERNEL_RESERVED_FRAMES,
+      KERNEL_BIN_LOAD_PHYSICAL_ADDR / PAGE_SIZE - KERNEL_RESERVED_FRAMES);
+  for (uint32 i = 0; i < KERNEL_RESERVED_FRAMES; i++) {
+    phy_pages[i].flags |= PAGE_FLAG_RESERVED;
   }
-  phy_frames_map = bitmap_create(bitarray, PHYSICAL_MEM_SIZE / PAGE_SIZE);
-  // Last virtual page is kernel stack.
-  bitmap_set_bit(&phy_frames_map, PHYSICAL_MEM_SIZE / PAGE_SIZE - 1);
+  phy_pages[PHYSICAL_MEM_SIZE / PAGE_SIZE - 1].flags |= PAGE_FLAG_RESERVED;
 
   // Initialize page directory.
   kernel_page_directory.page_dir_entries_phy = KERNEL_PAGE_DIR_PHY;
-  current_page_directory = &kernel_page_directory;
+
+  buddy_init(&kmap_allocator, kmap_blocks, KMAP_PAGES);
+  buddy_free_range(&kmap_allocator, 0, KMAP_PAGES);
 
   // Release memory for loading kernel binany - it's no longer needed.
   release_pages(0xFFFFFFFF - KERNEL_BIN_LOAD_SIZE + 1, KERNEL_BIN_LOAD_SIZE / PAGE_SIZE, true);
 
+  // Mark kernel mappings global.
+  init_tlb();
+
+  // Kernel writes must honor read-only pages too, otherwise kernel writing to user space would
+  // bypass copy-on-write.
+  enable_write_protect();
+
   // Register page fault handler.
   register_interrupt_handler(14, page_fault_handler);
 }
 
 void init_paging_stage2() {
-  yieldlock_init(&phy_frames_map_lock);
-
-  hash_table_init(&frame_cow_ref_counts);
-  yieldlock_init(&frame_cow_ref_counts_lock);
+  yieldlock_init(&phy_frames_allocator_lock);
 
   yieldlock_init(&page_copy_lock);
-
-  copy_on_write_ready = true;
+  yieldlock_init(&kmap_lock);
+#ifdef LAZY_PAGE_TABLE_COPY
+  yieldlock_init(&page_table_split_lock);
+#endif
 }
 
 int32 allocate_phy_frame() {
-  yieldlock_lock(&phy_frames_map_lock);
+  return allocate_phy_frames(0);
+}
+
+void release_phy_frame(uint32 frame) {
+  release_phy_frames(frame, 0);
+}
+
+int32 allocate_phy_frames(uint32 order) {
+  yieldlock_lock(&phy_frames_allocator_lock);
   uint32 frame;
-  if (!bitmap_allocate_first_free(&phy_frames_map, &frame)) {
-    yieldlock_unlock(&phy_frames_map_lock);
+  if (!buddy_alloc(&phy_frames_allocator, order, &frame)) {
+    yieldlock_unlock(&phy_frames_allocator_lock);
     return -1;
   }
-  yieldlock_unlock(&phy_frames_map_lock);
+  yieldlock_unlock(&phy_frames_allocator_lock);
   return (int32)frame;
 }
 
-void release_phy_frame(uint32 frame) {
-  yieldlock_lock(&phy_frames_map_lock);
-  bitmap_clear_bit(&phy_frames_map, frame);
-  yieldlock_unlock(&phy_frames_map_lock);
+void release_phy_frames(uint32 frame, uint32 order) {
+  yieldlock_lock(&phy_frames_allocator_lock);
+  buddy_free(&phy_frames_allocator, frame, order);
+  yieldlock_unlock(&phy_frames_allocator_lock);
+}
+
+uint32 get_free_phy_frames_num() {
+  return buddy_free_frames_num(&phy_frames_allocator);
+}
+
+page_t* get_phy_page(uint32 frame) {
+  ASSERT(frame < PHYSICAL_MEM_SIZE / PAGE_SIZE);
+  return phy_pages + frame;
 }
 
 void clear_page(uint32 addr) {
@@ -92,46 +133,48 @@ void enable_paging() {
   asm volatile("mov %0, %%cr0":: "r"(cr0));
 }
 
+static void enable_write_protect() {
+  uint32 cr0;
+  asm volatile("mov %%cr0, %0": "=r"(cr0));
+  cr0 |= 0x10000;
+  asm volatile("mov %0, %%cr0":: "r"(cr0));
+}
+
 void reload_page_directory(page_directory_t *dir) {
-  current_page_directory = dir;
+  cpu_t* cpu = get_cpu();
+  cpu->page_dir = dir;
+  // Published before cr3 is loaded - see tlb shootdown.
+  cpu->page_dir_phy = dir->page_dir_entries_phy;
   asm volatile("mov %0, %%cr3":: "r"(dir->page_dir_entries_phy));
 }
 
+// Each cpu starts with kernel page directory.
 page_directory_t* get_crt_page_directory() {
-  return current_page_directory;
+  page_directory_t* dir = get_cpu()->page_dir;
+  if (dir == nullptr) {
+    return &kernel_page_directory;
+  }
+  return dir;
 }
 
-static int32 change_cow_frame_refcount(uint32 frame, int32 refcount_delta) {
-  if (!copy_on_write_ready) {
-    return 0;
+// Change cow refcount of a frame, and return the old refcount. Refcount never drops below 0.
+int32 change_cow_frame_refcount(uint32 frame, int32 refcount_delta) {
+  page_t* page = get_phy_page(frame);
+  ASSERT((page->flags & PAGE_FLAG_RESERVED) == 0);
+  if (refcount_delta >= 0) {
+    return atomic_add(&page->cow_refcount, refcount_delta);
   }
 
-  yieldlock_lock(&frame_cow_ref_counts_lock);
-  int32* cnt_ptr = hash_table_get(&frame_cow_ref_counts, frame);
   int32 old_cnt;
   int32 new_cnt;
-  if (cnt_ptr != nullptr) {
-    old_cnt = *cnt_ptr;
+  do {
+    old_cnt = page->cow_refcount;
     new_cnt = old_cnt + refcount_delta;
-  } else {
-    old_cnt = 0;
-    new_cnt = old_cnt + refcount_delta;
-  }
-
-  if (new_cnt > 0) {
-    if (cnt_ptr != nullptr) {
-      *cnt_ptr = new_cnt;
-    } else {
-      cnt_ptr = (int32*)kmalloc(sizeof(int32));
-      *cnt_ptr = new_cnt;
-      hash_table_put(&frame_cow_ref_counts, frame, cnt_ptr);
+    if (new_cnt < 0) {
+      new_cnt = 0;
     }
-  } else {
-    if (cnt_ptr != nullptr) {
-      hash_table_remove(&frame_cow_ref_counts, frame);
-    }
-  }
-  yieldlock_unlock(&frame_cow_ref_counts_lock);
+  } while ((int32)compare_and_exchange(
+      (volatile uint32*)&page->cow_refcount, old_cnt, new_cnt) != old_cnt);
   return old_cnt;
 }
 
@@ -157,8 +200,38 @@ void page_fault_handler(isr_params_t params) {
   //  "page fault: %x, present %d, write %d, user-mode %d, reserved %d\n",
   //  faulting_address, present, rw, user_mode, reserved);
 
+  // Not-present user page may belong to the program file, which is paged in on demand.
+  if (!present && faulting_address < 0xC0000000 && multi_task_is_enabled() &&
+      process_fill_file_page(faulting_address)) {
+    return;
+  }
+
   map_page(faulting_address / PAGE_SIZE * PAGE_SIZE);
-  reload_page_directory(current_page_directory);
+}
+
+bool is_page_mapped(uint32 virtual_addr) {
+  pde_t* pde = (pde_t*)PAGE_DIR_VIRTUAL + (virtual_addr >> 22);
+  if (!pde->present) {
+    return false;
+  }
+  pte_t* pte = (pte_t*)PAGE_TABLES_VIRTUAL + (virtual_addr >> 12);
+  return pte->present;
+}
+
+int32 get_phy_addr(uint32 virtual_addr) {
+  if (!is_page_mapped(virtual_addr)) {
+    return -1;
+  }
+  pte_t* pte = (pte_t*)PAGE_TABLES_VIRTUAL + (virtual_addr >> 12);
+  return pte->frame * PAGE_SIZE + (virtual_addr & (PAGE_SIZE - 1));
+}
+
+static void set_pte(uint32 virtual_addr, pte_t* pte, int32 frame) {
+  pte->present = 1;
+  pte->rw = 1;
+  pte->user = 1;
+  pte->global = tlb_is_global_page(virtual_addr);
+  pte->frame = frame;
 }
 
 // Note this function itself must NOT trigger another page fault inside.
@@ -169,6 +242,13 @@ static void map_page_with_frame_impl(uint32 virtual_addr, int32 frame) {
   pde_t* pd = (pde_t*)PAGE_DIR_VIRTUAL;
   pde_t* pde = pd + pde_index;
 
+#ifdef LAZY_PAGE_TABLE_COPY
+  // Page table shared with other processes must be copied before any change.
+  if (pde_index < 768 && pde->present && !pde->rw) {
+    unshare_page_table(pde_index);
+  }
+#endif
+
   // Allcoate page table for this pde, if needed.
   if (!pde->present) {
     int32 page_table_frame = allocate_phy_frame();
@@ -182,8 +262,8 @@ static void map_page_with_frame_impl(uint32 virtual_addr, int32 frame) {
     pde->user = 1;
     pde->frame = page_table_frame;
 
-    // Reset page table pointed by this pde.
-    reload_page_directory(current_page_directory);
+    // Reset page table pointed by this pde. It was not present before, so nothing of it can be
+    // cached in TLB.
     clear_page(PAGE_TABLES_VIRTUAL + pde_index * PAGE_SIZE);
   }
 
@@ -193,12 +273,13 @@ static void map_page_with_frame_impl(uint32 virtual_addr, int32 frame) {
   pte_t* kernel_page_tables_virtual = (pte_t*)PAGE_TABLES_VIRTUAL;
   pte_t* pte = kernel_page_tables_virtual + pte_index;
   if (frame > 0) {
-    // If frame is provided, simply map it.
-    pte->present = 1;
-    pte->rw = 1;
-    pte->user = 1;
-    pte->frame = frame;
-    reload_page_directory(current_page_directory);
+    // If frame is provided, simply map it. TLB never caches not-present entries, so only a
+    // re-mapping needs a flush.
+    bool was_present = pte->present;
+    set_pte(virtual_addr, pte, frame);
+    if (was_present) {
+      tlb_flush_page(virtual_addr);
+    }
   } else {
     if (!pte->present) {
       // Allocate a new frame and map it.
@@ -208,11 +289,7 @@ static void map_page_with_frame_impl(uint32 virtual_addr, int32 frame) {
         PANIC();
       }
 
-      pte->present = 1;
-      pte->rw = 1;
-      pte->user = 1;
-      pte->frame = frame;
-      reload_page_directory(current_page_directory);
+      set_pte(virtual_addr, pte, frame);
       clear_page(virtual_addr);
     } else if (!pte->rw) {
       //monitor_printf("handle page fault rw on %x\n", virtual_addr);
@@ -238,40 +315,81 @@ static void map_page_with_frame_impl(uint32 virtual_addr, int32 frame) {
         void* copy_page = (void*)COPIED_PAGE_VADDR;
         map_page_with_frame_impl((uint32)copy_page, frame);
         memcpy(copy_page, (void*)(virtual_addr / PAGE_SIZE * PAGE_SIZE), PAGE_SIZE);
+        release_pages((uint32)copy_page, 1, false);
         yieldlock_unlock(&page_copy_lock);
         pte->frame = frame;
         pte->rw = 1;
-
-        //kfree(copy_page);
-        release_pages((uint32)copy_page, 1, false);
+        tlb_flush_page(virtual_addr);
       } else {
         //monitor_printf("cow rw %x on process %d\n", virtual_addr, get_crt_thread()->process->id);
         pte->rw = 1;
-        reload_page_directory(current_page_directory);
+        tlb_flush_page(virtual_addr);
       }
     }
   }
 }
 
-static void map_page_with_frame(uint32 virtual_addr, int32 frame) {
-  if (multi_task_is_enabled()) {
-    yieldlock_lock(&get_crt_thread()->process->page_dir_lock);
+static pcb_t* lock_crt_page_dir() {
+  // An exiting thread may have been detached from its process already, while it still
+  // allocates kernel memory on its way out.
+  pcb_t* process = multi_task_is_enabled() ? get_crt_process() : nullptr;
+  if (process != nullptr) {
+    // A vfork child runs on its parent's page directory, so it takes the parent's lock.
+    if (process->vfork_child) {
+      process = process->parent;
+    }
+    yieldlock_lock(&process->page_dir_lock);
   }
-  map_page_with_frame_impl(virtual_addr, frame);
-  if (multi_task_is_enabled()) {
-    yieldlock_unlock(&get_crt_thread()->process->page_dir_lock);
+  return process;
+}
+
+static void unlock_crt_page_dir(pcb_t* process) {
+  if (process != nullptr) {
+    yieldlock_unlock(&process->page_dir_lock);
   }
 }
 
+void map_page_with_frame(uint32 virtual_addr, int32 frame) {
+  pcb_t* process = lock_crt_page_dir();
+  map_page_with_frame_impl(virtual_addr, frame);
+  unlock_crt_page_dir(process);
+}
+
+void map_page_with_frame_readonly(uint32 virtual_addr, int32 frame) {
+  pcb_t* process = lock_crt_page_dir();
+  map_page_with_frame_impl(virtual_addr, frame);
+  pte_t* pte = (pte_t*)PAGE_TABLES_VIRTUAL + (virtual_addr >> 12);
+  pte->rw = 0;
+  tlb_flush_page(virtual_addr);
+  unlock_crt_page_dir(process);
+}
+
+void map_page_with_frame_uncached(uint32 virtual_addr, int32 frame) {
+  pcb_t* process = lock_crt_page_dir();
+  map_page_with_frame_impl(virtual_addr, frame);
+  pte_t* pte = (pte_t*)PAGE_TABLES_VIRTUAL + (virtual_addr >> 12);
+  pte->pwt = 1;
+  pte->pcd = 1;
+  tlb_flush_page(virtual_addr);
+  unlock_crt_page_dir(process);
+}
+
 void map_page(uint32 virtual_addr) {
   map_page_with_frame(virtual_addr, -1);
 }
 
-static void release_page(uint32 virtual_addr, bool free_frame) {
-  // reset pte
-  uint32 pte_index = virtual_addr >> 12;
-  pte_t* pte = (pte_t*)PAGE_TABLES_VIRTUAL + pte_index;
-  if (!pte->present) {
+// Unmapping is done in two passes, so that a whole range is flushed from TLB at once, and frames
+// are only returned after no stale TLB entry can point to them any more:
+//  1. mark ptes not present, keeping their frames;
+//  2. flush TLB, then release frames and reset ptes.
+static void unmap_page(uint32 virtual_addr) {
+  pte_t* pte = (pte_t*)PAGE_TABLES_VIRTUAL + (virtual_addr >> 12);
+  pte->present = 0;
+}
+
+static void release_unmapped_page(uint32 virtual_addr, bool free_frame) {
+  pte_t* pte = (pte_t*)PAGE_TABLES_VIRTUAL + (virtual_addr >> 12);
+  if (*((uint32*)pte) == 0) {
     return;
   }
   uint32 frame = pte->frame;
@@ -282,17 +400,13 @@ static void release_page(uint32 virtual_addr, bool free_frame) {
     int32 cow_refs = change_cow_frame_refcount(frame, -1);
     if (cow_refs <= 0) {
       release_phy_frame(frame);
-      //clear_page(virtual_addr);
     }
   }
 
   *((uint32*)pte) = 0;
-  reload_page_directory(current_page_directory);
 }
 
-void release_pages(uint32 virtual_addr, uint32 pages, bool free_frame) {
-  virtual_addr = (virtual_addr / PAGE_SIZE) * PAGE_SIZE;
-
+static void walk_pages(uint32 virtual_addr, uint32 pages, bool free_frame, bool unmap) {
   uint32 pte_index_start = (virtual_addr >> 12);
   uint32 pte_index_end = pte_index_start + pages;
 
@@ -306,41 +420,191 @@ void release_pages(uint32 virtual_addr, uint32 pages, bool free_frame) {
     }
 
     for (uint32 j = max(pte_index_start, i * 1024); j < min(pte_index_end, i * 1024 + 1024); j++) {
-      release_page(j * PAGE_SIZE, free_frame);
+      if (unmap) {
+        unmap_page(j * PAGE_SIZE);
+      } else {
+        release_unmapped_page(j * PAGE_SIZE, free_frame);
+      }
+    }
+  }
+}
+
+#ifdef LAZY_PAGE_TABLE_COPY
+// Split a shared page table for current process. If other processes still share it, it is
+// copied to a new frame, and all its pages are marked copy-on-write in both tables; otherwise
+// this process is the last owner and just takes it back.
+static void unshare_page_table(uint32 pde_index) {
+  yieldlock_lock(&page_table_split_lock);
+  pde_t* pde = (pde_t*)PAGE_DIR_VIRTUAL + pde_index;
+  if (!pde->present || pde->rw) {
+    yieldlock_unlock(&page_table_split_lock);
+    return;
+  }
+
+  int32 pt_refs = change_cow_frame_refcount(pde->frame, -1);
+  if (pt_refs > 0) {
+    int32 new_pt_frame = allocate_phy_frame();
+    if (new_pt_frame < 0) {
+      monitor_printf("couldn't alloc frame for copied page table\n");
+      PANIC();
+    }
+
+    // The shared table is read-only via the recursive mapping, so map it writable elsewhere.
+    yieldlock_lock(&page_copy_lock);
+    map_page_with_frame_impl(SHARED_PAGE_TABLE_VADDR, pde->frame);
+    map_page_with_frame_impl(COPIED_PAGE_TABLE_VADDR, new_pt_frame);
+    pte_t* shared_pt = (pte_t*)SHARED_PAGE_TABLE_VADDR;
+    pte_t* new_pt = (pte_t*)COPIED_PAGE_TABLE_VADDR;
+    memcpy(new_pt, shared_pt, PAGE_SIZE);
+    for (int j = 0; j < 1024; j++) {
+      if (!new_pt[j].present) {
+        continue;
+      }
+      shared_pt[j].rw = 0;
+      new_pt[j].rw = 0;
+      change_cow_frame_refcount(new_pt[j].frame, 1);
     }
+    release_pages(SHARED_PAGE_TABLE_VADDR, 1, false);
+    release_pages(COPIED_PAGE_TABLE_VADDR, 1, false);
+    yieldlock_unlock(&page_copy_lock);
+
+    pde->frame = new_pt_frame;
   }
+  pde->rw = 1;
+  tlb_flush_range(pde_index * 1024 * PAGE_SIZE, 1024);
+
+  yieldlock_unlock(&page_table_split_lock);
+}
+
+// Shared page tables entirely covered by the range are dropped without touching their pages,
+// unless this process is the last owner. Partially covered ones are unshared.
+static void drop_shared_page_tables(uint32 virtual_addr, uint32 pages) {
+  uint32 pte_index_start = (virtual_addr >> 12);
+  uint32 pte_index_end = pte_index_start + pages;
+
+  uint32 pde_index_start = (pte_index_start >> 10);
+  uint32 pde_index_end = min(((pte_index_end - 1) >> 10) + 1, 768);
+
+  for (uint32 i = pde_index_start; i < pde_index_end; i++) {
+    pde_t* pde = (pde_t*)PAGE_DIR_VIRTUAL + i;
+    if (!pde->present || pde->rw) {
+      continue;
+    }
+
+    if (pte_index_start > i * 1024 || pte_index_end < i * 1024 + 1024) {
+      unshare_page_table(i);
+      continue;
+    }
+
+    yieldlock_lock(&page_table_split_lock);
+    if (pde->present && !pde->rw) {
+      int32 pt_refs = change_cow_frame_refcount(pde->frame, -1);
+      if (pt_refs > 0) {
+        *((uint32*)pde) = 0;
+      } else {
+        pde->rw = 1;
+      }
+    }
+    yieldlock_unlock(&page_table_split_lock);
+  }
+}
+#endif
+
+void release_pages(uint32 virtual_addr, uint32 pages, bool free_frame) {
+  if (pages == 0) {
+    return;
+  }
+  virtual_addr = (virtual_addr / PAGE_SIZE) * PAGE_SIZE;
+
+#ifdef LAZY_PAGE_TABLE_COPY
+  if (virtual_addr < 0xC0000000) {
+    drop_shared_page_tables(virtual_addr, pages);
+  }
+#endif
+
+  walk_pages(virtual_addr, pages, free_frame, true);
+  tlb_flush_range(virtual_addr, pages);
+  walk_pages(virtual_addr, pages, free_frame, false);
+}
+
+static uint32 kmap_order(uint32 pages) {
+  uint32 order = 0;
+  while ((1u << order) < pages) {
+    order++;
+  }
+  return order;
+}
+
+uint32 kmap_frames(uint32 frame, uint32 pages) {
+  yieldlock_lock(&kmap_lock);
+  uint32 index;
+  bool ok = buddy_alloc(&kmap_allocator, kmap_order(pages), &index);
+  yieldlock_unlock(&kmap_lock);
+  if (!ok) {
+    return 0;
+  }
+
+  // Kernel page tables are shared by all page dirs, so the mapping is seen by every process.
+  uint32 vaddr = KMAP_START + index * PAGE_SIZE;
+  for (uint32 i = 0; i < pages; i++) {
+    map_page_with_frame(vaddr + i * PAGE_SIZE, frame + i);
+  }
+  return vaddr;
+}
+
+void kunmap_frames(uint32 vaddr, uint32 pages) {
+  release_pages(vaddr, pages, false);
+  yieldlock_lock(&kmap_lock);
+  buddy_free(&kmap_allocator, (vaddr - KMAP_START) / PAGE_SIZE, kmap_order(pages));
+  yieldlock_unlock(&kmap_lock);
 }
 
 void release_pages_tables(uint32 pde_index_start, uint32 num) {
+  bool released = false;
   for (uint32 i = pde_index_start; i < pde_index_start + num; i++) {
     pde_t* pde = (pde_t*)PAGE_DIR_VIRTUAL + i;
     if (!pde->present) {
       continue;
     }
+#ifdef LAZY_PAGE_TABLE_COPY
+    // Page table still shared with other processes. The lock keeps its frame from being released
+    // while another process is copying or write-protecting it.
+    if (!pde->rw) {
+      yieldlock_lock(&page_table_split_lock);
+      bool shared = change_cow_frame_refcount(pde->frame, -1) > 0;
+      if (shared) {
+        *((uint32*)pde) = 0;
+      }
+      yieldlock_unlock(&page_table_split_lock);
+      if (shared) {
+        released = true;
+        continue;
+      }
+    }
+#endif
     release_phy_frame(pde->frame);
     *((uint32*)pde) = 0;
+    released = true;
+  }
+
+  // Page tables are mapped by the recursive pde, and pdes may be cached by the MMU as well.
+  if (released) {
+    tlb_flush_all();
   }
 }
 
-// Copy the entire page dir and its page tables:
-//  - 256 kernel page tables are shared;
-//  - user space page tables are copied, and page entries are marked copy-on-write;
-//
-// Return the physical address of new page dir.
-page_directory_t clone_crt_page_dir() {
-  // Map copied page tables (including the new page dir) to some virtual space so that
-  // we can access them.
-  //
-  // First, map the new page dir.
-  int32 new_pd_frame = allocate_phy_frame();
-  if (new_pd_frame < 0) {
+// Allocate a new page dir, which shares kernel space with current one. It is mapped to some
+// virtual space of current process so that we can fill it, and the mapping virtual address is
+// returned.
+static uint32 new_page_dir(int32* new_pd_frame) {
+  int32 frame = allocate_phy_frame();
+  if (frame < 0) {
     monitor_printf("couldn't alloc frame for new page dir\n");
     PANIC();
   }
 
   uint32 copied_page_dir = (uint32)kmalloc_aligned(PAGE_SIZE);
-  map_page_with_frame(copied_page_dir, new_pd_frame);
-  reload_page_directory(current_page_directory);
+  map_page_with_frame(copied_page_dir, frame);
   clear_page(copied_page_dir);
 
   // First page dir entry is shared - the first 4MB virtual space is reserved.
@@ -355,12 +619,61 @@ page_directory_t clone_crt_page_dir() {
       new_pde->present = 1;
       new_pde->rw = 1;
       new_pde->user = 1;
-      new_pde->frame = new_pd_frame;
+      new_pde->frame = frame;
     } else {
       *new_pde = *(crt_pd + i);
     }
   }
 
+  *new_pd_frame = frame;
+  return copied_page_dir;
+}
+
+// Release mapping for new page dir on current process.
+static void unmap_new_page_dir(uint32 copied_page_dir) {
+  kfree((void*)copied_page_dir);
+  release_pages(copied_page_dir, 1, false);
+}
+
+// Create a page dir with empty user space.
+page_directory_t create_user_page_dir() {
+  int32 new_pd_frame;
+  uint32 copied_page_dir = new_page_dir(&new_pd_frame);
+  unmap_new_page_dir(copied_page_dir);
+
+  page_directory_t page_directory;
+  page_directory.page_dir_entries_phy = new_pd_frame * PAGE_SIZE;
+  return page_directory;
+}
+
+// Copy the entire page dir and its page tables:
+//  - 256 kernel page tables are shared;
+//  - user space page tables are copied, and page entries are marked copy-on-write;
+//
+// Return the physical address of new page dir.
+page_directory_t clone_crt_page_dir() {
+  // Map copied page tables (including the new page dir) to some virtual space so that
+  // we can access them.
+  int32 new_pd_frame;
+  uint32 copied_page_dir = new_page_dir(&new_pd_frame);
+  pde_t* new_pd = (pde_t*)copied_page_dir;
+  pde_t* crt_pd = (pde_t*)PAGE_DIR_VIRTUAL;
+
+#ifdef LAZY_PAGE_TABLE_COPY
+  // Share user space page tables read-only. A page table is copied on the first write into its
+  // range, from either process.
+  yieldlock_lock(&page_table_split_lock);
+  for (uint32 i = 1; i < 768; i++) {
+    pde_t* crt_pde = crt_pd + i;
+    if (!crt_pde->present) {
+      continue;
+    }
+    crt_pde->rw = 0;
+    *(new_pd + i) = *crt_pde;
+    change_cow_frame_refcount(crt_pde->frame, 1);
+  }
+  yieldlock_unlock(&page_table_split_lock);
+#else
   // Copy user space page tables.
   uint32 copied_page_table = (uint32)kmalloc_aligned(PAGE_SIZE);
 
@@ -379,7 +692,6 @@ page_directory_t clone_crt_page_dir() {
 
     // Copy page table and set ptes copy-on-write.
     map_page_with_frame(copied_page_table, new_pt_frame);
-    reload_page_directory(current_page_directory);
     memcpy((void*)copied_page_table, (void*)(PAGE_TABLES_VIRTUAL + i * PAGE_SIZE), PAGE_SIZE);
     for (int j = 0; j < 1024; j++) {
       pte_t* crt_pte = (pte_t*)(PAGE_TABLES_VIRTUAL + i * PAGE_SIZE) + j;
@@ -401,11 +713,14 @@ page_directory_t clone_crt_page_dir() {
     new_pde->frame = new_pt_frame;
   }
 
-  // Release mapping for new page tables on current process.
-  kfree((void*)copied_page_dir);
   kfree((void*)copied_page_table);
-  release_pages(copied_page_dir, 1, false);
   release_pages(copied_page_table, 1, false);
+#endif
+
+  // Current process's user ptes (or pdes) have been marked read-only.
+  tlb_flush_all();
+
+  unmap_new_page_dir(copied_page_dir);
 
   page_directory_t page_directory;
   page_directory.page_dir_entries_phy = new_pd_frame * PAGE_SIZE;
@@ -18,9 +18,22 @@
 #define KERNEL_LOAD_PHYSICAL_ADDR     0x200000
 #define KERNEL_SIZE_MAX               (1024 * 1024)
 
+// Physical frames are mapped here on demand, e.g. to fill a frame before it is shared to user
+// space, or to reach DMA memory. See kmap_frames().
+#define KMAP_START                    0xE8000000
+#define KMAP_MAX                      0xE9000000
+#define KMAP_PAGES                    ((KMAP_MAX - KMAP_START) / PAGE_SIZE)
+
+// Fixed single-page slots for temporary mappings. COPIED_PAGE_TABLE_VADDR and COPIED_PAGE_VADDR
+// share a slot, as both are only mapped with page_copy_lock held, and never at the same time.
+// Each other slot is its own.
 #define COPIED_PAGE_DIR_VADDR         0xFFFFE000
 #define COPIED_PAGE_TABLE_VADDR       0xFFFFF000
 #define COPIED_PAGE_VADDR             0xFFFFF000
+#define SHARED_PAGE_TABLE_VADDR       0xFFFFD000
+
+// Share user page tables read-only on fork, and copy a page table on the first write into it.
+#define LAZY_PAGE_TABLE_COPY
 
 // ********************* physical memory layout ********************************
 // 0x00000000 ... 0x00100000  boot & reserved                                1MB
@@ -31,6 +44,8 @@
 
 #define PHYSICAL_MEM_SIZE             (32 * 1024 * 1024)
 #define KERNEL_BIN_LOAD_SIZE          (1024 * 1024)
+#define KERNEL_BIN_LOAD_PHYSICAL_ADDR (PHYSICAL_MEM_SIZE - PAGE_SIZE - KERNEL_BIN_LOAD_SIZE)
+#define KERNEL_RESERVED_FRAMES        (3 * 1024 * 1024 / PAGE_SIZE)
 
 
 // *****************************************************************************
@@ -39,14 +54,28 @@ typedef struct page_table_entry {
   uint32 present    : 1;   // Page present in memory
   uint32 rw         : 1;   // Read-only if clear, readwrite if set
   uint32 user       : 1;   // Supervisor level only if clear
+  uint32 pwt        : 1;   // Write-through caching
+  uint32 pcd        : 1;   // Cache disabled
   uint32 accessed   : 1;   // Has the page been accessed since last refresh?
   uint32 dirty      : 1;   // Has the page been written to since last refresh?
-  uint32 unused     : 7;   // Amalgamation of unused and reserved bits
+  uint32 pat        : 1;   // Page attribute table index (page size for pde)
+  uint32 global     : 1;   // Not flushed on cr3 reload if cr4.PGE is set
+  uint32 avail      : 3;   // Available for kernel use
   uint32 frame      : 20;  // Frame address (shifted right 12 bits)
 } pte_t;
 
 typedef pte_t pde_t;
 
+// Physical frame descriptor, one for each frame.
+#define PAGE_FLAG_RESERVED  0x1   // never managed by frames allocator
+
+// 8 bytes
+typedef struct page {
+  // Copy-on-write sharers besides the first owner.
+  volatile int32 cow_refcount;
+  uint32 flags;
+} page_t;
+
 // 4KB
 typedef struct page_directory {
   uint32 page_dir_entries_phy;  // [1024]
@@ -63,16 +92,47 @@ void enable_paging();
 int32 allocate_phy_frame();
 void release_phy_frame(uint32 frame);
 
+// Alloc/release 2^order continuous physical frames.
+int32 allocate_phy_frames(uint32 order);
+void release_phy_frames(uint32 frame, uint32 order);
+
+uint32 get_free_phy_frames_num();
+
+// Get the descriptor of a physical frame.
+page_t* get_phy_page(uint32 frame);
+
+// Change copy-on-write sharers count of a frame, and return the old count. When the old count
+// is 0 on decrease, caller is the last owner and should release the frame.
+int32 change_cow_frame_refcount(uint32 frame, int32 refcount_delta);
+
 // Set all to zero for a page.
 void clear_page(uint32 addr);
 
 // Map virtual page to a physical frame.
 void map_page(uint32 virtual_addr);
+void map_page_with_frame(uint32 virtual_addr, int32 frame);
+
+// Map a shared frame read-only - a write to it is handled as copy-on-write.
+void map_page_with_frame_readonly(uint32 virtual_addr, int32 frame);
+
+// Map device memory, with caching disabled.
+void map_page_with_frame_uncached(uint32 virtual_addr, int32 frame);
+
+bool is_page_mapped(uint32 virtual_addr);
+
+// Physical address of a mapped virtual address on current page dir, or -1 if not mapped.
+int32 get_phy_addr(uint32 virtual_addr);
 
 // Release virtual page mapping and maybe return the physical frame(s).
 void release_pages(uint32 virtual_addr, uint32 pages, bool release_frame);
 void release_pages_tables(uint32 pde_index_start, uint32 num);
 
+// Map contiguous frames [frame, frame + pages) at a fresh range of kmap window, and return its
+// address, or 0 if the window is full. Frames are still owned by caller.
+uint32 kmap_frames(uint32 frame, uint32 pages);
+// Unmap a range returned by kmap_frames. Frames are not released.
+void kunmap_frames(uint32 vaddr, uint32 pages);
+
 // Switch to a different page directory.
 page_directory_t* get_crt_page_directory();
 void reload_page_directory(page_directory_t* dir);
@@ -83,6 +143,9 @@ void page_fault_handler(isr_params_t params);
 // Clonse page directory for a new process.
 page_directory_t clone_crt_page_dir();
 
+// Create page directory with empty user space for a new process.
+page_directory_t create_user_page_dir();
+
 
 // ******************************** unit tests **********************************
 void memory_killer();
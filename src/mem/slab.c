@@ -0,0 +1,289 @@
+#include "common/stdlib.h"
+#include "monitor/monitor.h"
+#include "mem/kheap.h"
+#include "mem/paging.h"
+#include "mem/slab.h"
+#include "utils/bitmap.h"
+#include "utils/debug.h"
+
+#define OBJECTS_OFFSET  ((sizeof(slab_t) + 7) / 8 * 8)
+
+// Empty slabs kept by each cache before their pages are returned.
+#define EMPTY_SLABS_KEEP  1
+
+static bool slab_ready = false;
+
+// size class caches for slab_kmalloc.
+static slab_cache_t size_caches[SLAB_SIZE_CLASSES_NUM];
+
+// slab virtual pages allocation
+static bitmap_t slab_pages_map;
+static uint32 slab_pages_bitarray[SLAB_PAGES_MAX / 32];
+static yieldlock_t slab_pages_lock;
+
+void init_slab() {
+  slab_pages_map = bitmap_create(slab_pages_bitarray, SLAB_PAGES_MAX);
+  yieldlock_init(&slab_pages_lock);
+
+  uint32 object_size = SLAB_MIN_OBJECT_SIZE;
+  for (uint32 i = 0; i < SLAB_SIZE_CLASSES_NUM; i++) {
+    char name[32];
+    sprintf(name, "kmalloc-%u", object_size);
+    slab_cache_init(&size_caches[i], name, object_size);
+    object_size *= 2;
+  }
+
+  slab_ready = true;
+}
+
+bool slab_is_ready() {
+  return slab_ready;
+}
+
+bool is_slab_object(void* ptr) {
+  return (uint32)ptr >= SLAB_START && (uint32)ptr < SLAB_MAX;
+}
+
+// ****************************************************************************
+static void slab_list_push(slab_t** head, slab_t* slab) {
+  slab->prev = nullptr;
+  slab->next = *head;
+  if (*head != nullptr) {
+    (*head)->prev = slab;
+  }
+  *head = slab;
+}
+
+static void slab_list_remove(slab_t** head, slab_t* slab) {
+  if (slab->prev != nullptr) {
+    slab->prev->next = slab->next;
+  } else {
+    *head = slab->next;
+  }
+  if (slab->next != nullptr) {
+    slab->next->prev = slab->prev;
+  }
+  slab->prev = nullptr;
+  slab->next = nullptr;
+}
+
+// Map a new page in slab space and cut it into objects.
+static slab_t* slab_create(slab_cache_t* cache) {
+  yieldlock_lock(&slab_pages_lock);
+  uint32 page_index;
+  if (!bitmap_allocate_first_free(&slab_pages_map, &page_index)) {
+    yieldlock_unlock(&slab_pages_lock);
+    return nullptr;
+  }
+  yieldlock_unlock(&slab_pages_lock);
+
+  int32 frame = allocate_phy_frame();
+  if (frame < 0) {
+    yieldlock_lock(&slab_pages_lock);
+    bitmap_clear_bit(&slab_pages_map, page_index);
+    yieldlock_unlock(&slab_pages_lock);
+    return nullptr;
+  }
+
+  uint32 page = SLAB_START + page_index * PAGE_SIZE;
+  map_page_with_frame(page, frame);
+
+  slab_t* slab = (slab_t*)page;
+  slab->magic = SLAB_MAGIC;
+  slab->cache = cache;
+  slab->prev = nullptr;
+  slab->next = nullptr;
+  slab->inuse = 0;
+  slab->frame = frame;
+
+  // Thread all objects into the free list.
+  slab->free_objects = nullptr;
+  for (int32 i = cache->objects_per_slab - 1; i >= 0; i--) {
+    void** object = (void**)(page + OBJECTS_OFFSET + i * cache->object_size);
+    *object = slab->free_objects;
+    slab->free_objects = object;
+  }
+
+  cache->slabs_num++;
+  return slab;
+}
+
+// Unmap slab page and return its frame. Note the frame is released directly rather than via
+// release_pages(), because slab pages are never shared copy-on-write.
+static void slab_destroy(slab_cache_t* cache, slab_t* slab) {
+  uint32 page = (uint32)slab;
+  uint32 frame = slab->frame;
+  slab->magic = 0;
+  release_pages(page, 1, false);
+  release_phy_frame(frame);
+
+  yieldlock_lock(&slab_pages_lock);
+  bitmap_clear_bit(&slab_pages_map, (page - SLAB_START) / PAGE_SIZE);
+  yieldlock_unlock(&slab_pages_lock);
+
+  cache->slabs_num--;
+}
+
+// ****************************************************************************
+void slab_cache_init(slab_cache_t* cache, char* name, uint32 object_size) {
+  ASSERT(object_size > 0);
+  // Objects must be able to hold the free list link, and are 8 bytes aligned.
+  if (object_size < sizeof(void*)) {
+    object_size = sizeof(void*);
+  }
+  object_size = (object_size + 7) / 8 * 8;
+  ASSERT(object_size <= PAGE_SIZE - OBJECTS_OFFSET);
+
+  memset(cache, 0, sizeof(slab_cache_t));
+  strcpy(cache->name, name);
+  cache->object_size = object_size;
+  cache->objects_per_slab = (PAGE_SIZE - OBJECTS_OFFSET) / object_size;
+  yieldlock_init(&cache->lock);
+}
+
+slab_cache_t* slab_cache_create(char* name, uint32 object_size) {
+  slab_cache_t* cache = (slab_cache_t*)kmalloc(sizeof(slab_cache_t));
+  slab_cache_init(cache, name, object_size);
+  return cache;
+}
+
+void* slab_cache_alloc(slab_cache_t* cache) {
+  yieldlock_lock(&cache->lock);
+
+  slab_t* slab = cache->partial_slabs;
+  if (slab == nullptr) {
+    slab = cache->empty_slabs;
+    if (slab != nullptr) {
+      slab_list_remove(&cache->empty_slabs, slab);
+      cache->empty_slabs_num--;
+    } else {
+      slab = slab_create(cache);
+      if (slab == nullptr) {
+        yieldlock_unlock(&cache->lock);
+        return nullptr;
+      }
+    }
+    slab_list_push(&cache->partial_slabs, slab);
+  }
+
+  void** object = (void**)slab->free_objects;
+  slab->free_objects = *object;
+  slab->inuse++;
+  if (slab->inuse == cache->objects_per_slab) {
+    slab_list_remove(&cache->partial_slabs, slab);
+    slab_list_push(&cache->full_slabs, slab);
+  }
+
+  cache->objects_inuse++;
+  cache->alloc_count++;
+  yieldlock_unlock(&cache->lock);
+  return (void*)object;
+}
+
+void slab_cache_free(slab_cache_t* cache, void* ptr) {
+  slab_t* slab = (slab_t*)((uint32)ptr & 0xFFFFF000);
+  ASSERT(slab->magic == SLAB_MAGIC);
+  ASSERT(slab->cache == cache);
+
+  yieldlock_lock(&cache->lock);
+
+  if (slab->inuse == cache->objects_per_slab) {
+    slab_list_remove(&cache->full_slabs, slab);
+    slab_list_push(&cache->partial_slabs, slab);
+  }
+
+  void** object = (void**)ptr;
+  *object = slab->free_objects;
+  slab->free_objects = object;
+  slab->inuse--;
+
+  slab_t* to_destroy = nullptr;
+  if (slab->inuse == 0) {
+    slab_list_remove(&cache->partial_slabs, slab);
+    if (cache->empty_slabs_num < EMPTY_SLABS_KEEP) {
+      slab_list_push(&cache->empty_slabs, slab);
+      cache->empty_slabs_num++;
+    } else {
+      to_destroy = slab;
+    }
+  }
+
+  cache->objects_inuse--;
+  cache->free_count++;
+
+  if (to_destroy != nullptr) {
+    slab_destroy(cache, to_destroy);
+  }
+  yieldlock_unlock(&cache->lock);
+}
+
+void* slab_kmalloc(uint32 size) {
+  ASSERT(size > 0 && size <= SLAB_MAX_OBJECT_SIZE);
+  uint32 index = 0;
+  uint32 object_size = SLAB_MIN_OBJECT_SIZE;
+  while (object_size < size) {
+    object_size *= 2;
+    index++;
+  }
+  return slab_cache_alloc(&size_caches[index]);
+}
+
+void slab_free(void* ptr) {
+  slab_t* slab = (slab_t*)((uint32)ptr & 0xFFFFF000);
+  ASSERT(slab->magic == SLAB_MAGIC);
+  slab_cache_free(slab->cache, ptr);
+}
+
+// ****************************************************************************
+void slab_cache_print_stats(slab_cache_t* cache) {
+  monitor_printf("%s: object %d, slabs %d (%d empty), objects %d / %d, alloc %u, free %u\n",
+      cache->name, cache->object_size, cache->slabs_num, cache->empty_slabs_num,
+      cache->objects_inuse, cache->slabs_num * cache->objects_per_slab,
+      cache->alloc_count, cache->free_count);
+}
+
+void slab_print_stats() {
+  monitor_printf("*************************** slab ******************************\n");
+  for (uint32 i = 0; i < SLAB_SIZE_CLASSES_NUM; i++) {
+    slab_cache_print_stats(&size_caches[i]);
+  }
+  monitor_printf("***************************************************************\n");
+}
+
+
+// ******************************** unit tests **********************************
+void slab_test() {
+  monitor_print("slab test ... ");
+
+  slab_cache_t* cache = slab_cache_create("test-12", 12);
+  ASSERT(cache->object_size == 16);
+
+  uint32 num = cache->objects_per_slab * 3;
+  uint32* ptrs[num];
+  for (uint32 i = 0; i < num; i++) {
+    ptrs[i] = (uint32*)slab_cache_alloc(cache);
+    ASSERT(is_slab_object(ptrs[i]));
+    *ptrs[i] = i;
+  }
+  ASSERT(cache->slabs_num == 3);
+  ASSERT(cache->objects_inuse == num);
+  ASSERT(cache->full_slabs != nullptr && cache->partial_slabs == nullptr);
+
+  for (uint32 i = 0; i < num; i++) {
+    ASSERT(*ptrs[i] == i);
+    slab_cache_free(cache, ptrs[i]);
+  }
+  ASSERT(cache->objects_inuse == 0);
+  ASSERT(cache->slabs_num == EMPTY_SLABS_KEEP);
+
+  // kmalloc routes small sizes to size classes.
+  uint8* small = (uint8*)kmalloc(12);
+  ASSERT(is_slab_object(small));
+  uint8* large = (uint8*)kmalloc(SLAB_MAX_OBJECT_SIZE + 1);
+  ASSERT(!is_slab_object(large));
+  kfree(small);
+  kfree(large);
+
+  slab_print_stats();
+  monitor_print_with_color("OK\n", COLOR_GREEN);
+}
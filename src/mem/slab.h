@@ -0,0 +1,81 @@
+#ifndef MEM_SLAB_H
+#define MEM_SLAB_H
+
+#include "common/common.h"
+#include "mem/paging.h"
+#include "sync/yieldlock.h"
+
+// Slab pages live in their own virtual space, right above kheap.
+#define SLAB_START              0xE0000000
+#define SLAB_MAX                0xE4000000
+#define SLAB_PAGES_MAX          ((SLAB_MAX - SLAB_START) / PAGE_SIZE)
+
+#define SLAB_MAGIC              0x51AB51AB
+
+// Power-of-two size classes: 8, 16, 32 ... 512 bytes.
+#define SLAB_MIN_OBJECT_SIZE    8
+#define SLAB_MAX_OBJECT_SIZE    512
+#define SLAB_SIZE_CLASSES_NUM   7
+
+// Each slab is one page, with this header at the beginning, followed by objects.
+struct slab {
+  uint32 magic;
+  struct slab_cache* cache;
+  struct slab* prev;
+  struct slab* next;
+  // singly linked list of free objects, threaded through the objects themselves.
+  void* free_objects;
+  uint32 inuse;
+  uint32 frame;
+};
+typedef struct slab slab_t;
+
+struct slab_cache {
+  char name[32];
+  uint32 object_size;
+  uint32 objects_per_slab;
+
+  slab_t* partial_slabs;
+  slab_t* full_slabs;
+  slab_t* empty_slabs;
+
+  // stats
+  uint32 slabs_num;
+  uint32 empty_slabs_num;
+  uint32 objects_inuse;
+  uint32 alloc_count;
+  uint32 free_count;
+
+  yieldlock_t lock;
+};
+typedef struct slab_cache slab_cache_t;
+
+
+// ****************************************************************************
+void init_slab();
+
+bool slab_is_ready();
+
+// Create a cache for fixed-size objects. The cache struct itself is allocated from kheap.
+slab_cache_t* slab_cache_create(char* name, uint32 object_size);
+void slab_cache_init(slab_cache_t* cache, char* name, uint32 object_size);
+
+void* slab_cache_alloc(slab_cache_t* cache);
+void slab_cache_free(slab_cache_t* cache, void* ptr);
+
+// Allocate from the power-of-two size class that fits size (<= SLAB_MAX_OBJECT_SIZE).
+void* slab_kmalloc(uint32 size);
+
+// Free an object allocated from any slab cache.
+void slab_free(void* ptr);
+
+bool is_slab_object(void* ptr);
+
+void slab_cache_print_stats(slab_cache_t* cache);
+void slab_print_stats();
+
+
+// ******************************** unit tests **********************************
+void slab_test();
+
+#endif
@@ -0,0 +1,221 @@
+#include "mem/paging.h"
+#include "mem/tlb.h"
+#include "monitor/monitor.h"
+#include "interrupt/apic.h"
+#include "interrupt/interrupt.h"
+#include "sync/spinlock.h"
+#include "task/cpu.h"
+
+extern uint32 atomic_exchange(volatile uint32* dst, uint32 src);
+extern uint32 get_eflags();
+
+#define CPUID_FEATURE_PGE  (1 << 13)
+#define CR4_PGE            (1 << 7)
+
+static bool global_pages_enabled = false;
+
+static bool cpu_support_pge() {
+  uint32 eax, ebx, ecx, edx;
+  asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1));
+  return (edx & CPUID_FEATURE_PGE) != 0;
+}
+
+static uint32 read_cr4() {
+  uint32 cr4;
+  asm volatile("mov %%cr4, %0": "=r"(cr4));
+  return cr4;
+}
+
+static void write_cr4(uint32 cr4) {
+  asm volatile("mov %0, %%cr4":: "r"(cr4): "memory");
+}
+
+static void flush_local_range(uint32 virtual_addr, uint32 pages, bool global);
+
+// Lock of shootdown requests. Only one cpu sends them at a time, so that each cpu has at most
+// one request to serve.
+static volatile uint32 shootdown_lock = LOCKED_NO;
+
+void tlb_shootdown_poll() {
+  cpu_t* cpu = get_cpu();
+  if (cpu->tlb_flush_pending) {
+    flush_local_range(cpu->tlb_flush_addr, cpu->tlb_flush_pages, cpu->tlb_flush_global);
+    cpu->tlb_flush_pending = false;
+  }
+}
+
+static void tlb_flush_callback(isr_params_t regs) {
+  tlb_shootdown_poll();
+}
+
+void init_tlb() {
+  if (!cpu_support_pge()) {
+    monitor_printf("global pages not supported\n");
+    return;
+  }
+
+  // Kernel page tables are shared by all processes, so their mappings survive cr3 reloads.
+  // The recursive pde is excluded - it maps the page tables of the current process.
+  pde_t* pd = (pde_t*)PAGE_DIR_VIRTUAL;
+  for (uint32 i = 768; i < 1024; i++) {
+    if (i == TLB_PAGE_TABLES_PDE_INDEX || !pd[i].present) {
+      continue;
+    }
+    pte_t* page_table = (pte_t*)(PAGE_TABLES_VIRTUAL + i * PAGE_SIZE);
+    for (uint32 j = 0; j < 1024; j++) {
+      if (page_table[j].present) {
+        page_table[j].global = 1;
+      }
+    }
+  }
+
+  // Setting cr4.PGE also flushes the entire TLB.
+  write_cr4(read_cr4() | CR4_PGE);
+  global_pages_enabled = true;
+
+  register_interrupt_handler(IPI_TLB_FLUSH_INT_NUM, tlb_flush_callback);
+}
+
+void init_tlb_ap() {
+  if (global_pages_enabled) {
+    write_cr4(read_cr4() | CR4_PGE);
+  }
+}
+
+bool tlb_is_global_page(uint32 virtual_addr) {
+  return global_pages_enabled && virtual_addr >= 0xC0000000 &&
+         (virtual_addr >> 22) != TLB_PAGE_TABLES_PDE_INDEX;
+}
+
+static uint32 cpu_page_dir_phy(cpu_t* cpu) {
+  uint32 page_dir_phy = cpu->page_dir_phy;
+  return page_dir_phy != 0 ? page_dir_phy : KERNEL_PAGE_DIR_PHY;
+}
+
+// User space and page tables are private to an address space. Kernel space is shared by all.
+static bool is_address_space_range(uint32 virtual_addr, uint32 pages) {
+  if (pages == TLB_FLUSH_ALL_PAGES) {
+    return virtual_addr < 0xC0000000;
+  }
+  uint32 last = virtual_addr + (pages - 1) * PAGE_SIZE;
+  if (last < virtual_addr) {
+    return false;
+  }
+  return last < 0xC0000000 ||
+         ((virtual_addr >> 22) == TLB_PAGE_TABLES_PDE_INDEX &&
+          (last >> 22) == TLB_PAGE_TABLES_PDE_INDEX);
+}
+
+// Other cpus may cache the old mapping too. Only those running current address space are asked
+// to flush the range, unless it is in kernel space. Caller waits until all of them are done.
+//
+// Local interrupts are off while waiting, and so may be those of the cpus waited for - each
+// spin loop with interrupts off serves its own request by tlb_shootdown_poll().
+static void shootdown_others(uint32 virtual_addr, uint32 pages, bool global) {
+  cpu_t* self = get_cpu();
+  bool targeted = !global && is_address_space_range(virtual_addr, pages);
+  uint32 page_dir_phy = cpu_page_dir_phy(self);
+
+  while (atomic_exchange(&shootdown_lock, LOCKED_YES) != LOCKED_NO) {
+    tlb_shootdown_poll();
+    asm volatile("pause");
+  }
+
+  // Page table changes must be visible before page dirs of other cpus are read. A cpu switching
+  // to this address space publishes its page dir before loading cr3, which flushes TLB anyway.
+  asm volatile("mfence" ::: "memory");
+
+  bool waiting[MAX_CPUS];
+  for (uint32 i = 0; i < get_cpus_online(); i++) {
+    cpu_t* cpu = get_cpu_by_id(i);
+    waiting[i] = false;
+    if (cpu == self || (targeted && cpu_page_dir_phy(cpu) != page_dir_phy)) {
+      continue;
+    }
+    cpu->tlb_flush_addr = virtual_addr;
+    cpu->tlb_flush_pages = pages;
+    cpu->tlb_flush_global = !targeted;
+    cpu->tlb_flush_pending = true;
+    lapic_send_ipi(cpu->apic_id, IPI_TLB_FLUSH_INT_NUM);
+    waiting[i] = true;
+  }
+
+  for (uint32 i = 0; i < get_cpus_online(); i++) {
+    cpu_t* cpu = get_cpu_by_id(i);
+    while (waiting[i] && cpu->tlb_flush_pending) {
+      asm volatile("pause");
+    }
+  }
+  shootdown_lock = LOCKED_NO;
+}
+
+static void flush_local_page(uint32 virtual_addr) {
+  asm volatile("invlpg (%0)":: "r"(virtual_addr): "memory");
+}
+
+static void flush_local_all() {
+  uint32 cr3;
+  asm volatile("mov %%cr3, %0": "=r"(cr3));
+  asm volatile("mov %0, %%cr3":: "r"(cr3): "memory");
+}
+
+static void flush_local_all_global() {
+  if (!global_pages_enabled) {
+    flush_local_all();
+    return;
+  }
+  // Toggling cr4.PGE flushes global entries as well.
+  uint32 cr4 = read_cr4();
+  write_cr4(cr4 & ~CR4_PGE);
+  write_cr4(cr4);
+}
+
+static void flush_local_range(uint32 virtual_addr, uint32 pages, bool global) {
+  if (pages > TLB_FLUSH_RANGE_THRESHOLD) {
+    // Global pages are not flushed by cr3 reload.
+    if (global) {
+      flush_local_all_global();
+    } else {
+      flush_local_all();
+    }
+  } else {
+    virtual_addr = virtual_addr / PAGE_SIZE * PAGE_SIZE;
+    for (uint32 i = 0; i < pages; i++) {
+      flush_local_page(virtual_addr + i * PAGE_SIZE);
+    }
+  }
+}
+
+// Interrupts are off throughout, so that the thread is not moved to another cpu between local
+// flush and shootdown.
+static void flush_range(uint32 virtual_addr, uint32 pages, bool global) {
+  bool interrupt_on = (get_eflags() & (1 << 9)) != 0;
+  disable_interrupt();
+  flush_local_range(virtual_addr, pages, global);
+  if (get_cpus_online() > 1) {
+    shootdown_others(virtual_addr, pages, global);
+  }
+  if (interrupt_on) {
+    enable_interrupt();
+  }
+}
+
+static bool range_has_global(uint32 virtual_addr, uint32 pages) {
+  return virtual_addr >= 0xC0000000 || virtual_addr + pages * PAGE_SIZE > 0xC0000000;
+}
+
+void tlb_flush_page(uint32 virtual_addr) {
+  flush_range(virtual_addr, 1, false);
+}
+
+void tlb_flush_range(uint32 virtual_addr, uint32 pages) {
+  flush_range(virtual_addr, pages, range_has_global(virtual_addr, pages));
+}
+
+void tlb_flush_all() {
+  flush_range(0, TLB_FLUSH_ALL_PAGES, false);
+}
+
+void tlb_flush_all_global() {
+  flush_range(0, TLB_FLUSH_ALL_PAGES, true);
+}
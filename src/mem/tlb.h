@@ -0,0 +1,44 @@
+#ifndef MEM_TLB_H
+#define MEM_TLB_H
+
+#include "common/common.h"
+
+// Ranges larger than this are flushed by reloading cr3 once, rather than invlpg page by page.
+#define TLB_FLUSH_RANGE_THRESHOLD  32
+
+// Recursive page dir entry which maps page tables - it differs among processes.
+#define TLB_PAGE_TABLES_PDE_INDEX  769
+
+// Page count of a flush of all entries.
+#define TLB_FLUSH_ALL_PAGES        0xFFFFFFFF
+
+
+// ****************************************************************************
+// Detect global page support, and mark the shared kernel mappings global.
+void init_tlb();
+// Enable global pages on an application processor.
+void init_tlb_ap();
+
+// All flushes below apply to other cpus as well - those running current address space, or all
+// of them for kernel space. Mappings which were not present need no flush at all.
+
+// Invalidate a single page.
+void tlb_flush_page(uint32 virtual_addr);
+
+// Invalidate a range of pages.
+void tlb_flush_range(uint32 virtual_addr, uint32 pages);
+
+// Invalidate all non-global entries.
+void tlb_flush_all();
+
+// Invalidate all entries, including global ones.
+void tlb_flush_all_global();
+
+// Serve TLB shootdown request from another cpu, if any. Spin loops with interrupts off must
+// call it, as the cpu they wait for may be waiting for this one.
+void tlb_shootdown_poll();
+
+// Whether the mapping of this virtual address should be marked global.
+bool tlb_is_global_page(uint32 virtual_addr);
+
+#endif
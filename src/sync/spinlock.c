@@ -1,4 +1,5 @@
 #include "interrupt/interrupt.h"
+#include "mem/tlb.h"
 #include "sync/spinlock.h"
 #include "task/thread.h"
 #include "task/scheduler.h"
@@ -17,11 +18,10 @@ void spinlock_lock(spinlock_t *splock) {
   // Disable preempt on local cpu.
   disable_preempt();
 
-  // For uni-processor, disabling preeempt is sufficient to to ensure mutual exclusive.
-  // For multi-processor however, competing for CAS is still needed.
-  #ifndef SINGLE_PROCESSOR
-  while (atomic_exchange(&splock->hold , LOCKED_YES) != LOCKED_NO) {}
-  #endif
+  // Disabling preempt only excludes local cpu, other cpus compete for CAS.
+  while (atomic_exchange(&splock->hold , LOCKED_YES) != LOCKED_NO) {
+    asm volatile("pause");
+  }
 }
 
 // This lock disables local interrupt, and can be used for interrupt handling.
@@ -32,31 +32,31 @@ void spinlock_lock_irqsave(spinlock_t *splock) {
   // Now disable local interrupt and save interrupt flag bit.
   uint32 eflags = get_eflags();
   disable_interrupt();
-  splock->interrupt_mask = (eflags & (1 << 9));
 
-  // For multi-processor, competing for CAS is still needed.
-  #ifndef SINGLE_PROCESSOR
-  while (atomic_exchange(&splock->hold , LOCKED_YES) != LOCKED_NO) {}
-  #endif
+  // Compete with other cpus. Interrupt flag is saved in the lock only after it is taken.
+  // The holder may be waiting for a TLB shootdown on this cpu, which can't take the IPI now.
+  while (atomic_exchange(&splock->hold , LOCKED_YES) != LOCKED_NO) {
+    tlb_shootdown_poll();
+    asm volatile("pause");
+  }
+  splock->interrupt_mask = (eflags & (1 << 9));
 }
 
 void spinlock_unlock(spinlock_t *splock) {
-  #ifndef SINGLE_PROCESSOR
   splock->hold = LOCKED_NO;
-  #endif
 
   enable_preempt();
 }
 
 void spinlock_unlock_irqrestore(spinlock_t *splock) {
-  #ifndef SINGLE_PROCESSOR
+  // Read saved flag before the lock goes to another cpu.
+  uint32 interrupt_mask = splock->interrupt_mask;
   splock->hold = LOCKED_NO;
-  #endif
 
   enable_preempt();
 
   // Restore interrupt flag bit - If it's previously enabled before locking, re-enable it again.
-  if (splock->interrupt_mask) {
+  if (interrupt_mask) {
     enable_interrupt();
   }
 }
@@ -6,8 +6,6 @@
 #define LOCKED_YES 1
 #define LOCKED_NO 0
 
-#define SINGLE_PROCESSOR
-
 typedef struct spinlock {
   volatile uint32 hold;
   volatile uint32 interrupt_mask;
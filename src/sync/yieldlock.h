@@ -6,8 +6,6 @@
 #define LOCKED_YES 1
 #define LOCKED_NO 0
 
-#define SINGLE_PROCESSOR
-
 // yieldlock gives up CPU when it cannot get lock.
 // Since a thread 'yield' action is involved, it apparently can NOT be used in interrupt context.
 typedef struct yieldlock {
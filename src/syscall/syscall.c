@@ -5,7 +5,7 @@ extern void trigger_syscall_exit(int32 exit_code);
 extern int32 trigger_syscall_fork();
 extern int32 trigger_syscall_exec(char* path, uint32 argc, char* argv[]);
 extern void trigger_syscall_yield();
-extern int32 trigger_syscall_read(char* filename, char* buffer, uint32 offset, uint32 size);
+extern int32 trigger_syscall_read(int32 fd, char* buffer, uint32 size);
 extern int32 trigger_syscall_write(char* filename, char* buffer, uint32 offset, uint32 size);
 extern int32 trigger_syscall_stat(char* filename, file_stat_t* stat);
 extern int32 trigger_syscall_listdir(char* dir);
@@ -14,6 +14,16 @@ extern int32 trigger_syscall_wait(uint32 pid, uint32* status);
 extern int32 trigger_syscall_thread_exit();
 extern int32 trigger_syscall_read_char();
 extern void trigger_syscall_move_cursor(int32 delta_x, int32 delta_y);
+extern int32 trigger_syscall_spawn(char* path, uint32 argc, char* argv[]);
+extern int32 trigger_syscall_vfork();
+extern int32 trigger_syscall_open(char* path);
+extern int32 trigger_syscall_pread(int32 fd, char* buffer, uint32 offset, uint32 size);
+extern int32 trigger_syscall_close(int32 fd);
+extern int32 trigger_syscall_lseek(int32 fd, int32 offset, uint32 whence);
+extern int32 trigger_syscall_sync();
+extern int32 trigger_syscall_truncate(char* filename, uint32 size);
+extern int32 trigger_syscall_sleep_ms(uint32 ms);
+extern int32 trigger_syscall_nanosleep(timespec_t* duration);
 
 
 void exit(int32 exit_code) {
@@ -32,8 +42,24 @@ void yield() {
   trigger_syscall_yield();
 }
 
-int32 read(char* filename, char* buffer, uint32 offset, uint32 size) {
-  return trigger_syscall_read(filename, buffer, offset, size);
+int32 open(char* path) {
+  return trigger_syscall_open(path);
+}
+
+int32 read(int32 fd, char* buffer, uint32 size) {
+  return trigger_syscall_read(fd, buffer, size);
+}
+
+int32 pread(int32 fd, char* buffer, uint32 offset, uint32 size) {
+  return trigger_syscall_pread(fd, buffer, offset, size);
+}
+
+int32 close(int32 fd) {
+  return trigger_syscall_close(fd);
+}
+
+int32 lseek(int32 fd, int32 offset, uint32 whence) {
+  return trigger_syscall_lseek(fd, offset, whence);
 }
 
 int32 write(char* filename, char* buffer, uint32 offset, uint32 size) {
@@ -67,3 +93,27 @@ int32 read_char() {
 void move_cursor(int32 delta_x, int32 delta_y) {
   trigger_syscall_move_cursor(delta_x, delta_y);
 }
+
+int32 spawn(char* path, uint32 argc, char* argv[]) {
+  return trigger_syscall_spawn(path, argc, argv);
+}
+
+int32 vfork() {
+  return trigger_syscall_vfork();
+}
+
+int32 sync() {
+  return trigger_syscall_sync();
+}
+
+int32 truncate(char* filename, uint32 size) {
+  return trigger_syscall_truncate(filename, size);
+}
+
+int32 sleep_ms(uint32 ms) {
+  return trigger_syscall_sleep_ms(ms);
+}
+
+int32 nanosleep(timespec_t* duration) {
+  return trigger_syscall_nanosleep(duration);
+}
@@ -3,6 +3,7 @@
 
 #include "common/common.h"
 #include "fs/file.h"
+#include "interrupt/timer.h"
 
 void exit(int32 exit_code);
 
@@ -12,10 +13,26 @@ int32 exec(char* path, uint32 argc, char* argv[]);
 
 void yield();
 
-int32 read(char* filename, char* buffer, uint32 offset, uint32 size);
+int32 open(char* path);
 
+// Read from current offset of fd, and advance it.
+int32 read(int32 fd, char* buffer, uint32 size);
+
+// Read at offset, without moving current offset.
+int32 pread(int32 fd, char* buffer, uint32 offset, uint32 size);
+
+int32 close(int32 fd);
+
+int32 lseek(int32 fd, int32 offset, uint32 whence);
+
+// Write at offset of file, creating it if not exists. Small writes are buffered until sync.
 int32 write(char* filename, char* buffer, uint32 offset, uint32 size);
 
+int32 sync();
+
+// Set size of file, dropping data beyond it or extending it with zeros. Only on tmpfs.
+int32 truncate(char* filename, uint32 size);
+
 int32 stat(char* filename, file_stat_t* stat);
 
 int32 listdir(char* dir);
@@ -30,4 +47,14 @@ int32 read_char();
 
 void move_cursor(int32 delta_x, int32 delta_y);
 
+int32 spawn(char* path, uint32 argc, char* argv[]);
+
+int32 vfork();
+
+// Block for at least the given time. It is rounded up to whole timer ticks.
+int32 sleep_ms(uint32 ms);
+
+// Return -1 if tv_nsec is not less than one second.
+int32 nanosleep(timespec_t* duration);
+
 #endif
@@ -1,11 +1,13 @@
 #include "common/stdlib.h"
 #include "monitor/monitor.h"
 #include "interrupt/interrupt.h"
+#include "interrupt/timer.h"
 #include "mem/paging.h"
 #include "mem/kheap.h"
 #include "task/thread.h"
 #include "fs/vfs.h"
 #include "fs/file.h"
+#include "elf/image_cache.h"
 #include "driver/keyboard.h"
 #include "task/process.h"
 #include "task/scheduler.h"
@@ -28,12 +30,45 @@ static int32 syscall_yield_impl() {
   return 0;
 }
 
-static int32 syscall_read_impl(char* filename, char* buffer, uint32 offset, uint32 size) {
-  return read_file(filename, buffer, offset, size);
+static int32 syscall_open_impl(char* path) {
+  return fd_open(&get_crt_process()->fd_table, path);
+}
+
+static int32 syscall_read_impl(int32 fd, char* buffer, uint32 size) {
+  return fd_read(&get_crt_process()->fd_table, fd, buffer, size);
+}
+
+static int32 syscall_pread_impl(int32 fd, char* buffer, uint32 offset, uint32 size) {
+  return fd_pread(&get_crt_process()->fd_table, fd, buffer, offset, size);
+}
+
+static int32 syscall_close_impl(int32 fd) {
+  return fd_close(&get_crt_process()->fd_table, fd);
+}
+
+static int32 syscall_lseek_impl(int32 fd, int32 offset, uint32 whence) {
+  return fd_lseek(&get_crt_process()->fd_table, fd, offset, whence);
 }
 
 static int32 syscall_write_impl(char* filename, char* buffer, uint32 offset, uint32 size) {
-  return -1;
+  int32 written = write_file(filename, buffer, offset, size);
+  if (written > 0) {
+    // Pages of the old file content may be cached for exec.
+    image_cache_invalidate(filename);
+  }
+  return written;
+}
+
+static int32 syscall_truncate_impl(char* filename, uint32 size) {
+  int32 result = truncate_file(filename, size);
+  if (result == 0) {
+    image_cache_invalidate(filename);
+  }
+  return result;
+}
+
+static int32 syscall_sync_impl() {
+  return sync_file_system();
 }
 
 static int32 syscall_stat_impl(char* filename, file_stat_t* stat) {
@@ -67,6 +102,23 @@ static int32 syscall_move_cursor_impl(int32 delta_x, int32 delta_y) {
   return 0;
 }
 
+static int32 syscall_spawn_impl(char* path, uint32 argc, char* argv[]) {
+  return process_spawn(path, argc, argv);
+}
+
+static int32 syscall_vfork_impl() {
+  return process_vfork();
+}
+
+static int32 syscall_sleep_ms_impl(uint32 ms) {
+  timer_sleep_ms(ms);
+  return 0;
+}
+
+static int32 syscall_nanosleep_impl(timespec_t* duration) {
+  return timer_nanosleep(duration);
+}
+
 int32 syscall_handler(isr_params_t isr_params) {
   // syscall num saved in eax.
   // args list: ecx, edx, ebx, esi, edi
@@ -82,8 +134,8 @@ int32 syscall_handler(isr_params_t isr_params) {
     case SYSCALL_YIELD_NUM:
       return syscall_yield_impl();
     case SYSCALL_READ_NUM:
-      return syscall_read_impl((char*)isr_params.ecx, (char*)isr_params.edx,
-          (uint32)isr_params.ebx, (uint32)isr_params.esi);
+      return syscall_read_impl((int32)isr_params.ecx, (char*)isr_params.edx,
+          (uint32)isr_params.ebx);
     case SYSCALL_WRITE_NUM:
       return syscall_write_impl((char*)isr_params.ecx, (char*)isr_params.edx,
           (uint32)isr_params.ebx, (uint32)isr_params.esi);
@@ -101,6 +153,28 @@ int32 syscall_handler(isr_params_t isr_params) {
       return syscall_read_char_impl();
     case SYSCALL_MOVE_CURSOR_NUM:
       return syscall_move_cursor_impl((int32)isr_params.ecx, (int32)isr_params.edx);
+    case SYSCALL_SPAWN_NUM:
+      return syscall_spawn_impl((char*)isr_params.ecx, isr_params.edx, (char**)isr_params.ebx);
+    case SYSCALL_VFORK_NUM:
+      return syscall_vfork_impl();
+    case SYSCALL_OPEN_NUM:
+      return syscall_open_impl((char*)isr_params.ecx);
+    case SYSCALL_PREAD_NUM:
+      return syscall_pread_impl((int32)isr_params.ecx, (char*)isr_params.edx,
+          (uint32)isr_params.ebx, (uint32)isr_params.esi);
+    case SYSCALL_CLOSE_NUM:
+      return syscall_close_impl((int32)isr_params.ecx);
+    case SYSCALL_LSEEK_NUM:
+      return syscall_lseek_impl((int32)isr_params.ecx, (int32)isr_params.edx,
+          (uint32)isr_params.ebx);
+    case SYSCALL_SYNC_NUM:
+      return syscall_sync_impl();
+    case SYSCALL_TRUNCATE_NUM:
+      return syscall_truncate_impl((char*)isr_params.ecx, (uint32)isr_params.edx);
+    case SYSCALL_SLEEP_MS_NUM:
+      return syscall_sleep_ms_impl((uint32)isr_params.ecx);
+    case SYSCALL_NANOSLEEP_NUM:
+      return syscall_nanosleep_impl((timespec_t*)isr_params.ecx);
     default:
       PANIC();
   }
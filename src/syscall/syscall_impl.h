@@ -17,6 +17,16 @@
 #define SYSCALL_THREAD_EXIT_NUM   10
 #define SYSCALL_READ_CHAR_NUM     11
 #define SYSCALL_MOVE_CURSOR_NUM   12
+#define SYSCALL_SPAWN_NUM         13
+#define SYSCALL_VFORK_NUM         14
+#define SYSCALL_OPEN_NUM          15
+#define SYSCALL_PREAD_NUM         16
+#define SYSCALL_CLOSE_NUM         17
+#define SYSCALL_LSEEK_NUM         18
+#define SYSCALL_SYNC_NUM          19
+#define SYSCALL_TRUNCATE_NUM      20
+#define SYSCALL_SLEEP_MS_NUM      21
+#define SYSCALL_NANOSLEEP_NUM     22
 
 
 int32 syscall_handler(isr_params_t isr_params);
@@ -0,0 +1,241 @@
+#include "common/stdlib.h"
+#include "monitor/monitor.h"
+#include "interrupt/apic.h"
+#include "interrupt/interrupt.h"
+#include "interrupt/timer.h"
+#include "mem/gdt.h"
+#include "mem/kheap.h"
+#include "mem/tlb.h"
+#include "task/cpu.h"
+#include "task/scheduler.h"
+#include "utils/debug.h"
+
+extern void cpu_idle();
+
+// boot code for application processors, see ap_boot.S
+extern char ap_boot_start[];
+extern char ap_boot_end[];
+extern char ap_boot_page_dir[];
+extern char ap_boot_stack[];
+extern char ap_boot_entry[];
+
+// ******************************** MP table ***********************************
+#define MP_FLOATING_SIGNATURE  0x5F504D5F  // "_MP_"
+#define MP_CONFIG_SIGNATURE    0x504D4350  // "PCMP"
+#define MP_ENTRY_PROCESSOR     0
+#define MP_PROCESSOR_ENABLED   0x1
+#define MP_PROCESSOR_BSP       0x2
+
+#define LOW_MEM_VIRTUAL(addr)  (0xC0000000 + (uint32)(addr))
+#define LOW_MEM_SIZE           (1024 * 1024)
+
+struct mp_floating_pointer {
+  uint32 signature;
+  uint32 config_table;
+  uint8 length;  // in 16 bytes
+  uint8 version;
+  uint8 checksum;
+  uint8 features[5];
+} __attribute__((packed));
+typedef struct mp_floating_pointer mp_floating_pointer_t;
+
+struct mp_config_table {
+  uint32 signature;
+  uint16 length;
+  uint8 version;
+  uint8 checksum;
+  char oem_id[8];
+  char product_id[12];
+  uint32 oem_table;
+  uint16 oem_table_size;
+  uint16 entries_num;
+  uint32 lapic_addr;
+  uint16 ext_table_length;
+  uint8 ext_table_checksum;
+  uint8 reserved;
+} __attribute__((packed));
+typedef struct mp_config_table mp_config_table_t;
+
+struct mp_processor_entry {
+  uint8 type;
+  uint8 apic_id;
+  uint8 apic_version;
+  uint8 flags;
+  uint32 signature;
+  uint32 features;
+  uint32 reserved[2];
+} __attribute__((packed));
+typedef struct mp_processor_entry mp_processor_entry_t;
+
+// ****************************************************************************
+static cpu_t cpus[MAX_CPUS];
+static uint32 cpus_num = 1;
+static volatile uint32 cpus_online = 1;
+
+static uint8 apic_id_to_cpu[256];
+
+void init_cpus() {
+  memset(cpus, 0, sizeof(cpus));
+  memset(apic_id_to_cpu, 0, sizeof(apic_id_to_cpu));
+  for (uint32 i = 0; i < MAX_CPUS; i++) {
+    cpus[i].id = i;
+  }
+  cpus[0].started = true;
+}
+
+cpu_t* get_cpu() {
+  if (!lapic_is_enabled()) {
+    return &cpus[0];
+  }
+  return &cpus[apic_id_to_cpu[lapic_id()]];
+}
+
+cpu_t* get_cpu_by_id(uint32 id) {
+  return &cpus[id];
+}
+
+uint32 get_cpus_online() {
+  return cpus_online;
+}
+
+static bool checksum_ok(uint8* addr, uint32 length) {
+  uint8 sum = 0;
+  for (uint32 i = 0; i < length; i++) {
+    sum += addr[i];
+  }
+  return sum == 0;
+}
+
+static mp_floating_pointer_t* search_mp_floating_pointer(uint32 start, uint32 length) {
+  for (uint32 addr = start; addr + sizeof(mp_floating_pointer_t) <= start + length; addr += 16) {
+    mp_floating_pointer_t* mp = (mp_floating_pointer_t*)LOW_MEM_VIRTUAL(addr);
+    if (mp->signature == MP_FLOATING_SIGNATURE && mp->length == 1 &&
+        checksum_ok((uint8*)mp, sizeof(mp_floating_pointer_t))) {
+      return mp;
+    }
+  }
+  return nullptr;
+}
+
+// MP floating pointer is in the first 1KB of EBDA, or the last 1KB of base memory, or BIOS rom.
+static mp_floating_pointer_t* find_mp_floating_pointer() {
+  mp_floating_pointer_t* mp;
+  uint32 ebda = (*(uint16*)LOW_MEM_VIRTUAL(0x40E)) << 4;
+  if (ebda != 0 && (mp = search_mp_floating_pointer(ebda, 1024)) != nullptr) {
+    return mp;
+  }
+  uint32 base_mem = (*(uint16*)LOW_MEM_VIRTUAL(0x413)) * 1024;
+  if (base_mem >= 1024 && (mp = search_mp_floating_pointer(base_mem - 1024, 1024)) != nullptr) {
+    return mp;
+  }
+  return search_mp_floating_pointer(0xF0000, 0x10000);
+}
+
+// Collect cpus from MP config table, and return local APIC address, or 0 if not found.
+static uint32 parse_mp_config() {
+  mp_floating_pointer_t* mp = find_mp_floating_pointer();
+  if (mp == nullptr || mp->config_table == 0 || mp->config_table >= LOW_MEM_SIZE) {
+    return 0;
+  }
+  mp_config_table_t* config = (mp_config_table_t*)LOW_MEM_VIRTUAL(mp->config_table);
+  if (config->signature != MP_CONFIG_SIGNATURE ||
+      mp->config_table + config->length > LOW_MEM_SIZE ||
+      !checksum_ok((uint8*)config, config->length)) {
+    return 0;
+  }
+
+  // Bootstrap processor is always cpu 0, the others are numbered in table order.
+  cpus_num = 1;
+  uint8* entry = (uint8*)config + sizeof(mp_config_table_t);
+  for (uint32 i = 0; i < config->entries_num; i++) {
+    if (*entry != MP_ENTRY_PROCESSOR) {
+      // All other entries are 8 bytes.
+      entry += 8;
+      continue;
+    }
+    mp_processor_entry_t* processor = (mp_processor_entry_t*)entry;
+    entry += sizeof(mp_processor_entry_t);
+    if (!(processor->flags & MP_PROCESSOR_ENABLED) || (processor->flags & MP_PROCESSOR_BSP)) {
+      continue;
+    }
+    if (cpus_num >= MAX_CPUS) {
+      monitor_printf("smp: only %d cpus are supported\n", MAX_CPUS);
+      break;
+    }
+    cpus[cpus_num].apic_id = processor->apic_id;
+    cpus_num++;
+  }
+  return config->lapic_addr;
+}
+
+// ****************************************************************************
+// Application processors jump here from ap_boot.S, with paging on and a boot stack.
+static void ap_main() {
+  cpu_t* cpu = get_cpu();
+  init_gdt_ap(cpu->id);
+  init_idt_ap();
+  init_tlb_ap();
+  init_lapic_ap();
+  lapic_start_timer();
+
+  cpu->started = true;
+
+  // Never returns.
+  schedule_start_cpu();
+}
+
+static bool start_cpu(cpu_t* cpu) {
+  // Boot stack is only used until the cpu switches to its idle thread, and it is never freed.
+  uint32 stack = (uint32)kmalloc(AP_BOOT_STACK_SIZE);
+  memset((void*)stack, 0, AP_BOOT_STACK_SIZE);
+
+  uint32 boot_code = LOW_MEM_VIRTUAL(AP_BOOT_ADDR);
+  *(uint32*)(boot_code + (ap_boot_page_dir - ap_boot_start)) = KERNEL_PAGE_DIR_PHY;
+  *(uint32*)(boot_code + (ap_boot_stack - ap_boot_start)) = stack + AP_BOOT_STACK_SIZE;
+  *(uint32*)(boot_code + (ap_boot_entry - ap_boot_start)) = (uint32)ap_main;
+
+  lapic_start_ap(cpu->apic_id, AP_BOOT_ADDR);
+
+  uint32 deadline = getTick() + AP_BOOT_TIMEOUT_TICKS;
+  while (!cpu->started && (int32)(getTick() - deadline) < 0) {
+    cpu_idle();
+  }
+  return cpu->started;
+}
+
+void start_other_cpus() {
+  uint32 lapic_addr = parse_mp_config();
+  if (lapic_addr == 0) {
+    lapic_addr = LAPIC_BASE_DEFAULT;
+  }
+  init_lapic(lapic_addr);
+  cpus[0].apic_id = lapic_id();
+  apic_id_to_cpu[cpus[0].apic_id] = 0;
+  for (uint32 i = 1; i < cpus_num; i++) {
+    apic_id_to_cpu[cpus[i].apic_id] = i;
+  }
+
+  // Other cpus have no PIT, they get timer interrupts from local APIC. It also wakes up idle
+  // bootstrap processor when PIT is stopped.
+  disable_preempt();
+  lapic_calibrate_timer();
+  enable_preempt();
+  if (cpus_num == 1) {
+    return;
+  }
+
+  memcpy((void*)LOW_MEM_VIRTUAL(AP_BOOT_ADDR), ap_boot_start, ap_boot_end - ap_boot_start);
+
+  // One at a time, as they share the boot code. Stop at the first failed one - it might still
+  // come up later and run the boot code prepared for the next.
+  for (uint32 i = 1; i < cpus_num; i++) {
+    cpu_t* cpu = &cpus[i];
+    schedule_init_cpu(cpu);
+    if (!start_cpu(cpu)) {
+      monitor_printf("smp: cpu %d (apic id %d) failed to start\n", i, cpu->apic_id);
+      break;
+    }
+    cpus_online++;
+  }
+  monitor_printf("smp: %d cpus online\n", cpus_online);
+}
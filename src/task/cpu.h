@@ -0,0 +1,60 @@
+#ifndef TASK_CPU_H
+#define TASK_CPU_H
+
+#include "common/common.h"
+#include "mem/paging.h"
+#include "utils/linked_list.h"
+
+#define MAX_CPUS  8
+
+// Application processors start in real mode at this physical address, which must be page
+// aligned and below 1MB. Low 1MB is identity mapped in kernel page dir, so the boot code still
+// runs right after it turns paging on.
+#define AP_BOOT_ADDR        0x7000
+#define AP_BOOT_STACK_SIZE  4096
+
+// Timer ticks to wait for an application processor to come up.
+#define AP_BOOT_TIMEOUT_TICKS  50
+
+// Per-cpu data. Current cpu is told by local APIC id.
+struct cpu {
+  uint32 id;
+  uint32 apic_id;
+  volatile bool started;
+
+  // running thread, and the idle thread which runs when nothing else is ready
+  struct linked_list_node* crt_thread_node;
+  struct linked_list_node* idle_thread_node;
+  // thread switched out by the last context switch, which is yet to be finished
+  struct task_struct* prev_thread;
+
+  page_directory_t* page_dir;
+  // physical address of page_dir, 0 until it is first loaded; read by other cpus
+  volatile uint32 page_dir_phy;
+  bool in_irq_context;
+
+  // TLB shootdown request, set by another cpu which changed page mappings. pending is cleared
+  // once the range is flushed.
+  volatile bool tlb_flush_pending;
+  uint32 tlb_flush_addr;
+  uint32 tlb_flush_pages;
+  bool tlb_flush_global;
+
+  // timer is stopped while idle, see timer_idle_enter()
+  volatile uint32 tickless;
+};
+typedef struct cpu cpu_t;
+
+
+// ****************************************************************************
+// Bootstrap processor only, until other cpus are started.
+void init_cpus();
+
+// Find other cpus in MP table, and start them. They go idle, waiting for threads to run.
+void start_other_cpus();
+
+cpu_t* get_cpu();
+cpu_t* get_cpu_by_id(uint32 id);
+uint32 get_cpus_online();
+
+#endif
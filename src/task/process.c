@@ -8,6 +8,8 @@
 #include "fs/file.h"
 #include "fs/vfs.h"
 #include "elf/elf.h"
+#include "elf/image_cache.h"
+#include "utils/math.h"
 #include "utils/string.h"
 #include "utils/debug.h"
 #include "utils/hash_table.h"
@@ -20,7 +22,8 @@ void init_process_manager() {
   id_pool_init(&process_id_pool, 1024, 16384);
 }
 
-pcb_t* create_process(char* name, uint8 is_kernel_process) {
+static pcb_t* create_process_with_page_dir(
+    char* name, uint8 is_kernel_process, page_directory_t page_dir) {
   pcb_t* process = (pcb_t*)kmalloc(sizeof(pcb_t));
   memset(process, 0, sizeof(pcb_t));
 
@@ -57,15 +60,23 @@ pcb_t* create_process(char* name, uint8 is_kernel_process) {
 
   process->waiting_thread_node = nullptr;
 
-  process->page_dir = clone_crt_page_dir();
+  process->page_dir = page_dir;
   yieldlock_init(&process->page_dir_lock);
 
+  yieldlock_init(&process->exec_program_lock);
+
+  fd_table_init(&process->fd_table);
+
   yieldlock_init(&process->lock);
 
   add_new_process(process);
   return process;
 }
 
+pcb_t* create_process(char* name, uint8 is_kernel_process) {
+  return create_process_with_page_dir(name, is_kernel_process, clone_crt_page_dir());
+}
+
 tcb_t* create_new_kernel_thread(pcb_t* process, char* name, void* function) {
   tcb_t* thread = init_thread(nullptr, name, function, THREAD_DEFAULT_PRIORITY, false);
   add_process_thread(process, thread);
@@ -129,6 +140,16 @@ static void release_user_space_pages() {
   release_pages_tables(1, 767);
 }
 
+// Child inherits parent's program mappings.
+static void copy_exec_program(pcb_t* process, pcb_t* parent_process) {
+  if (parent_process->exec_path == nullptr) {
+    return;
+  }
+  process->exec_path = (char*)kmalloc(strlen(parent_process->exec_path) + 1);
+  strcpy(process->exec_path, parent_process->exec_path);
+  process->exec_program = parent_process->exec_program;
+}
+
 int32 process_fork() {
   // Create a new process, with page directory cloned from this process.
   pcb_t* process = create_process(nullptr, /* is_kernel_process = */false);
@@ -137,6 +158,8 @@ int32 process_fork() {
   pcb_t* parent_process = get_crt_thread()->process;
   process->parent = parent_process;
   add_child_process(parent_process, process);
+  copy_exec_program(process, parent_process);
+  fd_table_copy(&process->fd_table, &parent_process->fd_table);
 
   // Copy current thread and prepare for its kernel and user stacks.
   tcb_t* thread = fork_crt_thread();
@@ -156,21 +179,131 @@ int32 process_fork() {
   return process->id;
 }
 
-int32 process_exec(char* path, uint32 argc, char* argv[]) {
-  // TODO: disallow exec if there are multiple threads running on this process?
+// Let the parent of a vfork child continue.
+static void vfork_release_parent(pcb_t* process) {
+  pcb_t* parent = process->parent;
+  yieldlock_lock(&parent->lock);
+  process->vfork_released = true;
+  if (parent->vfork_waiting_thread_node != nullptr) {
+    add_thread_node_to_schedule(parent->vfork_waiting_thread_node);
+    parent->vfork_waiting_thread_node = nullptr;
+  }
+  yieldlock_unlock(&parent->lock);
+}
+
+// Like fork, but the child borrows parent's address space instead of cloning it, and parent is
+// suspended until the child calls exec or exits. The child must do nothing else.
+int32 process_vfork() {
+  thread_node_t* thread_node = get_crt_thread_node();
+  pcb_t* parent_process = get_crt_thread()->process;
+  pcb_t* process = create_process_with_page_dir(
+      nullptr, /* is_kernel_process = */false, parent_process->page_dir);
+  process->vfork_child = true;
+  process->parent = parent_process;
+  add_child_process(parent_process, process);
+  copy_exec_program(process, parent_process);
+  fd_table_copy(&process->fd_table, &parent_process->fd_table);
+
+  tcb_t* thread = fork_crt_thread();
+  if (thread == nullptr) {
+    return -1;
+  }
+  add_process_thread(process, thread);
+  bitmap_set_bit(&process->user_thread_stack_indexes, thread->user_stack_index);
+
+  yieldlock_lock(&parent_process->lock);
+  add_thread_to_schedule(thread);
+  while (!process->vfork_released) {
+    parent_process->vfork_waiting_thread_node = thread_node;
+    schedule_mark_thread_block();
+    yieldlock_unlock(&parent_process->lock);
+    schedule_thread_yield();
+
+    yieldlock_lock(&parent_process->lock);
+  }
+  yieldlock_unlock(&parent_process->lock);
+
+  return process->id;
+}
 
-  // Read elf binary file.
+// Read elf headers of program. Segments are not loaded here - they are paged in on demand.
+static int32 read_program(char* path, elf_program_t* program) {
   file_stat_t stat;
   if (stat_file(path, &stat) != 0) {
     monitor_printf("Command %s not found\n", path);
     return -1;
   }
-
-  uint32 size = stat.size;
-  char* read_buffer = (char*)kmalloc(size);
-  if (read_file(path, read_buffer, 0, size) != size) {
+  if (parse_elf(path, program) != 0) {
     monitor_printf("Failed to load cmd %s\n", path);
-    kfree(read_buffer);
+    return -1;
+  }
+  return 0;
+}
+
+// Set program as the file-backed mappings of current process. path must be a kernel copy, and
+// it is owned by process from now on.
+static void set_exec_program(pcb_t* process, char* path, elf_program_t* program) {
+  yieldlock_lock(&process->exec_program_lock);
+  if (process->exec_path != nullptr) {
+    kfree(process->exec_path);
+  }
+  process->exec_path = path;
+  process->exec_program = *program;
+  yieldlock_unlock(&process->exec_program_lock);
+}
+
+// Start the main thread of exec'ed program. args are kernel copies, and they are released here.
+static void start_program(pcb_t* process, uint32 argc, char** args) {
+  //monitor_printf("entry = %x\n", process->exec_program.entry);
+  tcb_t* new_thread = create_new_user_thread(
+      process, process->exec_path, (void*)process->exec_program.entry, argc, args);
+  add_thread_to_schedule(new_thread);
+  destroy_str_array(argc, args);
+
+  // Exit current thread. This thread will never return to user mode.
+  schedule_thread_exit();
+}
+
+// First thread of a spawned process. It runs in the new process's empty address space.
+static void spawn_thread_entry() {
+  pcb_t* process = get_crt_thread()->process;
+  uint32 argc = process->spawn_argc;
+  char** args = process->spawn_args;
+  process->spawn_args = nullptr;
+  start_program(process, argc, args);
+}
+
+// Create a child process running the program directly - parent's address space is not copied.
+int32 process_spawn(char* path, uint32 argc, char* argv[]) {
+  elf_program_t program;
+  if (read_program(path, &program) != 0) {
+    return -1;
+  }
+
+  pcb_t* process = create_process_with_page_dir(
+      nullptr, /* is_kernel_process = */false, create_user_page_dir());
+  pcb_t* parent_process = get_crt_thread()->process;
+  process->parent = parent_process;
+  add_child_process(parent_process, process);
+
+  // Copy path and argv[] to kernel, since they are not accessible from the child.
+  char* path_copy = (char*)kmalloc(strlen(path) + 1);
+  strcpy(path_copy, path);
+  set_exec_program(process, path_copy, &program);
+  process->spawn_argc = argc;
+  process->spawn_args = copy_str_array(argc, argv);
+
+  tcb_t* thread = create_new_kernel_thread(process, nullptr, spawn_thread_entry);
+  add_thread_to_schedule(thread);
+  return process->id;
+}
+
+int32 process_exec(char* path, uint32 argc, char* argv[]) {
+  // TODO: disallow exec if there are multiple threads running on this process?
+
+  // Read elf headers.
+  elf_program_t program;
+  if (read_program(path, &program) != 0) {
     return -1;
   }
 
@@ -196,29 +329,60 @@ int32 process_exec(char* path, uint32 argc, char* argv[]) {
   char* path_copy = (char*)kmalloc(strlen(path) + 1);
   strcpy(path_copy, path);
 
-  // Release all user space pages of this process.
-  release_user_space_pages();
+  if (process->vfork_child) {
+    // Leave parent's address space for a new one, and let parent continue.
+    process->page_dir = create_user_page_dir();
+    reload_page_directory(&process->page_dir);
+    process->vfork_child = false;
+    vfork_release_parent(process);
+  } else {
+    // Release all user space pages of this process.
+    release_user_space_pages();
+  }
+
+  set_exec_program(process, path_copy, &program);
+  start_program(process, argc, args);
+}
 
-  // Load elf binary.
-  uint32 exec_entry;
-  if (load_elf(read_buffer, &exec_entry)) {
-    monitor_printf("faile to load elf file %s\n", path_copy);
-    kfree(read_buffer);
-    destroy_str_array(argc, args);
-    kfree(path_copy);
-    process_exit(-1);
+// Map a page of program on page fault, and fill it from file. The part of segment beyond file
+// size is left zero, as the newly mapped page is cleared. If file can't be read, the process is
+// killed rather than run on a corrupt page.
+bool process_fill_file_page(uint32 virtual_addr) {
+  pcb_t* process = get_crt_process();
+  if (process == nullptr || process->exec_path == nullptr) {
+    return false;
   }
-  //monitor_printf("entry = %x\n", exec_entry);
-  kfree(read_buffer);
 
-  // Create a new thread to exec new program.
-  tcb_t* new_thread = create_new_user_thread(process, path_copy, (void*)exec_entry, argc, args);
-  add_thread_to_schedule(new_thread);
-  destroy_str_array(argc, args);
-  kfree(path_copy);
+  uint32 page_start = virtual_addr / PAGE_SIZE * PAGE_SIZE;
+  elf_program_t* program = &process->exec_program;
 
-  // Exit current thread. This thread will never return to user mode.
-  schedule_thread_exit();
+  yieldlock_lock(&process->exec_program_lock);
+  if (!elf_page_is_loadable(program, page_start)) {
+    yieldlock_unlock(&process->exec_program_lock);
+    return false;
+  }
+
+  // Another thread may have filled it already.
+  int32 result = 0;
+  if (!is_page_mapped(page_start)) {
+    // Read-only pages are shared with other processes running the same image.
+    if (!elf_page_is_readonly(program, page_start) ||
+        !image_cache_map_page(program, page_start)) {
+      map_page(page_start);
+      result = elf_fill_page(program, page_start, (char*)page_start);
+      if (result != 0) {
+        release_pages(page_start, 1, true);
+      }
+    }
+  }
+  yieldlock_unlock(&process->exec_program_lock);
+
+  if (result != 0) {
+    monitor_printf("process %d couldn't read %s at %x, killed\n",
+                   process->id, process->exec_path, page_start);
+    process_exit(-1);
+  }
+  return true;
 }
 
 // Process wait
@@ -309,6 +473,9 @@ void process_exit(int32 exit_code) {
   process->status = PROCESS_EXIT;
 
   release_process_resources(process);
+  if (process->vfork_child) {
+    vfork_release_parent(process);
+  }
 
   // Thread will use kernel page table after this line.
   thread->process = nullptr;
@@ -334,7 +501,17 @@ void release_process_resources(pcb_t* process) {
   hash_table_clear(&process->threads);
   hash_table_destroy(&process->exit_children_processes);
 
-  release_user_space_pages();
+  if (process->exec_path != nullptr) {
+    kfree(process->exec_path);
+    process->exec_path = nullptr;
+  }
+
+  fd_table_release(&process->fd_table);
+
+  // vfork child doesn't own the address space.
+  if (!process->vfork_child) {
+    release_user_space_pages();
+  }
 }
 
 // The final step of destroying a process:
@@ -342,7 +519,9 @@ void release_process_resources(pcb_t* process) {
 //  - Return pid;
 //  - Release process struct;
 void destroy_process(pcb_t* process) {
-  release_phy_frame(process->page_dir.page_dir_entries_phy);
+  if (!process->vfork_child) {
+    release_phy_frame(process->page_dir.page_dir_entries_phy / PAGE_SIZE);
+  }
   id_pool_free_id(&process_id_pool, process->id);
   kfree(process);
 }
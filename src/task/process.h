@@ -3,16 +3,30 @@
 
 #include "task/thread.h"
 #include "mem/paging.h"
+#include "elf/elf.h"
+#include "fs/fd_table.h"
 #include "sync/mutex.h"
 #include "sync/yieldlock.h"
+#include "task/cpu.h"
 #include "utils/bitmap.h"
 #include "utils/linked_list.h"
 #include "utils/hash_table.h"
+#include "utils/rb_tree.h"
 
 #define USER_STACK_TOP   0xBFC00000  // 0xC0000000 - 4MB
 #define USER_STACK_SIZE  65536       // 64KB
 #define USER_PRCOESS_THREDS_MAX  4096
 
+// Fair scheduling of a process on one cpu: CPU time of its threads there, its ready threads
+// there by vruntime, and position in the tree of processes with ready threads of that cpu.
+struct fair_entity {
+  uint32 vruntime;
+  uint32 min_vruntime;
+  rb_tree_t ready_threads;
+  rb_node_t rb_node;
+};
+typedef struct fair_entity fair_entity_t;
+
 enum process_status {
   PROCESS_NORMAL,
   PROCESS_EXIT,
@@ -55,6 +69,27 @@ struct process_struct {
   page_directory_t page_dir;
   yieldlock_t page_dir_lock;
 
+  // exec'ed program, whose segments are paged in from file on demand
+  char* exec_path;
+  elf_program_t exec_program;
+  yieldlock_t exec_program_lock;
+
+  // open files
+  fd_table_t fd_table;
+
+  // args of the program, for a spawned process to start with
+  uint32 spawn_argc;
+  char** spawn_args;
+
+  // A vfork child runs on its parent's page directory, until it execs or exits.
+  bool vfork_child;
+  bool vfork_released;
+  // parent thread waiting for vfork child
+  struct linked_list_node* vfork_waiting_thread_node;
+
+  // fair scheduling, on each cpu
+  fair_entity_t fair_entities[MAX_CPUS];
+
   // lock to protect this struct
   yieldlock_t lock;
 };
@@ -80,8 +115,13 @@ void destroy_process(pcb_t* process);
 
 // syscalls implementation
 int32 process_fork();
+int32 process_vfork();
+int32 process_spawn(char* path, uint32 argc, char* argv[]);
 int32 process_exec(char* path, uint32 argc, char* argv[]);
 int32 process_wait(uint32 pid, uint32* status);
 void process_exit(int32 exit_code);
 
+// Page fault on a file-backed page of current process's program.
+bool process_fill_file_page(uint32 virtual_addr);
+
 #endif
@@ -1,29 +1,63 @@
 #include "common/stdio.h"
+#include "common/stdlib.h"
 #include "monitor/monitor.h"
 #include "task/thread.h"
 #include "task/process.h"
 #include "task/scheduler.h"
+#include "task/cpu.h"
 #include "syscall/syscall.h"
 #include "interrupt/interrupt.h"
+#include "interrupt/apic.h"
+#include "interrupt/timer.h"
 #include "mem/gdt.h"
 #include "mem/kheap.h"
 #include "mem/paging.h"
+#include "mem/tlb.h"
 #include "sync/yieldlock.h"
 #include "sync/cond_var.h"
 #include "utils/linked_list.h"
 #include "utils/hash_table.h"
+#include "utils/rb_tree.h"
+#include "utils/math.h"
 #include "utils/debug.h"
 
 extern void cpu_idle();
+extern void cpu_safe_halt();
 extern void context_switch(tcb_t* crt, tcb_t* next);
 extern void resume_thread();
+extern uint32 atomic_exchange(volatile uint32* dst, uint32 src);
+extern uint32 get_eflags();
 
 // ****************************************************************************
 static pcb_t* main_process;
 static thread_node_t* main_thread_node;
 static thread_node_t* kernel_clean_node;
 
-static thread_node_t* crt_thread_node = nullptr;
+// Ready threads of a cpu, and its scheduling counters. The lock also protects current thread
+// of the cpu. It is taken with local interrupts off, and held across context switch - the next
+// thread releases it in finish_context_switch().
+struct run_queue {
+  uint32 id;
+  volatile uint32 lock_hold;
+
+  // ready kernel threads, one queue for each priority level
+  linked_list_t ready_queues[SCHEDULE_PRIORITY_LEVELS];
+  // bit i is set if ready_queues[i] is not empty
+  uint32 ready_levels;
+
+  // processes with ready fair threads here, by vruntime of their fair entity of this cpu
+  rb_tree_t fair_processes;
+  // vruntime a process is placed at when it gets ready, never going backwards
+  uint32 fair_min_vruntime;
+
+  // ready threads of all classes, not counting the running one
+  volatile uint32 ready_num;
+
+  schedule_stats_t stats;
+};
+typedef struct run_queue run_queue_t;
+
+static run_queue_t run_queues[MAX_CPUS];
 
 // processes map
 static hash_table_t processes_map;
@@ -39,10 +73,14 @@ static cond_var_t dead_resource_cv;
 static hash_table_t threads_map;
 static yieldlock_t threads_map_lock;
 
-// ready task queue
-static linked_list_t ready_tasks;
-
-static bool main_thread_in_ready_queue = false;
+// Weight of each priority level for fair scheduling - each level gets about 1.25x the CPU of
+// the next one. THREAD_DEFAULT_PRIORITY has SCHEDULE_NICE_0_WEIGHT.
+static const uint32 priority_weights[SCHEDULE_PRIORITY_LEVELS] = {
+  9548, 7620, 6100, 4904, 3906, 3121, 2501, 1991, 1586, 1277,
+  1024,  820,  655,  526,  423,  335,  272,  215,  172,  137,
+   110,   87,   70,   56,   45,   36,   29,   23,   18,   15,
+    15,   15,
+};
 
 static bool multi_task_enabled = false;
 
@@ -50,8 +88,14 @@ static bool multi_task_enabled = false;
 static void kernel_main_thread();
 static void kernel_clean_thread();
 static void kernel_init_thread();
+static void cpu_idle_thread();
 
 static bool has_dead_resource();
+static void reschedule_callback(isr_params_t regs);
+static bool is_idle(cpu_t* cpu);
+static void balance_load(cpu_t* cpu);
+static int32 compare_entity_vruntime(rb_node_t* node1, rb_node_t* node2);
+static int32 compare_thread_vruntime(rb_node_t* node1, rb_node_t* node2);
 
 bool multi_task_is_enabled() {
   return multi_task_enabled;
@@ -60,7 +104,16 @@ bool multi_task_is_enabled() {
 void init_scheduler() {
   disable_interrupt();
 
-  linked_list_init(&ready_tasks);
+  for (uint32 i = 0; i < MAX_CPUS; i++) {
+    run_queue_t* rq = &run_queues[i];
+    memset(rq, 0, sizeof(run_queue_t));
+    rq->id = i;
+    rq->lock_hold = LOCKED_NO;
+    for (uint32 j = 0; j < SCHEDULE_PRIORITY_LEVELS; j++) {
+      linked_list_init(&rq->ready_queues[j]);
+    }
+    rb_tree_init(&rq->fair_processes, compare_entity_vruntime);
+  }
 
   hash_table_init(&processes_map);
   yieldlock_init(&processes_map_lock);
@@ -76,9 +129,18 @@ void init_scheduler() {
   // Create process 0: kernel main process (cpu idle)
   main_process = create_process("kernel_main_process", /* is_kernel_process = */true);
   tcb_t* main_thread = create_new_kernel_thread(main_process, "kernel main", kernel_main_thread);
+  main_thread->priority = SCHEDULE_IDLE_PRIORITY;
+  main_thread->effective_priority = SCHEDULE_IDLE_PRIORITY;
   main_thread_node = (thread_node_t*)kmalloc(sizeof(thread_node_t));
   main_thread_node->ptr = main_thread;
-  crt_thread_node = main_thread_node;
+  main_thread->on_cpu = true;
+
+  // It is the idle thread of bootstrap processor.
+  cpu_t* cpu = get_cpu();
+  cpu->idle_thread_node = main_thread_node;
+  cpu->crt_thread_node = main_thread_node;
+
+  register_interrupt_handler(IPI_RESCHEDULE_INT_NUM, reschedule_callback);
 
   // Kick off!
   asm volatile (
@@ -91,6 +153,7 @@ void init_scheduler() {
 
 // Kernel main thread:
 //  - Create the resource clean thread;
+//  - Start other cpus;
 //  - Create process 1 (init process) which will later become the first user process;
 //  - Becomes the cpu idle thread;
 static void kernel_main_thread() {
@@ -100,19 +163,20 @@ static void kernel_main_thread() {
   kernel_clean_node->ptr = clean_thread;
   add_thread_node_to_schedule(kernel_clean_node);
 
+  // Enable interrupt: multi tasks start running after this line.
+  multi_task_enabled = true;
+  enable_interrupt();
+
+  // Other cpus are started while there is nothing else to run, as it needs timer ticks.
+  start_other_cpus();
+
   // Create process 1: init process.
   pcb_t* init_process = create_process(nullptr, /* is_kernel_process = */true);
   tcb_t* init_thread = create_new_kernel_thread(init_process, "kernel init", kernel_init_thread);
   add_thread_to_schedule(init_thread);
 
-  // Enable interrupt: multi tasks start running after this line.
-  multi_task_enabled = true;
-  enable_interrupt();
-
   // Enter cpu idle.
-  while (true) {
-    cpu_idle();
-  }
+  cpu_idle_thread();
 }
 
 static void kernel_clean_thread() {
@@ -132,6 +196,10 @@ static void kernel_clean_thread() {
         linked_list_node_t* head = dead_tasks_receiver.head;
         linked_list_remove(&dead_tasks_receiver, head);
         tcb_t* thread = (tcb_t*)head->ptr;
+        // Its cpu may not have switched away from its stack yet.
+        while (thread->on_cpu) {
+          schedule_thread_yield();
+        }
         //monitor_printf("clean thread %d\n", thread->id);
         destroy_thread(thread);
         kfree(head);
@@ -172,16 +240,70 @@ static void kernel_init_thread() {
 }
 
 
+// *************************************************************************************************
+// Interrupts are off until it halts, so that no wakeup is missed once timer is stopped.
+static void cpu_idle_thread() {
+  while (true) {
+    disable_interrupt();
+    timer_idle_enter();
+    cpu_safe_halt();
+  }
+}
+
+void schedule_init_cpu(cpu_t* cpu) {
+  char name[32];
+  sprintf(name, "cpu %u idle", cpu->id);
+  tcb_t* idle_thread = create_new_kernel_thread(main_process, name, cpu_idle_thread);
+  idle_thread->priority = SCHEDULE_IDLE_PRIORITY;
+  idle_thread->effective_priority = SCHEDULE_IDLE_PRIORITY;
+  thread_node_t* idle_thread_node = (thread_node_t*)kmalloc(sizeof(thread_node_t));
+  idle_thread_node->ptr = idle_thread;
+
+  cpu->idle_thread_node = idle_thread_node;
+  cpu->crt_thread_node = idle_thread_node;
+}
+
+void schedule_start_cpu() {
+  tcb_t* idle_thread = get_crt_thread();
+  idle_thread->status = TASK_RUNNING;
+  idle_thread->on_cpu = true;
+  update_tss_esp(idle_thread->kernel_stack + KERNEL_STACK_SIZE);
+
+  asm volatile (
+   "movl %0, %%esp; \
+    jmp resume_thread": : "g" (idle_thread->kernel_esp) : "memory");
+
+  // Never should reach here!
+  PANIC();
+}
+
+static void reschedule_callback(isr_params_t regs) {
+  cpu_t* cpu = get_cpu();
+  if (is_idle(cpu)) {
+    // Woken up to take work of a busy cpu.
+    balance_load(cpu);
+  }
+  get_crt_thread()->need_reschedule = true;
+}
+
 // *************************************************************************************************
 tcb_t* get_crt_thread() {
-  if (crt_thread_node == nullptr) {
+  thread_node_t* thread_node = get_crt_thread_node();
+  if (thread_node == nullptr) {
     return nullptr;
   }
-  return (tcb_t*)(crt_thread_node->ptr);
+  return (tcb_t*)(thread_node->ptr);
 }
 
 thread_node_t* get_crt_thread_node() {
-  return crt_thread_node;
+  // Current thread must not be moved to another cpu in between.
+  bool interrupt_on = (get_eflags() & EFLAGS_IF_1) != 0;
+  disable_interrupt();
+  thread_node_t* thread_node = get_cpu()->crt_thread_node;
+  if (interrupt_on) {
+    enable_interrupt();
+  }
+  return thread_node;
 }
 
 pcb_t* get_crt_process() {
@@ -193,10 +315,17 @@ pcb_t* get_crt_process() {
 }
 
 bool is_kernel_main_thread() {
-  return crt_thread_node == main_thread_node;
+  return get_crt_thread_node() == main_thread_node;
 }
 
 void add_new_process(pcb_t* process) {
+  for (uint32 i = 0; i < MAX_CPUS; i++) {
+    fair_entity_t* entity = &process->fair_entities[i];
+    rb_tree_init(&entity->ready_threads, compare_thread_vruntime);
+    entity->vruntime = run_queues[i].fair_min_vruntime;
+    entity->min_vruntime = 0;
+  }
+
   yieldlock_lock(&processes_map_lock);
   hash_table_put(&processes_map, process->id, process);
   yieldlock_unlock(&processes_map_lock);
@@ -223,28 +352,393 @@ static void process_switch(pcb_t* process) {
   reload_page_directory(&process->page_dir);
 }
 
-// Note: interrupt must be DISABLED before entering this function.
-static void do_context_switch() {
-  //monitor_printf("ready_tasks num = %d\n", ready_tasks.size);
-  tcb_t* old_thread = get_crt_thread();
+// ************************** run queues **************************************
+// Note: run queue lock must be held for all operations on it.
+static void lock_run_queue(run_queue_t* rq) {
+  disable_interrupt();
+  while (atomic_exchange(&rq->lock_hold, LOCKED_YES) != LOCKED_NO) {
+    // Serve TLB shootdown which the holder may be waiting for.
+    tlb_shootdown_poll();
+    asm volatile("pause");
+  }
+}
+
+static bool trylock_run_queue(run_queue_t* rq) {
+  return atomic_exchange(&rq->lock_hold, LOCKED_YES) == LOCKED_NO;
+}
+
+// Local interrupts are left off.
+static void unlock_run_queue(run_queue_t* rq) {
+  rq->lock_hold = LOCKED_NO;
+}
+
+// Lock two run queues always in the same order, so that two cpus don't deadlock.
+static void lock_run_queues(run_queue_t* rq1, run_queue_t* rq2) {
+  if (rq1->id < rq2->id) {
+    lock_run_queue(rq1);
+    lock_run_queue(rq2);
+  } else {
+    lock_run_queue(rq2);
+    lock_run_queue(rq1);
+  }
+}
+
+static run_queue_t* cpu_run_queue(cpu_t* cpu) {
+  return &run_queues[cpu->id];
+}
+
+static bool is_idle(cpu_t* cpu) {
+  return cpu->crt_thread_node == cpu->idle_thread_node;
+}
+
+// Threads ready or running on a cpu. It is read without lock, for balancing decisions only.
+static uint32 cpu_load(cpu_t* cpu) {
+  return cpu_run_queue(cpu)->ready_num + (is_idle(cpu) ? 0 : 1);
+}
+
+static uint32 bit_scan_forward(uint32 value) {
+  uint32 index;
+  asm volatile ("bsf %1, %0" : "=r" (index) : "rm" (value));
+  return index;
+}
+
+// vruntime wraps around, so compare by difference.
+static bool vruntime_before(uint32 vruntime1, uint32 vruntime2) {
+  return (int32)(vruntime1 - vruntime2) < 0;
+}
+
+static uint32 vruntime_max(uint32 vruntime1, uint32 vruntime2) {
+  return vruntime_before(vruntime1, vruntime2) ? vruntime2 : vruntime1;
+}
+
+static int32 compare_vruntime(uint32 vruntime1, uint32 vruntime2) {
+  if (vruntime1 == vruntime2) {
+    return 0;
+  }
+  return vruntime_before(vruntime1, vruntime2) ? -1 : 1;
+}
+
+static int32 compare_entity_vruntime(rb_node_t* node1, rb_node_t* node2) {
+  return compare_vruntime(rb_entry(node1, fair_entity_t, rb_node)->vruntime,
+                          rb_entry(node2, fair_entity_t, rb_node)->vruntime);
+}
+
+static int32 compare_thread_vruntime(rb_node_t* node1, rb_node_t* node2) {
+  return compare_vruntime(rb_entry(node1, tcb_t, sched_rb_node)->vruntime,
+                          rb_entry(node2, tcb_t, sched_rb_node)->vruntime);
+}
+
+// Threads of user processes are scheduled fairly, and kernel threads by priority - ahead of
+// all fair ones.
+static bool is_fair_thread(tcb_t* thread) {
+  return thread->process != nullptr && !thread->process->is_kernel_process;
+}
+
+static fair_entity_t* fair_entity(run_queue_t* rq, pcb_t* process) {
+  return &process->fair_entities[rq->id];
+}
+
+// Fair threads are in a two level tree: processes by their vruntime, and threads of each
+// process by theirs. So CPU is shared between processes first, whatever their threads number.
+// A thread waking up from blocking is placed a bit ahead of others, for low latency, but it
+// can not save up CPU time while sleeping.
+static void enqueue_fair_thread(run_queue_t* rq, tcb_t* thread, bool waking) {
+  fair_entity_t* entity = fair_entity(rq, thread->process);
+  uint32 credit = waking ? SCHEDULE_SLEEPER_CREDIT : 0;
+
+  thread->vruntime = vruntime_max(thread->vruntime, entity->min_vruntime - credit);
+  if (entity->ready_threads.size == 0) {
+    entity->vruntime = vruntime_max(entity->vruntime, rq->fair_min_vruntime - credit);
+    rb_tree_insert(&rq->fair_processes, &entity->rb_node);
+  }
+  rb_tree_insert(&entity->ready_threads, &thread->sched_rb_node);
+}
+
+static tcb_t* first_fair_thread(run_queue_t* rq) {
+  fair_entity_t* entity = rb_entry(rb_tree_first(&rq->fair_processes), fair_entity_t, rb_node);
+  return rb_entry(rb_tree_first(&entity->ready_threads), tcb_t, sched_rb_node);
+}
+
+static void remove_fair_thread(run_queue_t* rq, tcb_t* thread) {
+  fair_entity_t* entity = fair_entity(rq, thread->process);
+  rb_tree_remove(&entity->ready_threads, &thread->sched_rb_node);
+  if (entity->ready_threads.size == 0) {
+    rb_tree_remove(&rq->fair_processes, &entity->rb_node);
+  }
+}
+
+static tcb_t* dequeue_fair_thread(run_queue_t* rq) {
+  tcb_t* thread = first_fair_thread(rq);
+  fair_entity_t* entity = fair_entity(rq, thread->process);
+
+  remove_fair_thread(rq, thread);
+  rq->fair_min_vruntime = vruntime_max(rq->fair_min_vruntime, entity->vruntime);
+  entity->min_vruntime = vruntime_max(entity->min_vruntime, thread->vruntime);
+  return thread;
+}
+
+// Charge a tick of CPU time to running fair thread and its process.
+static void charge_fair_thread(run_queue_t* rq, tcb_t* thread) {
+  fair_entity_t* entity = fair_entity(rq, thread->process);
+  thread->vruntime +=
+      SCHEDULE_VRUNTIME_PER_TICK * SCHEDULE_NICE_0_WEIGHT / priority_weights[thread->priority];
+
+  // Process key changes - it must be re-inserted if it is in tree.
+  bool queued = (entity->ready_threads.size > 0);
+  if (queued) {
+    rb_tree_remove(&rq->fair_processes, &entity->rb_node);
+  }
+  entity->vruntime += SCHEDULE_VRUNTIME_PER_TICK;
+  if (queued) {
+    rb_tree_insert(&rq->fair_processes, &entity->rb_node);
+  }
+}
+
+static void enqueue_ready_thread(
+    run_queue_t* rq, thread_node_t* thread_node, bool to_head, bool waking) {
+  tcb_t* thread = (tcb_t*)thread_node->ptr;
+  thread->sched_node = thread_node;
+  thread->sched_fair = is_fair_thread(thread);
+  thread->cpu = rq->id;
+  rq->ready_num++;
+  if (thread->sched_fair) {
+    enqueue_fair_thread(rq, thread, waking || to_head);
+    return;
+  }
+
+  uint32 level = thread->effective_priority;
+  if (to_head) {
+    linked_list_insert_to_head(&rq->ready_queues[level], thread_node);
+  } else {
+    linked_list_append(&rq->ready_queues[level], thread_node);
+  }
+  rq->ready_levels |= (1 << level);
+}
+
+static void remove_ready_thread(run_queue_t* rq, tcb_t* thread) {
+  rq->ready_num--;
+  if (thread->sched_fair) {
+    remove_fair_thread(rq, thread);
+    return;
+  }
+
+  uint32 level = thread->effective_priority;
+  linked_list_t* queue = &rq->ready_queues[level];
+  linked_list_remove(queue, thread->sched_node);
+  if (queue->size == 0) {
+    rq->ready_levels &= ~(1 << level);
+  }
+}
+
+static bool has_ready_thread(run_queue_t* rq) {
+  return rq->ready_num > 0;
+}
+
+// Thread to run next: the head of highest priority non-empty queue, or else the fair thread
+// with the least vruntime, or nullptr.
+static tcb_t* peek_ready_thread(run_queue_t* rq) {
+  if (rq->ready_levels != 0) {
+    return (tcb_t*)rq->ready_queues[bit_scan_forward(rq->ready_levels)].head->ptr;
+  }
+  if (rq->fair_processes.size > 0) {
+    return first_fair_thread(rq);
+  }
+  return nullptr;
+}
+
+// Pick the next thread, or else idle thread of this cpu. Idle threads are never queued.
+static thread_node_t* dequeue_ready_thread(run_queue_t* rq, cpu_t* cpu) {
+  tcb_t* thread = peek_ready_thread(rq);
+  if (thread == nullptr) {
+    return cpu->idle_thread_node;
+  }
+  if (thread->sched_fair) {
+    rq->ready_num--;
+    dequeue_fair_thread(rq);
+  } else {
+    remove_ready_thread(rq, thread);
+  }
+  return thread->sched_node;
+}
+
+// Move a ready thread to another run queue, both locked. Its vruntime is carried over relative
+// to the progress of its process on each cpu.
+static void migrate_thread(run_queue_t* src, run_queue_t* dst, tcb_t* thread) {
+  remove_ready_thread(src, thread);
+  if (thread->sched_fair) {
+    thread->vruntime = thread->vruntime - fair_entity(src, thread->process)->min_vruntime
+                                        + fair_entity(dst, thread->process)->min_vruntime;
+  }
+  enqueue_ready_thread(dst, thread->sched_node, false, false);
+}
+
+// Take the next thread of a run queue, both locked. A thread still on its cpu - which woke up
+// before it was switched out - can not move.
+static bool pull_thread(run_queue_t* src, run_queue_t* dst) {
+  tcb_t* thread = peek_ready_thread(src);
+  if (thread == nullptr || thread->on_cpu) {
+    return false;
+  }
+  migrate_thread(src, dst, thread);
+  return true;
+}
+
+// The online cpu with most threads, other than the given one.
+static cpu_t* find_busiest_cpu(cpu_t* self) {
+  cpu_t* busiest = nullptr;
+  for (uint32 i = 0; i < get_cpus_online(); i++) {
+    cpu_t* cpu = get_cpu_by_id(i);
+    if (cpu != self && (busiest == nullptr || cpu_load(cpu) > cpu_load(busiest))) {
+      busiest = cpu;
+    }
+  }
+  return busiest;
+}
+
+static cpu_t* find_idlest_cpu() {
+  cpu_t* idlest = get_cpu_by_id(0);
+  for (uint32 i = 1; i < get_cpus_online(); i++) {
+    cpu_t* cpu = get_cpu_by_id(i);
+    if (cpu_load(cpu) < cpu_load(idlest)) {
+      idlest = cpu;
+    }
+  }
+  return idlest;
+}
+
+// A cpu about to go idle steals a waiting thread from the busiest one. Its own run queue is
+// locked, so the other one is only tried, not to deadlock.
+static void steal_thread(run_queue_t* rq, cpu_t* cpu) {
+  cpu_t* busiest = find_busiest_cpu(cpu);
+  if (busiest == nullptr) {
+    return;
+  }
+  run_queue_t* src = cpu_run_queue(busiest);
+  if (src->ready_num == 0 || !trylock_run_queue(src)) {
+    return;
+  }
+  if (pull_thread(src, rq)) {
+    rq->stats.steals++;
+  }
+  unlock_run_queue(src);
+}
+
+// Even out load with the busiest cpu, by pulling half the difference. Run on each timer tick
+// of an idle cpu, and every SCHEDULE_BALANCE_TICKS otherwise.
+static void balance_load(cpu_t* cpu) {
+  cpu_t* busiest = find_busiest_cpu(cpu);
+  if (busiest == nullptr || cpu_load(busiest) < cpu_load(cpu) + SCHEDULE_IMBALANCE) {
+    return;
+  }
 
-  thread_node_t* head = ready_tasks.head;
-  linked_list_remove(&ready_tasks, head);
+  run_queue_t* rq = cpu_run_queue(cpu);
+  run_queue_t* src = cpu_run_queue(busiest);
+  lock_run_queues(rq, src);
+  uint32 pulled = 0;
+  while (cpu_load(busiest) >= cpu_load(cpu) + SCHEDULE_IMBALANCE && pull_thread(src, rq)) {
+    pulled++;
+  }
+  if (pulled > 0) {
+    rq->stats.balance_migrations += pulled;
+    get_crt_thread()->need_reschedule = true;
+  }
+  unlock_run_queue(src);
+  unlock_run_queue(rq);
+}
+
+// Idle cpus may have their timers stopped, and not balance on their own. A busy one with
+// waiting threads wakes one of them up.
+static void kick_idle_cpu(cpu_t* self) {
+  for (uint32 i = 0; i < get_cpus_online(); i++) {
+    cpu_t* cpu = get_cpu_by_id(i);
+    if (cpu != self && cpu->tickless) {
+      lapic_send_ipi(cpu->apic_id, IPI_RESCHEDULE_INT_NUM);
+      return;
+    }
+  }
+}
+
+bool schedule_cpu_is_idle(cpu_t* cpu) {
+  return is_idle(cpu) && cpu_run_queue(cpu)->ready_num == 0;
+}
+
+bool schedule_all_cpus_idle() {
+  for (uint32 i = 0; i < get_cpus_online(); i++) {
+    if (!schedule_cpu_is_idle(get_cpu_by_id(i))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// A thread goes back to the cpu it last ran on, where its cache may be still warm - unless that
+// cpu is loaded by SCHEDULE_IMBALANCE or more than the least loaded one.
+static cpu_t* select_cpu(tcb_t* thread) {
+  cpu_t* self = get_cpu();
+  if (thread == (tcb_t*)self->crt_thread_node->ptr) {
+    // Woken up before it is switched out - it must stay here.
+    return self;
+  }
+
+  cpu_t* target = (thread->cpu < get_cpus_online()) ? get_cpu_by_id(thread->cpu) : self;
+  cpu_t* idlest = find_idlest_cpu();
+  if (cpu_load(target) >= cpu_load(idlest) + SCHEDULE_IMBALANCE) {
+    return idlest;
+  }
+  return target;
+}
+
+// A thread waking up from blocking is likely interactive, and gets ahead of CPU-bound ones.
+static void boost_priority(tcb_t* thread) {
+  int32 floor = (int32)thread->priority - SCHEDULE_BOOST_MAX;
+  int32 priority = (int32)thread->effective_priority - SCHEDULE_WAKE_BOOST;
+  priority = (priority > floor) ? priority : floor;
+  thread->effective_priority = (priority > 0) ? priority : 0;
+}
+
+// Each time slice used up lowers the priority by a level.
+static void decay_priority(tcb_t* thread) {
+  uint32 ceiling = min(thread->priority + SCHEDULE_PENALTY_MAX, SCHEDULE_IDLE_PRIORITY - 1);
+  if (thread->effective_priority < ceiling) {
+    thread->effective_priority++;
+  }
+}
+
+// Note: run queue of this cpu must be locked before entering this function. It is released by
+// the next thread, once this one is off its stack.
+static void do_context_switch() {
+  cpu_t* cpu = get_cpu();
+  run_queue_t* rq = cpu_run_queue(cpu);
+  thread_node_t* crt_thread_node = cpu->crt_thread_node;
+  tcb_t* old_thread = (tcb_t*)crt_thread_node->ptr;
+
+  // Pick next thread before re-queuing current one, so that a yielding thread always gives
+  // way to another. Look around other cpus before going idle.
+  if (!has_ready_thread(rq)) {
+    steal_thread(rq, cpu);
+  }
+  thread_node_t* head = dequeue_ready_thread(rq, cpu);
   tcb_t* next_thread = (tcb_t*)head->ptr;
 
   // Switch out current running thread.
-  if (old_thread->status == TASK_RUNNING && crt_thread_node != main_thread_node) {
+  if (old_thread->ticks >= SCHEDULE_TIME_SLICE_TICKS) {
+    decay_priority(old_thread);
+  }
+  if (old_thread->status == TASK_RUNNING && crt_thread_node != cpu->idle_thread_node) {
     old_thread->status = TASK_READY;
-    linked_list_append(&ready_tasks, crt_thread_node);
+    enqueue_ready_thread(rq, crt_thread_node, false, false);
   }
   old_thread->ticks = 0;
   old_thread->need_reschedule = false;
 
   // Switch in next thread.
   next_thread->status = TASK_RUNNING;
-  crt_thread_node = head;
-  if (head == main_thread_node) {
-    main_thread_in_ready_queue = 0;
+  next_thread->on_cpu = true;
+  next_thread->cpu = cpu->id;
+  cpu->crt_thread_node = head;
+  cpu->prev_thread = old_thread;
+  if (next_thread != old_thread) {
+    rq->stats.switches++;
   }
 
   // Setup env for next thread (and maybe a different process)
@@ -257,24 +751,110 @@ static void do_context_switch() {
   context_switch(old_thread, next_thread);
 }
 
+void finish_context_switch() {
+  cpu_t* cpu = get_cpu();
+  tcb_t* prev_thread = cpu->prev_thread;
+  if (prev_thread == nullptr) {
+    // First thread to run on this cpu.
+    return;
+  }
+  cpu->prev_thread = nullptr;
+  if (prev_thread != (tcb_t*)cpu->crt_thread_node->ptr) {
+    prev_thread->on_cpu = false;
+  }
+  unlock_run_queue(cpu_run_queue(cpu));
+}
+
+// Whether a ready thread should run instead of current one of a cpu.
+static bool should_preempt(run_queue_t* rq, cpu_t* cpu, bool slice_used_up) {
+  if (is_idle(cpu)) {
+    return true;
+  }
+
+  // Lower priority threads never preempt current one, nor do fair threads.
+  tcb_t* crt_thread = (tcb_t*)cpu->crt_thread_node->ptr;
+  uint32 levels = rq->ready_levels;
+  if (!crt_thread->sched_fair) {
+    return levels != 0 && bit_scan_forward(levels) <= crt_thread->effective_priority;
+  }
+  if (levels != 0) {
+    return true;
+  }
+  if (rq->fair_processes.size == 0) {
+    return false;
+  }
+
+  // Before its slice is used up, current thread is preempted only by one behind it by some
+  // margin, so that they don't ping-pong.
+  uint32 granularity = slice_used_up ? 0 : SCHEDULE_WAKEUP_GRANULARITY;
+  fair_entity_t* crt_entity = fair_entity(rq, crt_thread->process);
+  fair_entity_t* entity = rb_entry(rb_tree_first(&rq->fair_processes), fair_entity_t, rb_node);
+  if (entity != crt_entity) {
+    return vruntime_before(entity->vruntime + granularity, crt_entity->vruntime);
+  }
+  tcb_t* thread = rb_entry(rb_tree_first(&entity->ready_threads), tcb_t, sched_rb_node);
+  return vruntime_before(thread->vruntime + granularity, crt_thread->vruntime);
+}
+
+void schedule_timer_tick() {
+  cpu_t* cpu = get_cpu();
+  run_queue_t* rq = cpu_run_queue(cpu);
+  lock_run_queue(rq);
+  tcb_t* crt_thread = get_crt_thread();
+  crt_thread->ticks++;
+  if (crt_thread->sched_fair) {
+    charge_fair_thread(rq, crt_thread);
+  }
+  if (crt_thread->ticks >= SCHEDULE_TIME_SLICE_TICKS) {
+    crt_thread->need_reschedule = true;
+  }
+  bool idle = is_idle(cpu);
+  if (idle) {
+    rq->stats.idle_ticks++;
+  } else {
+    rq->stats.busy_ticks++;
+  }
+  uint32 ticks = rq->stats.idle_ticks + rq->stats.busy_ticks;
+  bool waiting = has_ready_thread(rq);
+  unlock_run_queue(rq);
+
+  if (idle || ticks % SCHEDULE_BALANCE_TICKS == 0) {
+    balance_load(cpu);
+    if (!idle && waiting) {
+      kick_idle_cpu(cpu);
+    }
+  }
+}
+
 void schedule() {
-  disable_interrupt();
+  cpu_t* cpu = get_cpu();
+  run_queue_t* rq = cpu_run_queue(cpu);
+  lock_run_queue(rq);
 
   tcb_t* crt_thread = get_crt_thread();
   if (crt_thread->preempt_count > 0) {
     // preemption is disabled.
+    unlock_run_queue(rq);
     return;
   }
   bool need_context_switch = false;
-  if (ready_tasks.size > 0) {
-    need_context_switch = crt_thread->need_reschedule;
+  if (has_ready_thread(rq) && crt_thread->need_reschedule) {
+    // If current thread goes on, it is with a new time slice, and a decayed priority.
+    bool slice_used_up = (crt_thread->ticks >= SCHEDULE_TIME_SLICE_TICKS);
+    if (slice_used_up) {
+      decay_priority(crt_thread);
+      crt_thread->ticks = 0;
+    }
+    need_context_switch = should_preempt(rq, cpu, slice_used_up);
+    if (!need_context_switch) {
+      crt_thread->need_reschedule = false;
+    }
   }
 
   if (need_context_switch) {
-    //monitor_printf("context_switch yes, %d ready tasks\n", ready_tasks.size);
     do_context_switch();
   } else {
-    //monitor_println("context_switch no");
+    unlock_run_queue(rq);
     enable_interrupt();
   }
 }
@@ -285,40 +865,91 @@ void add_thread_to_schedule(tcb_t* thread) {
   add_thread_node_to_schedule(node);
 }
 
-void add_thread_node_to_schedule(thread_node_t* thread_node) {
-  disable_interrupt();
+// A thread marked blocked may be still on its way out of its cpu - it must not be picked by
+// another cpu until then.
+static void wait_thread_off_cpu(tcb_t* thread) {
+  if (thread == get_crt_thread()) {
+    return;
+  }
+  while (thread->on_cpu) {
+    tlb_shootdown_poll();
+    asm volatile("pause");
+  }
+}
+
+static void wake_up_thread(thread_node_t* thread_node, bool to_head) {
   tcb_t* thread = (tcb_t*)thread_node->ptr;
+  wait_thread_off_cpu(thread);
+
+  bool interrupt_on = (get_eflags() & EFLAGS_IF_1) != 0;
+  disable_interrupt();
+  cpu_t* cpu = select_cpu(thread);
+  run_queue_t* rq = cpu_run_queue(cpu);
+  lock_run_queue(rq);
+  bool waking = (thread->status == TASK_WAITING);
+  if (waking) {
+    boost_priority(thread);
+  }
   if (thread->status != TASK_DEAD) {
     thread->status = TASK_READY;
   }
-  linked_list_append(&ready_tasks, thread_node);
-  enable_interrupt();
+  if (thread->cpu != cpu->id) {
+    rq->stats.wakeup_migrations++;
+  }
+  enqueue_ready_thread(rq, thread_node, to_head, waking);
+  bool preempt = should_preempt(rq, cpu, false);
+  bool kick = false;
+  if (cpu == get_cpu()) {
+    // E.g. a sleeper woken up by timer on an idle cpu runs right after the interrupt, rather
+    // than once idle thread has used up its time slice.
+    if (preempt && cpu->crt_thread_node != nullptr) {
+      ((tcb_t*)cpu->crt_thread_node->ptr)->need_reschedule = true;
+    }
+  } else {
+    kick = preempt;
+  }
+  unlock_run_queue(rq);
+
+  // Let the other cpu check if it should switch.
+  if (kick) {
+    lapic_send_ipi(cpu->apic_id, IPI_RESCHEDULE_INT_NUM);
+  }
+  if (interrupt_on) {
+    enable_interrupt();
+  }
+}
+
+void add_thread_node_to_schedule(thread_node_t* thread_node) {
+  wake_up_thread(thread_node, false);
 }
 
 void add_thread_node_to_schedule_head(thread_node_t* thread_node) {
-  disable_interrupt();
-  tcb_t* thread = (tcb_t*)thread_node->ptr;
-  thread->status = TASK_READY;
-  linked_list_insert_to_head(&ready_tasks, thread_node);
-  enable_interrupt();
+  wake_up_thread(thread_node, true);
+}
+
+void get_schedule_stats(uint32 cpu_id, schedule_stats_t* stats) {
+  *stats = run_queues[cpu_id].stats;
 }
 
+void print_schedule_stats() {
+  for (uint32 i = 0; i < get_cpus_online(); i++) {
+    schedule_stats_t* stats = &run_queues[i].stats;
+    monitor_printf("cpu %u: switches %u, busy %u, idle %u, steals %u, balanced %u, woken %u\n",
+                   i, stats->switches, stats->busy_ticks, stats->idle_ticks, stats->steals,
+                   stats->balance_migrations, stats->wakeup_migrations);
+  }
+}
 void schedule_thread_yield() {
-  disable_interrupt();
+  lock_run_queue(cpu_run_queue(get_cpu()));
 
   //monitor_printf("thread %d yield\n", get_crt_thread()->id);
 
-  // If no ready task in queue, wake up kernel main (cpu idle) thread.
-  if (ready_tasks.size == 0) {
-    linked_list_append(&ready_tasks, main_thread_node);
-    main_thread_in_ready_queue = 1;
-  }
-
+  // If no ready task in queue, cpu idle thread takes over.
   do_context_switch();
 }
 
 void schedule_mark_thread_block() {
-  tcb_t* thread = (tcb_t*)crt_thread_node->ptr;
+  tcb_t* thread = get_crt_thread();
   thread->status = TASK_WAITING;
 }
 
@@ -334,7 +965,7 @@ void schedule_thread_exit() {
   add_dead_task(thread);
 
   // Mark this thread TASK_dead.
-  disable_interrupt();
+  lock_run_queue(cpu_run_queue(get_cpu()));
   do_context_switch();
 }
 
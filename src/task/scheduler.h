@@ -3,9 +3,66 @@
 
 #include "task/thread.h"
 
+struct cpu;
+
+// Ready threads are queued by priority level, 0 being the highest, and the next thread to run
+// is the head of the highest non-empty level. A thread runs at its base priority raised by
+// SCHEDULE_WAKE_BOOST each time it wakes up from blocking, and lowered by a level each time it
+// uses up a time slice - down to SCHEDULE_PENALTY_MAX levels below base for CPU hogs.
+#define SCHEDULE_PRIORITY_LEVELS   32
+#define SCHEDULE_IDLE_PRIORITY     (SCHEDULE_PRIORITY_LEVELS - 1)
+#define SCHEDULE_TIME_SLICE_TICKS  10
+#define SCHEDULE_WAKE_BOOST        3
+#define SCHEDULE_BOOST_MAX         6
+#define SCHEDULE_PENALTY_MAX       6
+
+// Fair scheduling of user threads: a tick of CPU time adds SCHEDULE_VRUNTIME_PER_TICK to the
+// vruntime of running process, and SCHEDULE_VRUNTIME_PER_TICK * SCHEDULE_NICE_0_WEIGHT / weight
+// to that of the thread, weight being given by its priority. Least vruntime runs next.
+#define SCHEDULE_NICE_0_WEIGHT       1024
+#define SCHEDULE_VRUNTIME_PER_TICK   1024
+#define SCHEDULE_SLEEPER_CREDIT      (SCHEDULE_TIME_SLICE_TICKS * SCHEDULE_VRUNTIME_PER_TICK / 2)
+#define SCHEDULE_WAKEUP_GRANULARITY  (2 * SCHEDULE_VRUNTIME_PER_TICK)
+
+// Each cpu has its own run queue. A waking thread goes back to the cpu it last ran on, unless
+// that one has SCHEDULE_IMBALANCE more threads than the least loaded cpu. A cpu going idle
+// steals a thread from the busiest one, and every SCHEDULE_BALANCE_TICKS each cpu pulls threads
+// from the busiest one, if they are imbalanced.
+#define SCHEDULE_IMBALANCE      2
+#define SCHEDULE_BALANCE_TICKS  10
+
+// Scheduling counters of a cpu.
+struct schedule_stats {
+  // context switches to a different thread
+  uint32 switches;
+  // timer ticks running threads, and idle
+  uint32 busy_ticks;
+  uint32 idle_ticks;
+  // threads moved here: stolen when going idle, pulled by periodic balancing, and woken up
+  // here instead of on their last cpu
+  uint32 steals;
+  uint32 balance_migrations;
+  uint32 wakeup_migrations;
+};
+typedef struct schedule_stats schedule_stats_t;
+
 // Init scheduler.
 void init_scheduler();
 
+// Create idle thread of a cpu, before it is started.
+void schedule_init_cpu(struct cpu* cpu);
+
+// Run idle thread on an application processor, and take threads from ready queues from then on.
+// Never returns.
+void schedule_start_cpu();
+
+// Called by each thread when it is switched in, to finish the switch on its behalf.
+void finish_context_switch();
+
+// No thread is running or ready on a cpu, or on any cpu.
+bool schedule_cpu_is_idle(struct cpu* cpu);
+bool schedule_all_cpus_idle();
+
 // Get current running thread.
 tcb_t* get_crt_thread();
 thread_node_t* get_crt_thread_node();
@@ -22,6 +79,12 @@ void add_thread_node_to_schedule_head(thread_node_t* thread_node);
 // Call scheduler.
 void schedule();
 
+// Account a timer tick to current thread, and balance load between cpus.
+void schedule_timer_tick();
+
+void get_schedule_stats(uint32 cpu_id, schedule_stats_t* stats);
+void print_schedule_stats();
+
 // Yield thread - give up cpu and move current thread to ready queue tail.
 void schedule_thread_yield();
 
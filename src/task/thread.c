@@ -45,7 +45,9 @@ tcb_t* init_thread(tcb_t* thread, char* name, thread_func function, uint32 prior
 
   thread->status = TASK_READY;
   thread->ticks = 0;
+  thread->on_cpu = false;
   thread->priority = priority;
+  thread->effective_priority = priority;
   thread->user_stack_index = -1;
 
   // Init thread stack.
@@ -179,6 +181,7 @@ tcb_t* fork_crt_thread() {
   strcpy(thread->name, buf);
 
   thread->ticks = 0;
+  thread->on_cpu = false;
 
   // allocate kernel stack
   uint32 kernel_stack = (uint32)kmalloc_aligned(KERNEL_STACK_SIZE);
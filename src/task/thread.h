@@ -5,6 +5,7 @@
 #include "interrupt/interrupt.h"
 #include "task/process.h"
 #include "utils/linked_list.h"
+#include "utils/rb_tree.h"
 
 #define KERNEL_MAIN_STACK_TOP    0xF0000000
 #define THREAD_STACK_MAGIC       0x32602021
@@ -39,8 +40,18 @@ struct task_struct {
   uint32 kernel_stack;
   uint32 id;
   char name[32];
+  // base priority level, and the one it is scheduled at now
   uint8 priority;
+  uint8 effective_priority;
   enum task_status status;
+  // fair scheduling: weighted CPU time, and position in its process's ready tree
+  bool sched_fair;
+  uint32 vruntime;
+  rb_node_t sched_rb_node;
+  // node it was last queued with
+  thread_node_t* sched_node;
+  // cpu it is queued on, or last ran on
+  uint32 cpu;
   // timer ticks this thread has been running for.
   uint32 ticks;
   // pointer to its process
@@ -50,6 +61,8 @@ struct task_struct {
   int32 user_stack_index;
   // need reschedule flag
   bool need_reschedule;
+  // running on a cpu, or still being switched out of one
+  volatile bool on_cpu;
   // preempt (disable) count
   uint32 preempt_count;
 };
@@ -0,0 +1,356 @@
+#include "monitor/monitor.h"
+#include "utils/rb_tree.h"
+#include "utils/debug.h"
+
+void rb_tree_init(rb_tree_t* this, rb_comparator_t comparator) {
+  this->root = nullptr;
+  this->size = 0;
+  this->comparator = comparator;
+}
+
+static bool is_red(rb_node_t* node) {
+  return node != nullptr && node->color == RB_RED;
+}
+
+static bool is_black(rb_node_t* node) {
+  return node == nullptr || node->color == RB_BLACK;
+}
+
+// Replace old_node with new_node in old_node's parent.
+static void replace_child(rb_tree_t* this, rb_node_t* old_node, rb_node_t* new_node) {
+  rb_node_t* parent = old_node->parent;
+  if (parent == nullptr) {
+    this->root = new_node;
+  } else if (parent->left == old_node) {
+    parent->left = new_node;
+  } else {
+    parent->right = new_node;
+  }
+  if (new_node != nullptr) {
+    new_node->parent = parent;
+  }
+}
+
+/*
+ *     x              y
+ *    / \            / \
+ *   a   y    =>    x   c
+ *      / \        / \
+ *     b   c      a   b
+ */
+static void rotate_left(rb_tree_t* this, rb_node_t* x) {
+  rb_node_t* y = x->right;
+  x->right = y->left;
+  if (y->left != nullptr) {
+    y->left->parent = x;
+  }
+  replace_child(this, x, y);
+  y->left = x;
+  x->parent = y;
+}
+
+static void rotate_right(rb_tree_t* this, rb_node_t* x) {
+  rb_node_t* y = x->left;
+  x->left = y->right;
+  if (y->right != nullptr) {
+    y->right->parent = x;
+  }
+  replace_child(this, x, y);
+  y->right = x;
+  x->parent = y;
+}
+
+void rb_tree_insert(rb_tree_t* this, rb_node_t* node) {
+  // Plain BST insert.
+  rb_node_t* parent = nullptr;
+  rb_node_t** link = &this->root;
+  while (*link != nullptr) {
+    parent = *link;
+    if (this->comparator(node, parent) < 0) {
+      link = &parent->left;
+    } else {
+      link = &parent->right;
+    }
+  }
+  node->parent = parent;
+  node->left = nullptr;
+  node->right = nullptr;
+  node->color = RB_RED;
+  *link = node;
+  this->size++;
+
+  // Fix red-red violation.
+  while (is_red(node->parent)) {
+    parent = node->parent;
+    rb_node_t* grandparent = parent->parent;
+    if (parent == grandparent->left) {
+      rb_node_t* uncle = grandparent->right;
+      if (is_red(uncle)) {
+        parent->color = RB_BLACK;
+        uncle->color = RB_BLACK;
+        grandparent->color = RB_RED;
+        node = grandparent;
+        continue;
+      }
+      if (node == parent->right) {
+        rotate_left(this, parent);
+        node = parent;
+        parent = node->parent;
+      }
+      parent->color = RB_BLACK;
+      grandparent->color = RB_RED;
+      rotate_right(this, grandparent);
+    } else {
+      rb_node_t* uncle = grandparent->left;
+      if (is_red(uncle)) {
+        parent->color = RB_BLACK;
+        uncle->color = RB_BLACK;
+        grandparent->color = RB_RED;
+        node = grandparent;
+        continue;
+      }
+      if (node == parent->left) {
+        rotate_right(this, parent);
+        node = parent;
+        parent = node->parent;
+      }
+      parent->color = RB_BLACK;
+      grandparent->color = RB_RED;
+      rotate_left(this, grandparent);
+    }
+  }
+  this->root->color = RB_BLACK;
+}
+
+static rb_node_t* subtree_min(rb_node_t* node) {
+  while (node->left != nullptr) {
+    node = node->left;
+  }
+  return node;
+}
+
+static rb_node_t* subtree_max(rb_node_t* node) {
+  while (node->right != nullptr) {
+    node = node->right;
+  }
+  return node;
+}
+
+void rb_tree_remove(rb_tree_t* this, rb_node_t* node) {
+  // x is the node which takes the removed position, and it may be null - so we track its parent.
+  rb_node_t* x;
+  rb_node_t* x_parent;
+  uint32 removed_color;
+
+  if (node->left == nullptr || node->right == nullptr) {
+    x = (node->left != nullptr) ? node->left : node->right;
+    x_parent = node->parent;
+    removed_color = node->color;
+    replace_child(this, node, x);
+  } else {
+    // Replace node with its successor, which has no left child.
+    rb_node_t* successor = subtree_min(node->right);
+    removed_color = successor->color;
+    x = successor->right;
+    if (successor->parent == node) {
+      x_parent = successor;
+    } else {
+      x_parent = successor->parent;
+      replace_child(this, successor, x);
+      successor->right = node->right;
+      successor->right->parent = successor;
+    }
+    replace_child(this, node, successor);
+    successor->left = node->left;
+    successor->left->parent = successor;
+    successor->color = node->color;
+  }
+  this->size--;
+
+  node->parent = nullptr;
+  node->left = nullptr;
+  node->right = nullptr;
+
+  if (removed_color == RB_RED) {
+    return;
+  }
+
+  // Fix the missing black on x.
+  while (x != this->root && is_black(x)) {
+    if (x == x_parent->left) {
+      rb_node_t* sibling = x_parent->right;
+      if (is_red(sibling)) {
+        sibling->color = RB_BLACK;
+        x_parent->color = RB_RED;
+        rotate_left(this, x_parent);
+        sibling = x_parent->right;
+      }
+      if (is_black(sibling->left) && is_black(sibling->right)) {
+        sibling->color = RB_RED;
+        x = x_parent;
+        x_parent = x->parent;
+      } else {
+        if (is_black(sibling->right)) {
+          sibling->left->color = RB_BLACK;
+          sibling->color = RB_RED;
+          rotate_right(this, sibling);
+          sibling = x_parent->right;
+        }
+        sibling->color = x_parent->color;
+        x_parent->color = RB_BLACK;
+        sibling->right->color = RB_BLACK;
+        rotate_left(this, x_parent);
+        x = this->root;
+        break;
+      }
+    } else {
+      rb_node_t* sibling = x_parent->left;
+      if (is_red(sibling)) {
+        sibling->color = RB_BLACK;
+        x_parent->color = RB_RED;
+        rotate_right(this, x_parent);
+        sibling = x_parent->left;
+      }
+      if (is_black(sibling->left) && is_black(sibling->right)) {
+        sibling->color = RB_RED;
+        x = x_parent;
+        x_parent = x->parent;
+      } else {
+        if (is_black(sibling->left)) {
+          sibling->right->color = RB_BLACK;
+          sibling->color = RB_RED;
+          rotate_left(this, sibling);
+          sibling = x_parent->left;
+        }
+        sibling->color = x_parent->color;
+        x_parent->color = RB_BLACK;
+        sibling->left->color = RB_BLACK;
+        rotate_right(this, x_parent);
+        x = this->root;
+        break;
+      }
+    }
+  }
+  if (x != nullptr) {
+    x->color = RB_BLACK;
+  }
+}
+
+rb_node_t* rb_tree_first(rb_tree_t* this) {
+  if (this->root == nullptr) {
+    return nullptr;
+  }
+  return subtree_min(this->root);
+}
+
+rb_node_t* rb_tree_last(rb_tree_t* this) {
+  if (this->root == nullptr) {
+    return nullptr;
+  }
+  return subtree_max(this->root);
+}
+
+rb_node_t* rb_tree_next(rb_node_t* node) {
+  if (node->right != nullptr) {
+    return subtree_min(node->right);
+  }
+  while (node->parent != nullptr && node == node->parent->right) {
+    node = node->parent;
+  }
+  return node->parent;
+}
+
+rb_node_t* rb_tree_prev(rb_node_t* node) {
+  if (node->left != nullptr) {
+    return subtree_max(node->left);
+  }
+  while (node->parent != nullptr && node == node->parent->left) {
+    node = node->parent;
+  }
+  return node->parent;
+}
+
+
+// ******************************** unit tests **********************************
+struct rb_test_element {
+  uint32 key;
+  rb_node_t node;
+};
+typedef struct rb_test_element rb_test_element_t;
+
+static int32 rb_test_comparator(rb_node_t* x, rb_node_t* y) {
+  uint32 key1 = rb_entry(x, rb_test_element_t, node)->key;
+  uint32 key2 = rb_entry(y, rb_test_element_t, node)->key;
+  return key1 < key2 ? -1 : (key1 == key2 ? 0 : 1);
+}
+
+// Return black height of the subtree, and verify red-black properties.
+static uint32 rb_test_verify(rb_node_t* node) {
+  if (node == nullptr) {
+    return 1;
+  }
+  if (is_red(node)) {
+    ASSERT(is_black(node->left) && is_black(node->right));
+  }
+  if (node->left != nullptr) {
+    ASSERT(node->left->parent == node);
+  }
+  if (node->right != nullptr) {
+    ASSERT(node->right->parent == node);
+  }
+  uint32 left_height = rb_test_verify(node->left);
+  uint32 right_height = rb_test_verify(node->right);
+  ASSERT(left_height == right_height);
+  return left_height + (is_black(node) ? 1 : 0);
+}
+
+void rb_tree_test() {
+  monitor_print("rb tree test ... ");
+
+  rb_tree_t tree;
+  rb_tree_init(&tree, rb_test_comparator);
+
+  uint32 num = 200;
+  rb_test_element_t elements[num];
+  for (uint32 i = 0; i < num; i++) {
+    // Shuffled keys with duplicates.
+    elements[i].key = (i * 37) % 101;
+    rb_tree_insert(&tree, &elements[i].node);
+    ASSERT(tree.root->color == RB_BLACK);
+    rb_test_verify(tree.root);
+  }
+  ASSERT(tree.size == num);
+
+  // In-order traversal is sorted.
+  uint32 count = 0;
+  uint32 last_key = 0;
+  for (rb_node_t* node = rb_tree_first(&tree); node != nullptr; node = rb_tree_next(node)) {
+    uint32 key = rb_entry(node, rb_test_element_t, node)->key;
+    ASSERT(key >= last_key);
+    last_key = key;
+    count++;
+  }
+  ASSERT(count == num);
+
+  // Remove half of the elements.
+  for (uint32 i = 0; i < num; i += 2) {
+    rb_tree_remove(&tree, &elements[i].node);
+    rb_test_verify(tree.root);
+  }
+  ASSERT(tree.size == num / 2);
+
+  count = 0;
+  for (rb_node_t* node = rb_tree_last(&tree); node != nullptr; node = rb_tree_prev(node)) {
+    count++;
+  }
+  ASSERT(count == num / 2);
+
+  for (uint32 i = 1; i < num; i += 2) {
+    rb_tree_remove(&tree, &elements[i].node);
+    rb_test_verify(tree.root);
+  }
+  ASSERT(tree.size == 0);
+  ASSERT(tree.root == nullptr);
+
+  monitor_print_with_color("OK\n", COLOR_GREEN);
+}
@@ -0,0 +1,51 @@
+#ifndef UTILS_RB_TREE_H
+#define UTILS_RB_TREE_H
+
+#include "common/common.h"
+
+#define RB_RED    0
+#define RB_BLACK  1
+
+// Intrusive red-black tree: rb_node_t is embedded in the element struct, so insert and remove
+// never allocate memory. This makes it usable inside memory allocators and the scheduler.
+struct rb_node {
+  struct rb_node* parent;
+  struct rb_node* left;
+  struct rb_node* right;
+  uint32 color;
+};
+typedef struct rb_node rb_node_t;
+
+// It returns -1, 0 or 1 if the first node is less than, equal to or greater than the second.
+// Equal nodes are allowed - a new node is inserted after all equal ones.
+typedef int32 (*rb_comparator_t)(rb_node_t*, rb_node_t*);
+
+struct rb_tree {
+  rb_node_t* root;
+  uint32 size;
+  rb_comparator_t comparator;
+};
+typedef struct rb_tree rb_tree_t;
+
+// Get the struct which contains this node.
+#define rb_entry(node, type, member) \
+    ((type*)((uint32)(node) - (uint32)(&((type*)0)->member)))
+
+
+// ****************************************************************************
+void rb_tree_init(rb_tree_t* this, rb_comparator_t comparator);
+
+void rb_tree_insert(rb_tree_t* this, rb_node_t* node);
+void rb_tree_remove(rb_tree_t* this, rb_node_t* node);
+
+// In-order traversal. All return nullptr at the end.
+rb_node_t* rb_tree_first(rb_tree_t* this);
+rb_node_t* rb_tree_last(rb_tree_t* this);
+rb_node_t* rb_tree_next(rb_node_t* node);
+rb_node_t* rb_tree_prev(rb_node_t* node);
+
+
+// ******************************** unit tests **********************************
+void rb_tree_test();
+
+#endif
@@ -30,4 +30,14 @@ void destroy_str_array(uint32 num, char* str_array[]) {
     kfree(str_array[i]);
   }
   kfree(str_array);
-}
\ No newline at end of file
+}
+
+uint32 str_hash(char* str) {
+  uint32 hash = 2166136261u;
+  while (*str != '\0') {
+    hash ^= (uint8)(*str);
+    hash *= 16777619u;
+    str++;
+  }
+  return hash;
+}
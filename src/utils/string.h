@@ -9,4 +9,7 @@ char** copy_str_array(uint32 num, char* str_array[]);
 // Release a char* array created by copy_str_array.
 void destroy_str_array(uint32 num, char* str_array[]);
 
+// FNV-1a hash of a string.
+uint32 str_hash(char* str);
+
 #endif
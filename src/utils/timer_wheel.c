@@ -0,0 +1,209 @@
+#include "monitor/monitor.h"
+#include "utils/debug.h"
+#include "utils/timer_wheel.h"
+
+void timer_wheel_init(timer_wheel_t* this, uint32 now) {
+  this->now = now;
+  this->size = 0;
+  for (uint32 i = 0; i < TIMER_WHEEL_LEVELS; i++) {
+    for (uint32 j = 0; j < TIMER_WHEEL_SLOTS; j++) {
+      linked_list_init(&this->slots[i][j]);
+    }
+  }
+}
+
+// ticks wrap around, so compare by difference.
+static bool tick_before(uint32 tick1, uint32 tick2) {
+  return (int32)(tick1 - tick2) < 0;
+}
+
+// Put event in the slot of its expiry, at the lowest level its timeout fits in. An event due
+// at the tick being processed goes to the current slot of level 0.
+static void insert_event(timer_wheel_t* this, timer_event_t* event) {
+  uint32 timeout = event->expires - this->now;
+  if ((int32)timeout < 0) {
+    timeout = 0;
+    event->expires = this->now;
+  } else if (timeout > TIMER_WHEEL_MAX_TIMEOUT) {
+    timeout = TIMER_WHEEL_MAX_TIMEOUT;
+    event->expires = this->now + TIMER_WHEEL_MAX_TIMEOUT;
+  }
+
+  uint32 level = 0;
+  while (level < TIMER_WHEEL_LEVELS - 1 &&
+         timeout >= (1 << ((level + 1) * TIMER_WHEEL_SLOT_BITS))) {
+    level++;
+  }
+  uint32 index = (event->expires >> (level * TIMER_WHEEL_SLOT_BITS)) & TIMER_WHEEL_SLOT_MASK;
+
+  event->node.ptr = event;
+  event->slot = &this->slots[level][index];
+  linked_list_append(event->slot, &event->node);
+}
+
+void timer_wheel_add(timer_wheel_t* this, timer_event_t* event) {
+  if (!tick_before(this->now, event->expires)) {
+    event->expires = this->now + 1;
+  }
+  insert_event(this, event);
+  this->size++;
+}
+
+void timer_wheel_remove(timer_wheel_t* this, timer_event_t* event) {
+  linked_list_remove(event->slot, &event->node);
+  event->slot = nullptr;
+  this->size--;
+}
+
+// Re-insert events of a slot - they all fit in lower levels now.
+static void cascade(timer_wheel_t* this, uint32 level) {
+  uint32 index = (this->now >> (level * TIMER_WHEEL_SLOT_BITS)) & TIMER_WHEEL_SLOT_MASK;
+  linked_list_t events;
+  linked_list_move(&events, &this->slots[level][index]);
+  while (events.size > 0) {
+    linked_list_node_t* head = events.head;
+    linked_list_remove(&events, head);
+    insert_event(this, (timer_event_t*)head->ptr);
+  }
+}
+
+static void process_tick(timer_wheel_t* this, linked_list_t* expired) {
+  this->now++;
+
+  // Each time a level wraps around, the current slot of the next level is moved down.
+  for (uint32 level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+    uint32 lower_bits = level * TIMER_WHEEL_SLOT_BITS;
+    if ((this->now & ((1 << lower_bits) - 1)) != 0) {
+      break;
+    }
+    cascade(this, level);
+  }
+
+  linked_list_t* slot = &this->slots[0][this->now & TIMER_WHEEL_SLOT_MASK];
+  while (slot->size > 0) {
+    linked_list_node_t* head = slot->head;
+    linked_list_remove(slot, head);
+    ((timer_event_t*)head->ptr)->slot = nullptr;
+    linked_list_append(expired, head);
+    this->size--;
+  }
+}
+
+void timer_wheel_advance(timer_wheel_t* this, uint32 now, linked_list_t* expired) {
+  while (tick_before(this->now, now)) {
+    if (this->size == 0) {
+      // Nothing to expire - skip to now.
+      this->now = now;
+      break;
+    }
+    process_tick(this, expired);
+  }
+}
+
+// Slots of each level are in order of time, starting right after the current one. So the
+// earliest event is in the first non-empty slot of some level.
+bool timer_wheel_next_expiry(timer_wheel_t* this, uint32* expires) {
+  if (this->size == 0) {
+    return false;
+  }
+
+  bool found = false;
+  for (uint32 level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+    uint32 crt_index = (this->now >> (level * TIMER_WHEEL_SLOT_BITS)) & TIMER_WHEEL_SLOT_MASK;
+    for (uint32 i = 1; i <= TIMER_WHEEL_SLOTS; i++) {
+      linked_list_t* slot = &this->slots[level][(crt_index + i) & TIMER_WHEEL_SLOT_MASK];
+      if (slot->size == 0) {
+        continue;
+      }
+      for (linked_list_node_t* node = slot->head; node != nullptr; node = node->next) {
+        timer_event_t* event = (timer_event_t*)node->ptr;
+        if (!found || tick_before(event->expires, *expires)) {
+          *expires = event->expires;
+          found = true;
+        }
+      }
+      break;
+    }
+  }
+  return found;
+}
+
+
+// ******************************** unit tests **********************************
+static uint32 timer_test_fired;
+
+static void timer_test_callback(timer_event_t* event) {
+  timer_test_fired++;
+}
+
+// Advance a tick at a time, and check every event expires exactly at its tick.
+static void timer_test_run(timer_wheel_t* wheel, uint32 until) {
+  while (tick_before(wheel->now, until)) {
+    uint32 next;
+    bool has_next = timer_wheel_next_expiry(wheel, &next);
+    ASSERT(has_next == (wheel->size > 0));
+
+    linked_list_t expired;
+    linked_list_init(&expired);
+    timer_wheel_advance(wheel, wheel->now + 1, &expired);
+    if (expired.size > 0) {
+      ASSERT(has_next && next == wheel->now);
+    }
+    for (linked_list_node_t* node = expired.head; node != nullptr; node = node->next) {
+      timer_event_t* event = (timer_event_t*)node->ptr;
+      ASSERT(event->expires == wheel->now);
+      event->callback(event);
+    }
+  }
+}
+
+void timer_wheel_test() {
+  monitor_print("timer wheel test ... ");
+
+  // Start near wrap around of tick counter.
+  uint32 start = 0xFFFFFFFF - 5000;
+  timer_wheel_t wheel;
+  timer_wheel_init(&wheel, start);
+
+  uint32 num = 100;
+  timer_event_t events[num];
+  for (uint32 i = 0; i < num; i++) {
+    // Timeouts spread over the first three levels.
+    events[i].expires = start + 1 + (i * 97) % 9000;
+    events[i].callback = timer_test_callback;
+    timer_wheel_add(&wheel, &events[i]);
+  }
+  ASSERT(wheel.size == num);
+
+  // Remove every fourth event.
+  for (uint32 i = 0; i < num; i += 4) {
+    timer_wheel_remove(&wheel, &events[i]);
+  }
+  ASSERT(wheel.size == num - num / 4);
+
+  timer_test_fired = 0;
+  timer_test_run(&wheel, start + 9001);
+  ASSERT(timer_test_fired == num - num / 4);
+  ASSERT(wheel.size == 0);
+
+  // Event already due expires at next tick, and a too long timeout is clamped.
+  timer_event_t due = {.expires = wheel.now - 10, .callback = timer_test_callback};
+  timer_wheel_add(&wheel, &due);
+  ASSERT(due.expires == wheel.now + 1);
+  timer_event_t far = {.expires = wheel.now + TIMER_WHEEL_MAX_TIMEOUT + 100,
+                       .callback = timer_test_callback};
+  timer_wheel_add(&wheel, &far);
+  ASSERT(far.expires == wheel.now + TIMER_WHEEL_MAX_TIMEOUT);
+
+  // Jump over a long idle period at once.
+  linked_list_t expired;
+  linked_list_init(&expired);
+  timer_wheel_advance(&wheel, wheel.now + 10000, &expired);
+  ASSERT(expired.size == 1 && expired.head->ptr == &due);
+  uint32 next;
+  ASSERT(timer_wheel_next_expiry(&wheel, &next) && next == far.expires);
+  timer_wheel_remove(&wheel, &far);
+  ASSERT(!timer_wheel_next_expiry(&wheel, &next));
+
+  monitor_print_with_color("OK\n", COLOR_GREEN);
+}
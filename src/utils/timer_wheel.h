@@ -0,0 +1,61 @@
+#ifndef UTILS_TIMER_WHEEL_H
+#define UTILS_TIMER_WHEEL_H
+
+#include "common/common.h"
+#include "utils/linked_list.h"
+
+// Hierarchical timer wheel: level 0 has a slot for each of the next 64 ticks, and each higher
+// level has slots 64 times as wide. An event is put at the level its timeout fits in, and moved
+// down a level each time the lower level wraps around - so add and remove are O(1), and each
+// event is moved at most TIMER_WHEEL_LEVELS - 1 times.
+#define TIMER_WHEEL_LEVELS       4
+#define TIMER_WHEEL_SLOT_BITS    6
+#define TIMER_WHEEL_SLOTS        (1 << TIMER_WHEEL_SLOT_BITS)
+#define TIMER_WHEEL_SLOT_MASK    (TIMER_WHEEL_SLOTS - 1)
+
+// Longest timeout in ticks - later events are clamped to it.
+#define TIMER_WHEEL_MAX_TIMEOUT  ((1 << (TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOT_BITS)) - 1)
+
+struct timer_event;
+typedef void (*timer_callback_t)(struct timer_event*);
+
+struct timer_event {
+  // tick it expires at
+  uint32 expires;
+  timer_callback_t callback;
+  void* data;
+
+  // node in the slot it is in, or in the expired list
+  linked_list_node_t node;
+  linked_list_t* slot;
+};
+typedef struct timer_event timer_event_t;
+
+struct timer_wheel {
+  // last tick processed
+  uint32 now;
+  uint32 size;
+  linked_list_t slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+};
+typedef struct timer_wheel timer_wheel_t;
+
+
+// ****************************************************************************
+void timer_wheel_init(timer_wheel_t* this, uint32 now);
+
+// An event which is already due expires at the next tick.
+void timer_wheel_add(timer_wheel_t* this, timer_event_t* event);
+void timer_wheel_remove(timer_wheel_t* this, timer_event_t* event);
+
+// Process ticks up to now, and move events expired to a list. They are removed from the wheel,
+// and their callbacks are left to caller.
+void timer_wheel_advance(timer_wheel_t* this, uint32 now, linked_list_t* expired);
+
+// Get the tick the earliest event expires at. Return false if the wheel is empty.
+bool timer_wheel_next_expiry(timer_wheel_t* this, uint32* expires);
+
+
+// ******************************** unit tests **********************************
+void timer_wheel_test();
+
+#endif
@@ -4,6 +4,12 @@
 #include <dirent.h>
 #include <sys/stat.h>
 
+// Log region of naive fs, for file writes. It is the data of a hidden meta entry, placed last
+// and aligned to sector, and must be zeroed.
+#define LOG_FILENAME  ".naive_log"
+#define LOG_SIZE      (512 * 1024)
+#define SECTOR_SIZE   512
+
 int main(int argc, char* argv[]) {
   char* dir_path = "./progs";
   if (argc > 1) {
@@ -46,10 +52,11 @@ int main(int argc, char* argv[]) {
     exit(1);
   }
 
-  fwrite((const void*)&num, sizeof(int), 1, image_file);
+  int meta_num = num + 1;
+  fwrite((const void*)&meta_num, sizeof(int), 1, image_file);
   char char_end = '\0';
 
-  int data_offset = sizeof(int) + num * (64 + sizeof(int) + sizeof(int));
+  int data_offset = sizeof(int) + meta_num * (64 + sizeof(int) + sizeof(int));
   int file_size[num];
   int file_data_offsets[num];
 
@@ -76,6 +83,16 @@ int main(int argc, char* argv[]) {
     data_offset += size;
   }
 
+  // Log meta.
+  int log_offset = (data_offset + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE;
+  int log_size = LOG_SIZE;
+  fwrite((const void*)LOG_FILENAME, sizeof(char), strlen(LOG_FILENAME), image_file);
+  for (int j = 0; j < 64 - strlen(LOG_FILENAME); j++) {
+    fwrite((const void*)&char_end, sizeof(char), 1, image_file);
+  }
+  fwrite((const void*)&log_size, sizeof(int), 1, image_file);
+  fwrite((const void*)&log_offset, sizeof(int), 1, image_file);
+
   // Write file data.
   for (int i = 0; i < num; i++) {
     char* file_path = file_paths[i];
@@ -94,6 +111,11 @@ int main(int argc, char* argv[]) {
     fclose(prog_file);
   }
 
+  // Zeroed log region.
+  char* zeros = (char*)calloc(1, log_offset - data_offset + LOG_SIZE);
+  fwrite(zeros, 1, log_offset - data_offset + LOG_SIZE, image_file);
+  free(zeros);
+
   // Close.
   fclose(image_file);
 
@@ -105,8 +127,8 @@ int main(int argc, char* argv[]) {
   }
   int file_num;
   fread(&file_num, sizeof(int), 1, image_file);
-  printf("disk image has %d files\n", file_num);
-  for (int i = 0; i < file_num; i++) {
+  printf("disk image has %d files\n", file_num - 1);
+  for (int i = 0; i < file_num - 1; i++) {
     fseek(image_file, 4 + i * (64 + sizeof(int) + sizeof(int)), SEEK_SET);
 
     char filename[64];
@@ -3,6 +3,8 @@
 #include "syscall/syscall.h"
 #include "fs/file.h"
 
+#define READ_BUFFER_SIZE  1024
+
 int main(uint32 argc, char* argv[]) {
   if (argc != 2) {
     printf("Usage: cat filename\n");
@@ -11,20 +13,24 @@ int main(uint32 argc, char* argv[]) {
 
   char* path = argv[1];
 
-  file_stat_t file_stat;
-  if (stat(path, &file_stat) != 0) {
+  int32 fd = open(path);
+  if (fd < 0) {
     printf("Could not find file \"%s\"\n", path);
     return -1;
   }
 
-  uint32 size = file_stat.size;
-  char read_buffer[size + 1];
-  if (read(path, read_buffer, 0, size) != size) {
+  // Stream the file in chunks - the path is resolved only once on open.
+  char read_buffer[READ_BUFFER_SIZE + 1];
+  int32 read_size;
+  while ((read_size = read(fd, read_buffer, READ_BUFFER_SIZE)) > 0) {
+    read_buffer[read_size] = '\0';
+    printf("%s", read_buffer);
+  }
+  close(fd);
+
+  if (read_size < 0) {
     printf("Failed to read file \"%s\"\n", path);
     return -1;
   }
-  read_buffer[size] = '\0';
-
-  printf("%s", read_buffer);
   return 0;
 }
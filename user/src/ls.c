@@ -4,6 +4,13 @@
 #include "fs/file.h"
 
 int main(uint32 argc, char* argv[]) {
-  listdir(".");
+  char* dir = ".";
+  if (argc > 1) {
+    dir = argv[1];
+  }
+  if (listdir(dir) != 0) {
+    printf("Could not list directory \"%s\"\n", dir);
+    return -1;
+  }
   return 0;
 }
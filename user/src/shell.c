@@ -70,20 +70,13 @@ static int32 run_program() {
   //  printf("%s\n", args[i]);
   //}
 
-  int32 pid = fork();
-  if (pid < 0) {
-    printf("fork failed");
-  } else if (pid > 0) {
-    // parent
+  // Spawn child directly from the program, without copying shell's address space.
+  int32 pid = spawn(program, args_index, (char**)args);
+  if (pid > 0) {
     //printf("created child process %d\n", pid);
     int32 status;
     wait(pid, &status);
     //printf("child process %d exit with code %d\n", pid, status);
-  } else {
-    // child
-    //printf("child process started\n");
-    int32 ret = exec(program, args_index, (char**)args);
-    exit(ret);
   }
 }
 